@@ -60,44 +60,113 @@ class CoreExport BanCacheHit
 		this->IP = ip;
 		this->Expiry = ServerInstance->Time() + seconds;
 	}
+
+ private:
+	/** The binary address this hit is hashed under */
+	irc::sockets::cidr_mask key;
+	/** Position of this hit in the manager's recently used list */
+	std::list<BanCacheHit*>::iterator lrupos;
+	/** The generation counter this hit was cached under */
+	const unsigned long* counter;
+	/** Value of *counter when this hit was cached; the hit is stale once they differ */
+	unsigned long generation;
+
+	friend class BanCacheManager;
+};
+
+/** Hashes a full length cidr_mask, for keying the ban cache on the binary address
+ * rather than its textual form.
+ */
+struct CoreExport BanCacheKeyHash
+{
+	size_t operator()(const irc::sockets::cidr_mask& key) const;
 };
 
 /* A container of ban cache items.
  * must be defined after class BanCacheHit.
  */
-typedef nspace::hash_map<std::string, BanCacheHit*, nspace::hash<std::string> > BanCacheHash;
+typedef nspace::hash_map<irc::sockets::cidr_mask, BanCacheHit*, BanCacheKeyHash> BanCacheHash;
 
 /** A manager for ban cache, which allocates and deallocates and checks cached bans.
+ * The cache holds at most <performance:bancachesize> hits; once full, the hit that
+ * was least recently added or looked up is evicted to make room for a new one, so
+ * a connection flood from many addresses cannot grow it without limit.
  */
 class CoreExport BanCacheManager
 {
  private:
 	BanCacheHash* BanHash;
+
+	/** Every hit in the cache, most recently used first */
+	std::list<BanCacheHit*> lru;
+
+	/** Bumped whenever an X-line of any type is added, staling every negative hit */
+	unsigned long negativegen;
+
+	/** Bumped per type whenever an X-line of that type is removed, staling the positive hits of that type.
+	 * Hits point at the counters, so entries are never erased from here.
+	 */
+	std::map<std::string, unsigned long> positivegens;
+
+	/** Unlinks a hit from the hash and the recently used list and deletes it */
+	void Erase(BanCacheHit* b);
+
+	/** Returns true if the hit has expired or been invalidated by RemoveEntries() */
+	bool IsStale(BanCacheHit* b) const
+	{
+		return (*b->counter != b->generation) || (ServerInstance->Time() > b->Expiry);
+	}
+
  public:
+	/** Number of lookups which found a live hit */
+	unsigned long Hits;
+	/** Number of lookups which found nothing, or only an expired or invalidated hit */
+	unsigned long Misses;
+	/** Number of hits evicted to keep the cache within its size limit */
+	unsigned long Evictions;
 
 	/** Creates and adds a Ban Cache item.
-	 * @param ip The IP the item is for.
+	 * @param sa The address the item is for.
 	 * @param type The type of ban cache item. std::string. .empty() means it's a negative match (user is allowed freely).
 	 * @param reason The reason for the ban. Left .empty() if it's a negative match.
+	 * @param seconds The number of seconds before the item expires.
+	 * @return The new item, or NULL if the address already has a live one or can't be cached.
+	 */
+	BanCacheHit *AddHit(const irc::sockets::sockaddrs& sa, const std::string &type, const std::string &reason, time_t seconds = 86400);
+
+	/** Creates and adds a Ban Cache item for a textual IP. See the sockaddrs version above.
 	 */
 	BanCacheHit *AddHit(const std::string &ip, const std::string &type, const std::string &reason);
 
 	// Overridden to allow an optional number of seconds before expiry
 	BanCacheHit *AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds);
+
+	/** Looks up the Ban Cache item for an address, marking it as recently used.
+	 * @param sa The address to look up.
+	 * @return The item, or NULL if there is none or it has expired or been invalidated.
+	 */
+	BanCacheHit *GetHit(const irc::sockets::sockaddrs& sa);
 	BanCacheHit *GetHit(const std::string &ip);
 	bool RemoveHit(BanCacheHit *b);
 
-	/** Removes all entries of a given type, either positive or negative. Returns the number of hits removed.
-	 * @param type The type of bancache entries to remove (e.g. 'G')
+	/** Invalidates all entries of a given type, either positive or negative.
+	 * This only bumps a generation counter; the invalidated hits are dropped when
+	 * they are next looked up, replaced or evicted.
+	 * @param type The type of bancache entries to remove (e.g. 'G'). Ignored when removing negative hits.
 	 * @param positive Remove either positive (true) or negative (false) hits.
 	 */
-	unsigned int RemoveEntries(const std::string &type, bool positive);
+	void RemoveEntries(const std::string &type, bool positive);
 
-	BanCacheManager()
+	/** Returns the number of hits currently cached */
+	size_t Size() const { return BanHash->size(); }
+
+	BanCacheManager() : negativegen(0), Hits(0), Misses(0), Evictions(0)
 	{
 		this->BanHash = new BanCacheHash();
 	}
 	~BanCacheManager();
+
+	/** Drops every expired or invalidated hit from the cache at once */
 	void RehashCache();
 };
 
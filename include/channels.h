@@ -52,6 +52,69 @@ class BanItem : public HostItem
 {
 };
 
+/** The bans of one type set on a channel, either the plain nick!ident\@host
+ * bans or the extbans of one letter, sorted by the shape of their host part so
+ * that checking a user does not mean glob matching every mask. Masks with no
+ * wildcards in their host are found by looking up the user's host, displayed
+ * host and IP in a hash, CIDR masks by walking a trie with the user's address,
+ * and only the rest are glob matched in turn.
+ */
+class CoreExport BanIndex
+{
+ public:
+	/** A mask split at its '\@' */
+	struct Entry
+	{
+		std::string nickident;
+		std::string host;
+	};
+
+#ifdef HASHMAP_DEPRECATED
+	typedef nspace::hash_map<std::string, std::vector<std::string>, nspace::insensitive, irc::StrHashComp> ExactMap;
+#else
+	typedef nspace::hash_map<std::string, std::vector<std::string>, nspace::hash<std::string>, irc::StrHashComp> ExactMap;
+#endif
+
+ private:
+	/** nick!ident patterns of the masks with no wildcards in their host, by host */
+	ExactMap exact;
+
+	/** nick!ident patterns of the masks whose host is a CIDR range */
+	irc::sockets::cidr_trie<std::string> cidrs;
+
+	/** Masks with wildcards in their host */
+	std::vector<Entry> globs;
+
+	/** Check the nick!ident patterns stored under one host */
+	bool MatchExact(const std::string& nickident, const std::string& host) const;
+
+	BanIndex(const BanIndex&);
+	BanIndex& operator=(const BanIndex&);
+
+ public:
+	/** Every mask of this type, with any extban prefix removed, for passing to
+	 * the OnCheckBan hook
+	 */
+	std::vector<std::string> masks;
+
+	/** Value of Channel::banversion when the index was built */
+	unsigned long version;
+
+	BanIndex() : version(0) { }
+
+	/** Rebuild the index from a ban list
+	 * @param bans The ban list
+	 * @param type The extban letter to index, or 0 for plain bans
+	 */
+	void Build(const BanList& bans, char type);
+
+	/** Check a user against the indexed masks the same way as the core part
+	 * of Channel::CheckBan, without calling any hooks
+	 * @return True if any mask matches
+	 */
+	bool Match(User* user) const;
+};
+
 /** Holds all relevent information for a channel.
  * This class represents a channel, and contains its name, modes, topic, topic set time,
  * etc, and an instance of the BanList type.
@@ -70,6 +133,36 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	int maxbans;
 
+	/** Incremented whenever a list mode on the channel changes, see
+	 * Membership::bancacheversion and BanIndex::version
+	 */
+	unsigned long banversion;
+
+	/** Get a member with their cached ban results, discarding the results if
+	 * they are out of date
+	 * @param user The user to look up
+	 * @return The user's membership, or NULL if they are not on the channel
+	 */
+	Membership* GetBanCache(User* user);
+
+	/** Ban indexes by extban letter (0 for plain bans), built on first use
+	 * and rebuilt when banversion changes
+	 */
+	std::map<char, BanIndex*> banindexes;
+
+	/** Get the up to date index of one type of ban
+	 * @param type The extban letter, or 0 for plain bans
+	 */
+	BanIndex* GetBanIndex(char type);
+
+	/** Check a user against one type of ban, calling the OnCheckBan hook for
+	 * each mask and using the index for the core match
+	 * @param user The user to check
+	 * @param type The extban letter, or 0 for plain bans
+	 * @return True if any ban of the type matches
+	 */
+	bool CheckBans(User* user, char type);
+
 	/** Modes for the channel.
 	 * This is not a null terminated string! It is a bitset where
 	 * each item in it represents if a mode is set. For example
@@ -83,12 +176,35 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	CustomModeList custom_mode_params;
 
+	/** Memberships of the local users on the channel, packed together so that
+	 * writing to the channel never has to visit remote members.
+	 * Maintained by AddUser and DelUser alongside userlist.
+	 */
+	LocalMembList localmembers;
+
+	/** Memberships of the local users on the channel which hold at least one
+	 * prefix mode, so that status messages (e.g. to \@\#chan) only visit
+	 * members who may have the required rank.
+	 * Maintained by SetPrefix, RemoveAllPrefixes and DelUser.
+	 */
+	LocalMembList localprefixed;
+
+	/** Add a local membership to, or remove it from, localprefixed
+	 * according to whether it currently holds any prefix modes
+	 * @param memb The membership whose prefix modes have changed
+	 */
+	void UpdatePrefixed(Membership* memb);
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @throw Nothing at present.
 	 */
 	Channel(const std::string &name, time_t ts);
 
+	/** Frees the ban indexes
+	 */
+	~Channel();
+
 	/** The channel's name.
 	 */
 	std::string name;
@@ -198,6 +314,19 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	const UserMembList* GetUsers();
 
+	/** Obtain the memberships of the local users on this channel.
+	 * The order of the list is unspecified and changes as users join and part;
+	 * it should be considered readonly and only modified via AddUser and DelUser.
+	 * @return The packed list of local memberships
+	 */
+	inline const LocalMembList& GetLocalMembers() const { return localmembers; }
+
+	/** Obtain the memberships of the local users on this channel which hold
+	 * at least one prefix mode. Like GetLocalMembers(), the order is unspecified.
+	 * @return The packed list of local memberships with a prefix mode
+	 */
+	inline const LocalMembList& GetLocalPrefixedMembers() const { return localprefixed; }
+
 	/** Returns true if the user given is on the given channel.
 	 * @param user The user to look for
 	 * @return True if the user is on this channel
@@ -392,6 +521,18 @@ class CoreExport Channel : public Extensible, public InviteBase
 	/** Clears the cached max bans value
 	 */
 	void ResetMaxBans();
+
+	/** Discard the results of ban checks cached for the members of this channel.
+	 * This is done whenever a list mode changes; modules providing extbans
+	 * which match on channel state other than list modes should call it when
+	 * that changes.
+	 */
+	inline void InvalidateBanCache() { banversion++; }
+
+	/** Discard the results of all cached ban checks. This is done on rehash
+	 * and when a module is loaded or unloaded.
+	 */
+	static void InvalidateAllBanCaches();
 };
 
 #endif
@@ -44,6 +44,20 @@ class CoreExport CommandParser
 	 */
 	bool ProcessCommand(LocalUser *user, std::string &cmd);
 
+	/** Number of entries in cmdcache */
+	static const unsigned int CMDCACHE_SIZE = 256;
+
+	/** Direct-mapped cache of recently used commands, to save looking
+	 * frequent commands up in cmdlist every time
+	 */
+	Command* cmdcache[CMDCACHE_SIZE];
+
+	/** Find a command for ProcessCommand(), through the cache
+	 * @param commandname The command to find, in uppercase
+	 * @return The command, or NULL if it does not exist
+	 */
+	Command* FindCommand(const std::string& commandname);
+
  public:
 	/** Command list, a hash_map of command names to Command*
 	 */
@@ -152,6 +152,16 @@ class CoreExport OperInfo : public refcountbase
 	std::set<std::string> AllowedOperCommands;
 	std::set<std::string> AllowedPrivs;
 
+	/** AllowedOperCommands and AllowedPrivs as bitmaps indexed by the ids
+	 * from PermissionRegistry. These are filled in by init().
+	 */
+	std::vector<bool> CommandBits;
+	std::vector<bool> PrivBits;
+
+	/** True if AllowedOperCommands or AllowedPrivs contain "*" */
+	bool AllCommands;
+	bool AllPrivs;
+
 	/** Allowed user modes from oper classes. */
 	std::bitset<64> AllowedUserModes;
 
@@ -171,6 +181,20 @@ class CoreExport OperInfo : public refcountbase
 	std::string getConfig(const std::string& key);
 	void init();
 
+	OperInfo() : AllCommands(false), AllPrivs(false) { }
+
+	/** Check for a command by its id from PermissionRegistry */
+	inline bool HasCommand(unsigned int id) const
+	{
+		return AllCommands || (id < CommandBits.size() && CommandBits[id]);
+	}
+
+	/** Check for a privilege by its id from PermissionRegistry */
+	inline bool HasPriv(unsigned int id) const
+	{
+		return AllPrivs || (id < PrivBits.size() && PrivBits[id]);
+	}
+
 	inline const char* NameStr()
 	{
 		return irc::Spacify(name.c_str());
@@ -393,6 +417,12 @@ class CoreExport ServerConfig
 	 */
 	int NetBufferSize;
 
+	/** The maximum number of addresses held in the ban
+	 * cache before the least recently used are evicted.
+	 * Zero disables the ban cache.
+	 */
+	unsigned int BanCacheSize;
+
 	/** The value to be used for listen() backlogs
 	 * as default.
 	 */
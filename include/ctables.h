@@ -155,6 +155,10 @@ class CoreExport Command : public ServiceProvider
 	 */
 	int Penalty;
 
+	/** The id of the command's name in PermissionRegistry
+	 */
+	const unsigned int permid;
+
 	/** Create a new command.
 	 * @param me The module which created this command.
 	 * @param cmd Command name. This must be UPPER CASE.
@@ -162,12 +166,7 @@ class CoreExport Command : public ServiceProvider
 	 * @param maxpara Maximum number of parameters this command may have - extra parameters
 	 * will be tossed into one last space-seperated param.
 	 */
-	Command(Module* me, const std::string &cmd, int minpara = 0, int maxpara = 0) :
-		ServiceProvider(me, cmd, SERVICE_COMMAND), flags_needed(0), min_params(minpara), max_params(maxpara),
-		use_count(0), total_bytes(0), disabled(false), works_before_reg(false), allow_empty_last_param(true),
-		Penalty(1)
-	{
-	}
+	Command(Module* me, const std::string &cmd, int minpara = 0, int maxpara = 0);
 
 	/** Handle the command from a user.
 	 * @param parameters The parameters for the command.
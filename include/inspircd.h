@@ -80,6 +80,7 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "extensible.h"
 #include "numerics.h"
 #include "uid.h"
+#include "uidtable.h"
 #include "users.h"
 #include "channels.h"
 #include "timer.h"
@@ -302,10 +303,6 @@ class CoreExport InspIRCd
 	 */
 	void IncrementUID(int pos);
 
-	/** Perform background user events such as PING checks
-	 */
-	void DoBackgroundUserStuff();
-
 	/** Returns true when all modules have done pre-registration checks on a user
 	 * @param user The user to verify
 	 * @return True if all modules have finished checking this user
@@ -873,6 +870,7 @@ class CoreExport InspIRCd
 	}
 
 	friend class TestSuite;
+	friend class UserDeadlineTimer;
 };
 
 ENTRYPOINT;
@@ -69,6 +69,21 @@ enum BufferedSocketError
 /* Required forward declarations */
 class BufferedSocket;
 
+/** A block of data which is ready to be written to one or more sockets.
+ * The data is immutable once built, and is reference counted, so the same
+ * buffer can be placed on the sendq of any number of StreamSockets without
+ * being copied for each of them.
+ */
+class CoreExport SendQBuffer : public refcountbase
+{
+ public:
+	/** The data to send */
+	const std::string data;
+
+	SendQBuffer(const std::string& text) : data(text) {}
+	SendQBuffer(const char* text, size_t len) : data(text, len) {}
+};
+
 /** Used to time out socket connections
  */
 class CoreExport SocketTimeout : public Timer
@@ -104,9 +119,21 @@ class CoreExport StreamSocket : public EventHandler
 {
 	/** Module that handles raw I/O for this socket, or NULL */
 	reference<Module> IOHook;
-	/** Private send queue. Note that individual strings may be shared
+	/** An entry in the send queue: a (possibly shared) buffer, and
+	 * how much of that buffer has already been written out
 	 */
-	std::deque<std::string> sendq;
+	struct SendQElement
+	{
+		reference<SendQBuffer> buf;
+		size_t pos;
+		SendQElement(SendQBuffer* b) : buf(b), pos(0) {}
+		inline const char* data() const { return buf->data.data() + pos; }
+		inline size_t length() const { return buf->data.length() - pos; }
+	};
+	/** Private send queue. Note that individual buffers may be shared
+	 * with the sendqs of other sockets, and must never be modified.
+	 */
+	std::deque<SendQElement> sendq;
 	/** Length, in bytes, of the sendq */
 	size_t sendq_len;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
@@ -141,6 +168,10 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+	/** Queue a prebuilt buffer on the socket, either now or when writes unblock.
+	 * The buffer is not copied; it may be queued on any number of sockets.
+	 */
+	void WriteData(const reference<SendQBuffer>& data);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
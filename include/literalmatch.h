@@ -0,0 +1,120 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef LITERALMATCH_H
+#define LITERALMATCH_H
+
+/** Finds which of a set of literal strings occur in a text in a single pass
+ * over it (an Aho-Corasick automaton), ignoring ASCII case.
+ *
+ * This is meant as a prefilter for sets of patterns: every pattern that can
+ * only match a text containing some literal is added under that literal, and
+ * only the patterns whose literal was found need to be evaluated in full.
+ * The literals returned by GlobLiteral() and RegexLiteral() never contain
+ * characters which any casemapping folds other than A-Z, so they are safe to
+ * use whatever casemapping the pattern engine uses.
+ */
+class CoreExport LiteralMatcher
+{
+	static const unsigned int npos = static_cast<unsigned int>(-1);
+
+	struct Node
+	{
+		/** Edges as (folded character, node index) pairs */
+		std::vector<std::pair<unsigned char, unsigned int> > next;
+		/** Node for the longest proper suffix of this node's string which is also in the trie */
+		unsigned int fail;
+		/** Nearest node along the fail chain which ends a literal, or 0 */
+		unsigned int output;
+		/** Ids of the literals ending at this node */
+		std::vector<unsigned int> ids;
+
+		Node() : fail(0), output(0) { }
+	};
+
+	/** The trie; node 0 is the root */
+	std::vector<Node> nodes;
+
+	/** Returns the child of a node for a folded character, or npos */
+	unsigned int Child(unsigned int node, unsigned char c) const
+	{
+		const std::vector<std::pair<unsigned char, unsigned int> >& next = nodes[node].next;
+		for (std::vector<std::pair<unsigned char, unsigned int> >::const_iterator i = next.begin(); i != next.end(); ++i)
+			if (i->first == c)
+				return i->second;
+		return npos;
+	}
+
+ public:
+	LiteralMatcher() : nodes(1) { }
+
+	/** Returns true if c may appear in a literal; see the class comment */
+	static bool IsLiteralChar(unsigned char c);
+
+	/** Returns the longest literal that every text matched by a glob pattern
+	 * (as used by InspIRCd::Match) must contain, or an empty string if none.
+	 */
+	static std::string GlobLiteral(const std::string& glob);
+
+	/** Returns the longest literal that every text matched by a regular
+	 * expression must contain, or an empty string if none could be found.
+	 * This understands enough of PCRE, POSIX basic and extended and ECMAScript
+	 * syntax to be conservative with all of them: anything it is unsure of is
+	 * left out of the literal, and patterns using alternation at the top level
+	 * or extended mode yield no literal at all.
+	 */
+	static std::string RegexLiteral(const std::string& regex);
+
+	/** Removes every literal */
+	void Clear();
+
+	/** Adds a literal. Compile() must be called before the next Scan().
+	 * @param literal The literal to add, which must not be empty.
+	 * @param id The id passed back by Scan() when the literal is found.
+	 */
+	void Add(const std::string& literal, unsigned int id);
+
+	/** Links up the automaton after literals have been added */
+	void Compile();
+
+	/** Returns true if no literals have been added */
+	bool empty() const { return nodes.size() == 1; }
+
+	/** Finds the literals occurring in a text.
+	 * @param text The text to scan.
+	 * @param found Called with the id of each literal every time it occurs in the text.
+	 */
+	template<typename F>
+	void Scan(const std::string& text, F& found) const
+	{
+		unsigned int state = 0;
+		for (std::string::const_iterator c = text.begin(); c != text.end(); ++c)
+		{
+			unsigned char folded = ascii_case_insensitive_map[static_cast<unsigned char>(*c)];
+			unsigned int next;
+			while ((next = Child(state, folded)) == npos && state)
+				state = nodes[state].fail;
+			state = (next == npos ? 0 : next);
+
+			for (unsigned int o = (nodes[state].ids.empty() ? nodes[state].output : state); o; o = nodes[o].output)
+				for (std::vector<unsigned int>::const_iterator id = nodes[o].ids.begin(); id != nodes[o].ids.end(); ++id)
+					found(*id);
+		}
+	}
+};
+
+#endif
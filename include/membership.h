@@ -27,7 +27,19 @@ class CoreExport Membership : public Extensible
 	Channel* const chan;
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	// position in the channel's LocalMembList, only valid for local users
+	size_t localindex;
+	// position in the channel's list of local members with a prefix mode, or npos
+	size_t prefixedindex;
+	// sum of the global, channel and user ban versions when the ban results
+	// below were cached; each only ever goes up, so any change alters the sum
+	unsigned long bancacheversion;
+	// cached results of Channel::IsBanned (bit 0) and Channel::GetExtBanStatus
+	// (bit type - 'A' + 1): whether the result is cached, and if it was deny or allow
+	std::bitset<64> bancached;
+	std::bitset<64> bandeny;
+	std::bitset<64> banallow;
+	Membership(User* u, Channel* c) : user(u), chan(c), localindex(0), prefixedindex(std::string::npos), bancacheversion(0) {}
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
@@ -1215,7 +1215,9 @@ class CoreExport Module : public classbase, public usecountbase
 	 * Called when a hooked stream has data to write, or when the socket
 	 * engine returns it as writable
 	 * @param sock The socket in question
-	 * @param sendq Data to send to the socket
+	 * @param sendq Data to send to the socket. This is empty if the socket
+	 *  became writable with nothing queued, so the hook can flush any output
+	 *  it has buffered itself.
 	 * @return 1 if the sendq has been completely emptied, 0 if there is
 	 *  still data to send, and -1 if there was an error
 	 */
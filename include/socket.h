@@ -96,6 +96,154 @@ namespace irc
 			std::string str() const;
 		};
 
+		/** A binary trie of CIDR masks, used to find every mask containing an
+		 * address with a single walk down the bits of the address instead of
+		 * testing each mask in turn. Items are stored at the node reached by the
+		 * bits of their mask, so a lookup visits at most 33 (IPv4) or 129 (IPv6)
+		 * nodes however many masks are held.
+		 */
+		template<typename T>
+		class cidr_trie
+		{
+			struct node
+			{
+				node* child[2];
+				std::vector<T> items;
+				node() { child[0] = child[1] = NULL; }
+				~node() { delete child[0]; delete child[1]; }
+			};
+
+			node* root4;
+			node* root6;
+
+			/** Nodes are owned by exactly one trie */
+			cidr_trie(const cidr_trie&);
+			cidr_trie& operator=(const cidr_trie&);
+
+			static inline unsigned int bit(const unsigned char* bits, unsigned int n)
+			{
+				return (bits[n / 8] >> (7 - (n & 7))) & 1;
+			}
+
+		 public:
+			cidr_trie() : root4(NULL), root6(NULL) {}
+			~cidr_trie() { clear(); }
+
+			/** Remove every item */
+			void clear()
+			{
+				delete root4;
+				delete root6;
+				root4 = root6 = NULL;
+			}
+
+			/** @return True if the trie holds no items */
+			bool empty() const { return !root4 && !root6; }
+
+			/** Add an item under a mask
+			 * @param mask The mask, which must be AF_INET or AF_INET6
+			 * @param item The item to store
+			 * @return True if the item was added, false if the mask was of another type
+			 */
+			bool add(const cidr_mask& mask, const T& item)
+			{
+				if (mask.type != AF_INET && mask.type != AF_INET6)
+					return false;
+
+				node** n = (mask.type == AF_INET ? &root4 : &root6);
+				for (unsigned int i = 0; ; i++)
+				{
+					if (!*n)
+						*n = new node;
+					if (i == mask.length)
+						break;
+					n = &(*n)->child[bit(mask.bits, i)];
+				}
+				(*n)->items.push_back(item);
+				return true;
+			}
+
+			/** Remove one copy of an item from a mask, freeing any branch left empty
+			 * @param mask The mask the item was added with
+			 * @param item The item to remove
+			 * @return True if the item was found and removed
+			 */
+			bool remove(const cidr_mask& mask, const T& item)
+			{
+				if (mask.type != AF_INET && mask.type != AF_INET6)
+					return false;
+
+				node** path[129];
+				node** n = (mask.type == AF_INET ? &root4 : &root6);
+				unsigned int depth = 0;
+				for (; *n && depth < mask.length; depth++)
+				{
+					path[depth] = n;
+					n = &(*n)->child[bit(mask.bits, depth)];
+				}
+				if (!*n)
+					return false;
+
+				typename std::vector<T>::iterator i = std::find((*n)->items.begin(), (*n)->items.end(), item);
+				if (i == (*n)->items.end())
+					return false;
+				(*n)->items.erase(i);
+
+				path[depth] = n;
+				for (;;)
+				{
+					node* cur = *path[depth];
+					if (!cur->items.empty() || cur->child[0] || cur->child[1])
+						break;
+					delete cur;
+					*path[depth] = NULL;
+					if (!depth)
+						break;
+					depth--;
+				}
+				return true;
+			}
+
+			/** Pass the items of every mask containing an address to a functor,
+			 * widest mask first, until it returns true
+			 * @param addr The address to look up
+			 * @param func Called as func(item), returns true to stop the search
+			 * @return True if func returned true for any item
+			 */
+			template<typename F>
+			bool find(const sockaddrs& addr, F& func) const
+			{
+				const unsigned char* bits;
+				unsigned int length;
+				const node* n;
+				if (addr.sa.sa_family == AF_INET)
+				{
+					bits = reinterpret_cast<const unsigned char*>(&addr.in4.sin_addr);
+					length = 32;
+					n = root4;
+				}
+				else if (addr.sa.sa_family == AF_INET6)
+				{
+					bits = reinterpret_cast<const unsigned char*>(&addr.in6.sin6_addr);
+					length = 128;
+					n = root6;
+				}
+				else
+					return false;
+
+				for (unsigned int i = 0; n; i++)
+				{
+					for (typename std::vector<T>::const_iterator item = n->items.begin(); item != n->items.end(); ++item)
+						if (func(*item))
+							return true;
+					if (i == length)
+						break;
+					n = n->child[bit(bits, i)];
+				}
+				return false;
+			}
+		};
+
 		/** Match CIDR, including an optional username/nickname part.
 		 *
 		 * This function will compare a human-readable address (plus
@@ -110,6 +258,14 @@ namespace irc
 		 */
 		CoreExport bool MatchCIDR(const std::string &address, const std::string &cidr_mask, bool match_with_username);
 
+		/** Parse a human-readable CIDR mask, checking it is well formed in the
+		 * same way as MatchCIDR does.
+		 * @param text The mask, e.g. 1.2.0.0/16
+		 * @param mask The parsed mask, only set if the mask is well formed
+		 * @return True if the mask is well formed
+		 */
+		CoreExport bool ParseCIDR(const std::string& text, irc::sockets::cidr_mask& mask);
+
 		/** Return the size of the structure for syscall passing */
 		inline int sa_size(const irc::sockets::sockaddrs& sa) { return sa.sa_size(); }
 
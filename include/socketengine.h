@@ -259,6 +259,13 @@ public:
 	unsigned long WriteEvents;
 	unsigned long ErrorEvents;
 
+	/** Number of system calls made to change the events the kernel watches for,
+	 * and the most made in a single mainloop iteration. Only counted by engines
+	 * which batch these changes.
+	 */
+	unsigned long ChangeCalls;
+	unsigned long MaxChangeCalls;
+
 	/** Constructor.
 	 * The constructor transparently initializes
 	 * the socket engine which the ircd is using.
@@ -31,6 +31,13 @@ class TestSuite
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
+	bool DoNeighborTests();
+	bool DoTimerTests();
+	bool DoLineSplitTests();
+	bool DoBanListTests();
+	bool DoXLineIndexTests();
+	bool DoLiteralMatchTests();
+	bool DoUIDTableTests();
 };
 
 #endif
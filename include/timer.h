@@ -38,6 +38,13 @@ class CoreExport Timer
 	/** The triggering time
 	 */
 	time_t trigger;
+	/** Next timer in the same TimerManager wheel slot
+	 */
+	Timer* wheelnext;
+	/** Pointer to the link which points at this timer, or NULL
+	 * if the timer is not currently scheduled
+	 */
+	Timer** wheelprev;
 	/** Number of seconds between triggers
 	 */
 	long secs;
@@ -55,6 +62,8 @@ class CoreExport Timer
 		trigger = now + secs_from_now;
 		secs = secs_from_now;
 		repeat = repeating;
+		wheelnext = NULL;
+		wheelprev = NULL;
 	}
 
 	/** Default destructor, does nothing.
@@ -110,19 +119,63 @@ class CoreExport Timer
 	{
 		repeat = false;
 	}
+
+	friend class TimerManager;
 };
 
 
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel: the first level has one slot
+ * per second for the next 256 seconds, and each further level covers 64 times
+ * the range of the one below it. A timer is placed in the level matching how
+ * far away it is, and is moved down a level each time the level below wraps.
+ * Adding and deleting a timer is therefore O(1), no matter how many timers are
+ * pending, and each second only has to look at the timers due in that second.
  */
 class CoreExport TimerManager
 {
- protected:
-	/** A list of all pending timers
+	/** Number of bits of the trigger time used to index the first level */
+	static const unsigned int ROOT_BITS = 8;
+	/** Number of bits of the trigger time used to index each further level */
+	static const unsigned int LEVEL_BITS = 6;
+	static const unsigned int ROOT_SIZE = 1 << ROOT_BITS;
+	static const unsigned int LEVEL_SIZE = 1 << LEVEL_BITS;
+	/** Number of levels above the first one */
+	static const unsigned int LEVELS = 4;
+
+	/** Slots of the first level, one per second */
+	Timer* root[ROOT_SIZE];
+	/** Slots of the coarser levels */
+	Timer* levels[LEVELS][LEVEL_SIZE];
+
+	/** All timers due before this time have been ticked
+	 */
+	time_t nexttick;
+
+	/** Number of timers currently scheduled
+	 */
+	size_t count;
+
+	/** Link a timer into the slot for its triggering time
+	 */
+	void Schedule(Timer* T);
+
+	/** Unlink a timer from whichever slot it is in
+	 */
+	void Unlink(Timer* T);
+
+	/** Move every timer in a coarse slot down to a finer level.
+	 * @return The index of the slot that was redistributed
+	 */
+	unsigned int Cascade(unsigned int level);
+
+	/** Take every timer out of the wheel and schedule it again relative to a new time.
+	 * Used when the clock has moved in a way the wheel cannot follow one second at a time.
 	 */
-	std::vector<Timer *> Timers;
+	void Rebase(time_t TIME);
 
  public:
 	/** Constructor
@@ -145,9 +198,9 @@ class CoreExport TimerManager
 	 */
 	void DelTimer(Timer* T);
 
-	/** Compares two timers
+	/** Get the number of timers which are waiting to be ticked
 	 */
-	static bool TimerComparison( Timer *one,  Timer*two);
+	size_t GetTimerCount() const { return count; }
 };
 
 #endif
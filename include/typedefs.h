@@ -45,6 +45,7 @@ class ServerConfig;
 class ServerLimits;
 class Thread;
 class User;
+class UserDeadlineTimer;
 class UserResolver;
 class XLine;
 class XLineManager;
@@ -133,6 +134,9 @@ typedef UserMembList::iterator UserMembIter;
 /** const Iterator of UserMembList */
 typedef UserMembList::const_iterator UserMembCIter;
 
+/** Packed list of the memberships of local users on a channel */
+typedef std::vector<Membership*> LocalMembList;
+
 /** Generic user list, used for exceptions */
 typedef std::set<User*> CUList;
 
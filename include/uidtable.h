@@ -0,0 +1,185 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef UIDTABLE_H
+#define UIDTABLE_H
+
+#include <stdint.h>
+
+/** A UUID or SID packed into an integer, 7 bits per character. Every
+ * character of an ID is ASCII and not NUL, so any ID of up to 9 characters
+ * packs into 63 bits, and no ID packs to 0.
+ */
+typedef uint64_t uid_key;
+
+/** Packs a UUID or SID into a uid_key, ignoring ASCII case.
+ * @return The key, or 0 if the string is empty, longer than 9 characters
+ *  (UUID_LENGTH - 1) or contains a character which isn't ASCII or is NUL.
+ */
+inline uid_key PackUID(const char* id, size_t len)
+{
+	if (!len || len > UUID_LENGTH - 1)
+		return 0;
+
+	uid_key key = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned char c = id[i];
+		if (!c || c > 0x7F)
+			return 0;
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		key = (key << 7) | c;
+	}
+	return key;
+}
+
+inline uid_key PackUID(const std::string& id)
+{
+	return PackUID(id.data(), id.length());
+}
+
+/** Maps UUIDs or SIDs to objects, using the packed form of the ID as the key
+ * of an open addressing hash table. This avoids hashing and comparing strings
+ * on lookups, and uses two words per slot instead of a node per entry.
+ */
+template<typename T> class UIDTable
+{
+	struct Slot
+	{
+		uid_key key;
+		T* value;
+	};
+
+	/** The slots, a power of two of them; slots with a key of 0 are empty */
+	std::vector<Slot> slots;
+	/** Number of slots in use */
+	size_t count;
+
+	/** Smallest number of slots the table shrinks to */
+	static const size_t MIN_SLOTS = 64;
+
+	/** Returns the index of the first slot to look in for a key */
+	size_t Home(uid_key key) const
+	{
+		// Mix the bits, as the low bits of a packed UUID vary much less than the key as a whole
+		key ^= key >> 33;
+		key *= (static_cast<uid_key>(0xff51afd7) << 32) | 0xed558ccd;
+		key ^= key >> 33;
+		return static_cast<size_t>(key) & (slots.size() - 1);
+	}
+
+	/** Returns the index of the slot holding a key, or of the empty slot where it would go */
+	size_t Locate(uid_key key) const
+	{
+		size_t i = Home(key);
+		while (slots[i].key && slots[i].key != key)
+			i = (i + 1) & (slots.size() - 1);
+		return i;
+	}
+
+	void Resize(size_t newsize)
+	{
+		std::vector<Slot> old(newsize, Slot());
+		old.swap(slots);
+		for (typename std::vector<Slot>::const_iterator i = old.begin(); i != old.end(); ++i)
+			if (i->key)
+				slots[Locate(i->key)] = *i;
+	}
+
+ public:
+	UIDTable() : slots(MIN_SLOTS, Slot()), count(0) { }
+
+	/** Returns the object with a packed ID, or NULL */
+	T* find(uid_key key) const
+	{
+		return key ? slots[Locate(key)].value : NULL;
+	}
+
+	/** Returns the object with an ID, or NULL */
+	T* find(const std::string& id) const
+	{
+		return find(PackUID(id));
+	}
+
+	/** Adds an object, unless there is already one with its ID
+	 * @return False if the ID is taken or can't be packed
+	 */
+	bool insert(const std::string& id, T* value)
+	{
+		uid_key key = PackUID(id);
+		if (!key || find(key))
+			return false;
+		set(key, value);
+		return true;
+	}
+
+	/** Adds an object, replacing any with the same packed ID */
+	void set(uid_key key, T* value)
+	{
+		if (!key)
+			return;
+
+		size_t i = Locate(key);
+		if (!slots[i].key)
+		{
+			// Keep the table at most half full, so that runs stay short
+			if (++count * 2 > slots.size())
+			{
+				Resize(slots.size() * 2);
+				i = Locate(key);
+			}
+			slots[i].key = key;
+		}
+		slots[i].value = value;
+	}
+
+	/** Removes the object with an ID, if there is one */
+	void erase(const std::string& id)
+	{
+		uid_key key = PackUID(id);
+		if (!key)
+			return;
+
+		size_t i = Locate(key);
+		if (!slots[i].key)
+			return;
+
+		// Move back any later entries in the run which would no longer be found past the gap
+		size_t mask = slots.size() - 1;
+		for (size_t j = (i + 1) & mask; slots[j].key; j = (j + 1) & mask)
+		{
+			size_t home = Home(slots[j].key);
+			if (((j - home) & mask) >= ((j - i) & mask))
+			{
+				slots[i] = slots[j];
+				i = j;
+			}
+		}
+		slots[i] = Slot();
+		count--;
+
+		// Give the memory back after a big netsplit
+		if (slots.size() > MIN_SLOTS && count * 8 < slots.size())
+			Resize(slots.size() / 2);
+	}
+
+	/** Returns the number of objects */
+	size_t size() const { return count; }
+};
+
+#endif
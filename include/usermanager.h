@@ -25,12 +25,40 @@
 /** A list of ip addresses cross referenced against clone counts */
 typedef std::map<irc::sockets::cidr_mask, unsigned int> clonemap;
 
+/** Per-user timer which replaces polling every local user once a second.
+ * It fires when the user's ping is due (LocalUser::nping), or every second
+ * while the user is unregistered or has commands held back by fakelag or a
+ * full sendq. Activity which moves nping forward does not touch the timer,
+ * it is only moved when it fires early.
+ * The timer is owned by the TimerManager and deleted when the user is culled.
+ */
+class CoreExport UserDeadlineTimer : public Timer
+{
+	LocalUser* const user;
+
+ public:
+	/** Set when command processing stopped with lines left in the recvq
+	 */
+	bool resume;
+
+	UserDeadlineTimer(LocalUser* u);
+
+	/** Returns the next time this user has to be looked at
+	 */
+	time_t GetTimer();
+
+	void Tick(time_t TIME);
+};
+
 class CoreExport UserManager
 {
  private:
 	/** Map of local ip addresses for clone counting
 	 */
 	clonemap local_clones;
+
+	/** Does the work of QuitUser(), and tells the user's neighbours unless notify is false */
+	void DoQuitUser(User* user, const std::string &quitreason, const char* operreason, bool notify);
  public:
 	UserManager();
 
@@ -52,7 +80,7 @@ class CoreExport UserManager
 	/** Client list stored by UUID. Contains all clients, and is updated
 	 * automatically by the constructor and destructor of User.
 	 */
-	user_hash* uuidlist;
+	UIDTable<User>* uuidlist;
 
 	/** Local client list, a list containing only local clients
 	 */
@@ -95,6 +123,17 @@ class CoreExport UserManager
 	 */
 	void QuitUser(User *user, const std::string &quitreason, const char* operreason = "");
 
+	/** Disconnect a number of users with the same reason, as in a netsplit. This
+	 * is the same as calling QuitUser() for each of them, except that the QUITs
+	 * are sent out a channel at a time: each local member of a channel is
+	 * visited once for all of the quitting users on it, instead of once for
+	 * each of them.
+	 * @param users The users to remove
+	 * @param quitreason The quit reason to show to normal users
+	 * @param operreason The quit reason to show to opers
+	 */
+	void QuitUsers(const std::vector<User*>& users, const std::string &quitreason, const char* operreason = "");
+
 	/** Add a user to the local clone map
 	 * @param user The user to add
 	 */
@@ -222,6 +222,55 @@ struct CoreExport ConnectClass : public refcountbase
 	}
 };
 
+/** Assigns small integer ids to the names of oper privileges and oper
+ * commands, so an oper's permissions can be kept as bitmaps. Privileges and
+ * commands have separate sets of ids. Ids are never reused, so a name keeps
+ * its id for the life of the process.
+ */
+class CoreExport PermissionRegistry
+{
+ public:
+	enum Type { PRIV, COMMAND };
+
+	/** Get the id of a name, registering the name if it is new
+	 * @param type Whether the name is a privilege or a command
+	 * @param name The privilege or command name
+	 * @return The id of the name
+	 */
+	static unsigned int GetId(Type type, const std::string& name);
+
+	/** Get the id of a name without registering it
+	 * @param type Whether the name is a privilege or a command
+	 * @param name The privilege or command name
+	 * @param id Set to the id of the name if it is known
+	 * @return True if the name is known, false if not
+	 */
+	static bool FindId(Type type, const std::string& name, unsigned int& id);
+};
+
+/** A privilege which opers can be given in the privs of a \<class> block.
+ * Declaring the privileges you check up front, e.g. as members of your
+ * module, means that checking them with User::HasPrivPermission() does
+ * not need to look up the name each time.
+ */
+class CoreExport Privilege
+{
+ public:
+	/** The name of the privilege, e.g. "users/auspex" */
+	const std::string name;
+
+	/** The id of the privilege from PermissionRegistry */
+	const unsigned int id;
+
+	/** Register a privilege
+	 * @param privname The name of the privilege
+	 */
+	Privilege(const std::string& privname)
+		: name(privname), id(PermissionRegistry::GetId(PermissionRegistry::PRIV, privname))
+	{
+	}
+};
+
 /** Holds all information about a user
  * This class stores all information about a user connected to the irc server. Everything about a
  * connection is stored here primarily, from the user's socket ID (file descriptor) through to the
@@ -341,6 +390,11 @@ class CoreExport User : public Extensible
 	 */
 	reference<OperInfo> oper;
 
+	/** Incremented whenever something a channel ban can match on changes,
+	 * see Membership::bancacheversion
+	 */
+	unsigned long banversion;
+
 	/** Used by User to indicate the registration status of the connection
 	 * It is a bitfield of the REG_NICK, REG_USER and REG_ALL bits to indicate
 	 * the connection state.
@@ -428,6 +482,13 @@ class CoreExport User : public Extensible
 	 */
 	void InvalidateCache();
 
+	/** Discard the results of ban checks cached for this user on their channels.
+	 * This is done by InvalidateCache() and whenever the core changes anything
+	 * else about the user which bans can match on; modules providing extbans
+	 * which match on other things should call it when those change.
+	 */
+	inline void InvalidateBanCache() { banversion++; }
+
 	/** Create a displayable mode string for this users snomasks
 	 * @return The notice mask character sequence
 	 */
@@ -488,6 +549,20 @@ class CoreExport User : public Extensible
 	 */
 	virtual bool HasPrivPermission(const std::string &privstr, bool noisy = false);
 
+	/** Returns true if a user has a given permission, without looking up its name.
+	 * @param priv The priv to check
+	 * @param noisy If set to true, the user is notified that they do not have the specified permission where applicable. If false, no notification is sent.
+	 * @return True if this user has the permission in question.
+	 */
+	virtual bool HasPrivPermission(const Privilege& priv, bool noisy = false);
+
+	/** Returns true or false for if a user can execute a privilaged oper command,
+	 * without looking up its name.
+	 * @param command The command to check
+	 * @return True if this user can execute the command
+	 */
+	virtual bool HasPermission(const Command* command);
+
 	/** Returns true or false if a user can set a privileged user or channel mode.
 	 * This is done by looking up their oper type from User::oper, then referencing
 	 * this to their oper classes, and checking the modes they can set.
@@ -729,12 +804,30 @@ class CoreExport UserIOHandler : public StreamSocket
 	void OnDataReady();
 	void OnError(BufferedSocketError error);
 
+	/** Extracts the next complete line from a receive buffer. CR characters are
+	 * dropped, NUL characters are replaced with spaces and the line is cut
+	 * short at MAXBUF - 2 characters.
+	 * @param buffer The receive buffer
+	 * @param pos Offset of the first unprocessed byte in the buffer, this is
+	 * moved past the line and its terminator if a line is found
+	 * @param line Set to the line, without its terminator
+	 * @return True if a line was found, false if the rest of the buffer does
+	 * not contain a complete line
+	 */
+	static bool SplitLine(const std::string& buffer, std::string::size_type& pos, std::string& line);
+
 	/** Adds to the user's write buffer.
 	 * You may add any amount of text up to this users sendq value, if you exceed the
 	 * sendq value, the user will be removed, and further buffer adds will be dropped.
 	 * @param data The data to add to the write buffer
 	 */
 	void AddWriteBuf(const std::string &data);
+
+	/** Adds a prebuilt, possibly shared, buffer to the user's write buffer.
+	 * The same sendq limits apply as for AddWriteBuf(const std::string&).
+	 * @param data The buffer to add to the write buffer
+	 */
+	void AddWriteBuf(const reference<SendQBuffer>& data);
 };
 
 typedef unsigned int already_sent_t;
@@ -796,11 +889,20 @@ class CoreExport LocalUser : public User, public InviteBase
 	 */
 	time_t nping;
 
+	/** Timer which handles this user's ping checks and registration timeout,
+	 * NULL if the user was never added to the UserManager
+	 */
+	UserDeadlineTimer* deadline;
+
 	/** This value contains how far into the penalty threshold the user is.
 	 * This is used either to enable fake lag or for excess flood quits
 	 */
 	unsigned int CommandFloodPenalty;
 
+	/** The last time CommandFloodPenalty was reduced by the connect class command rate
+	 */
+	time_t lastdecay;
+
 	static already_sent_t already_sent_id;
 	already_sent_t already_sent;
 
@@ -833,6 +935,21 @@ class CoreExport LocalUser : public User, public InviteBase
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line which was built by LocalUser::PrepareLine().
+	 * The line is queued by reference, so writing the same prepared line to
+	 * many users costs no more than a pointer push for each of them.
+	 * @param line The prepared line, including its trailing CR/LF
+	 */
+	void Write(const reference<SendQBuffer>& line);
+
+	/** Serialise a line of text once, cropped to the maximum line length and with
+	 * the trailing CR/LF appended, so that it can be written to any number of
+	 * local users with LocalUser::Write(const reference<SendQBuffer>&).
+	 * @param text The line to send, without CR/LF
+	 * @return A new buffer holding the wire form of the line
+	 */
+	static SendQBuffer* PrepareLine(const std::string& text);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
@@ -877,6 +994,20 @@ class CoreExport LocalUser : public User, public InviteBase
 	 */
 	bool HasPrivPermission(const std::string &privstr, bool noisy = false);
 
+	/** Returns true if a user has a given permission, without looking up its name.
+	 * @param priv The priv to check
+	 * @param noisy If set to true, the user is notified that they do not have the specified permission where applicable. If false, no notification is sent.
+	 * @return True if this user has the permission in question.
+	 */
+	bool HasPrivPermission(const Privilege& priv, bool noisy = false);
+
+	/** Returns true or false for if a user can execute a privilaged oper command,
+	 * without looking up its name.
+	 * @param command The command to check
+	 * @return True if this user can execute the command
+	 */
+	bool HasPermission(const Command* command);
+
 	/** Returns true or false if a user can set a privileged user or channel mode.
 	 * This is done by looking up their oper type from User::oper, then referencing
 	 * this to their oper classes, and checking the modes they can set.
@@ -931,6 +1062,66 @@ inline FakeUser* IS_SERVER(User* u)
 /** Is away */
 #define IS_AWAY(x) (!x->awaymsg.empty())
 
+/** Iterates over the local users who share a channel with a given user,
+ * honouring the users and channels added or removed by OnBuildNeighborList.
+ * Each neighbour is returned at most once. Users are deduplicated by stamping
+ * LocalUser::already_sent with a fresh id, so no set of visited users is built,
+ * and the source's channel list is only copied if a module implements
+ * OnBuildNeighborList. Only the packed local member lists of the channels
+ * are walked, so remote members are never visited. Quitting users are never
+ * returned.
+ */
+class CoreExport NeighborIterator
+{
+	/** The user whose neighbours are being visited */
+	User* const source;
+
+	/** Copy of the source's channels, only used when modules may alter it */
+	UserChanList include_c;
+
+	/** Users explicitly included (true) or excluded (false) by modules */
+	std::map<User*,bool> exceptions;
+
+	/** The channels being walked, either source->chans or include_c */
+	const UserChanList* chans;
+
+	/** The source itself, if it must be returned before anyone else */
+	LocalUser* first;
+
+	std::map<User*,bool>::const_iterator excit;
+	UserChanList::const_iterator chanit;
+	/** Position in the local member list of *chanit */
+	size_t membidx;
+
+	/** already_sent stamp for excluded users */
+	already_sent_t silent_id;
+	/** already_sent stamp for users which have been returned */
+	already_sent_t seen_id;
+
+ public:
+	/** Begin iterating over the neighbours of a user
+	 * @param user The user whose neighbours to visit
+	 * @param include_self True to also return the user itself, if it is local
+	 */
+	NeighborIterator(User* user, bool include_self);
+
+	/** Get the next neighbour
+	 * @return The next local user sharing a channel with the source, or NULL when done
+	 */
+	LocalUser* Next();
+
+	/** Check if a user has already been returned by Next()
+	 * @param user The user to check
+	 * @return True if the user was returned by this iterator
+	 */
+	inline bool WasVisited(LocalUser* user) const { return user->already_sent == seen_id; }
+
+	/** Get the channels being walked, after any changes made by modules
+	 * @return The list of channels considered when finding neighbours
+	 */
+	inline const UserChanList& GetChannels() const { return *chans; }
+};
+
 /** Derived from Resolver, and performs user forward/reverse lookups.
  */
 class CoreExport UserResolver : public Resolver
@@ -32,6 +32,10 @@
  */
 class CoreExport XLine : public classbase
 {
+	/** Position in XLineManager's expiry heap, or npos
+	 */
+	size_t heappos;
+
  protected:
 
 	/** Default 'apply' action. Quits the user.
@@ -51,7 +55,7 @@ class CoreExport XLine : public classbase
 	 * @param t The line type, should be set by the derived class constructor
 	 */
 	XLine(time_t s_time, long d, std::string src, std::string re, const std::string &t)
-		: set_time(s_time), duration(d), source(src), reason(re), type(t)
+		: heappos(std::string::npos), set_time(s_time), duration(d), source(src), reason(re), type(t)
 	{
 		expiry = set_time + duration;
 	}
@@ -116,6 +120,31 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** Fields of a user, or the string passed to Matches(const std::string&),
+	 * which the mask returned by GetIndexMask() is compared against
+	 */
+	enum IndexField
+	{
+		/** The user's real host */
+		INDEX_HOST = 1,
+		/** The user's IP address */
+		INDEX_IP = 2,
+		/** The user's nick */
+		INDEX_NICK = 4,
+		/** The whole string passed to Matches(const std::string&) */
+		INDEX_PATTERN = 8
+	};
+
+	/** Get the mask the XLineManager indexes this line by, so that it is only
+	 * tested against users it might match. A line may only return a mask if
+	 * Matches() can never succeed unless the mask, compared case insensitively
+	 * or as a CIDR range as MatchCIDR() does, matches one of the given fields.
+	 * The mask must not change while the line is added.
+	 * @param fields Set to the IndexFields the mask is compared against
+	 * @return The mask, or NULL to have the line tested against every user
+	 */
+	virtual const std::string* GetIndexMask(int& fields) { return NULL; }
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -142,6 +171,8 @@ class CoreExport XLine : public classbase
 	const std::string type;
 
 	virtual bool IsBurstable();
+
+	friend class XLineManager;
 };
 
 /** KLine class
@@ -181,6 +212,8 @@ class CoreExport KLine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual const std::string* GetIndexMask(int& fields);
+
 	virtual bool IsBurstable();
 
 	/** Ident mask (ident part only)
@@ -229,6 +262,8 @@ class CoreExport GLine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual const std::string* GetIndexMask(int& fields);
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -275,6 +310,8 @@ class CoreExport ELine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual const std::string* GetIndexMask(int& fields);
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -318,6 +355,8 @@ class CoreExport ZLine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual const std::string* GetIndexMask(int& fields);
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
@@ -355,6 +394,8 @@ class CoreExport QLine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual const std::string* GetIndexMask(int& fields);
+
 	/** Nickname mask
 	 */
 	std::string nick;
@@ -402,6 +443,126 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+class XLineExpiryTimer;
+
+/** Finds the lines of one type which might match a user or string without
+ * testing every line. Lines whose index mask (see XLine::GetIndexMask) has no
+ * wildcards are kept in a hash keyed by the mask, and also in a trie if the
+ * mask is a CIDR range; any other line is tested every time.
+ */
+class CoreExport XLineIndex
+{
+#ifdef HASHMAP_DEPRECATED
+	typedef nspace::hash_map<std::string, std::vector<XLine*>, nspace::insensitive, irc::StrHashComp> ExactMap;
+#else
+	typedef nspace::hash_map<std::string, std::vector<XLine*>, nspace::hash<std::string>, irc::StrHashComp> ExactMap;
+#endif
+
+	/** Lines by their index mask, for masks with no wildcards */
+	ExactMap exact;
+
+	/** Lines whose index mask is a CIDR range */
+	irc::sockets::cidr_trie<XLine*> cidrs;
+
+	/** Lines which have to be tested every time */
+	std::set<XLine*> residual;
+
+	/** Union of the IndexFields of the lines in exact */
+	int fields;
+
+	/** Number of lines in exact which can't be found by pattern */
+	size_t unpatterned;
+
+	XLineIndex(const XLineIndex&);
+	XLineIndex& operator=(const XLineIndex&);
+
+	template<typename F>
+	bool WalkExact(const std::string& key, F& func)
+	{
+		ExactMap::iterator i = exact.find(key);
+		if (i == exact.end())
+			return false;
+		for (std::vector<XLine*>::iterator j = i->second.begin(); j != i->second.end(); ++j)
+			if (func(*j))
+				return true;
+		return false;
+	}
+
+	template<typename F>
+	bool WalkResidual(F& func)
+	{
+		for (std::set<XLine*>::iterator i = residual.begin(); i != residual.end(); ++i)
+			if (func(*i))
+				return true;
+		return false;
+	}
+
+ public:
+	XLineIndex() : fields(0), unpatterned(0) { }
+
+	/** Add a line to the index */
+	void Add(XLine* line);
+
+	/** Remove a line from the index */
+	void Remove(XLine* line);
+
+	/** @return True if every line can be found by Walk(const std::string&, F&) */
+	bool CanWalkPattern() const { return !unpatterned; }
+
+	/** Pass each line which might match a user to a functor, until it returns
+	 * true. The same line may be passed more than once, and the functor must
+	 * not change the index.
+	 * @param user The user to look up
+	 * @param func Called as func(line), returns true to stop
+	 * @return True if func returned true
+	 */
+	template<typename F>
+	bool Walk(User* user, F& func)
+	{
+		const std::string ip = user->GetIPString();
+		if (!exact.empty())
+		{
+			if ((fields & XLine::INDEX_IP) && WalkExact(ip, func))
+				return true;
+			if ((fields & XLine::INDEX_HOST) && user->host != ip && WalkExact(user->host, func))
+				return true;
+			if ((fields & XLine::INDEX_NICK) && WalkExact(user->nick, func))
+				return true;
+		}
+
+		if (!cidrs.empty())
+		{
+			if (cidrs.find(user->client_sa, func))
+				return true;
+
+			irc::sockets::sockaddrs sa;
+			if (user->host != ip && irc::sockets::aptosa(user->host, 0, sa) && cidrs.find(sa, func))
+				return true;
+		}
+
+		return WalkResidual(func);
+	}
+
+	/** Pass each line which might match a string to a functor, until it
+	 * returns true. Only valid if CanWalkPattern() returns true.
+	 * @param pattern The string to look up
+	 * @param func Called as func(line), returns true to stop
+	 * @return True if func returned true
+	 */
+	template<typename F>
+	bool Walk(const std::string& pattern, F& func)
+	{
+		if (WalkExact(pattern, func))
+			return true;
+
+		irc::sockets::sockaddrs sa;
+		if (!cidrs.empty() && irc::sockets::aptosa(pattern, 0, sa) && cidrs.find(sa, func))
+			return true;
+
+		return WalkResidual(func);
+	}
+};
+
 /** XLineManager is a class used to manage glines, klines, elines, zlines and qlines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -418,12 +579,30 @@ class CoreExport XLineManager
 	XLineFactMap line_factory;
 
 	/** Container of all lines, this is a map of maps which
-	 * allows for fast lookup for add/remove of a line, and
-	 * the shortest possible timed O(n) for checking a user
-	 * against a line.
+	 * allows for fast lookup for add/remove of a line. Checking
+	 * a user against the lines is done with line_indexes.
 	 */
 	XLineContainer lookup_lines;
 
+	/** Index of the lines of each type, kept alongside lookup_lines
+	 */
+	std::map<std::string, XLineIndex*> line_indexes;
+
+	/** Lines with a duration, as a binary heap with the line which expires
+	 * first at the top; see XLine::heappos
+	 */
+	std::vector<XLine*> expiry_heap;
+
+	/** Timer which calls ExpireLines() every second
+	 */
+	XLineExpiryTimer* expirytimer;
+
+	void HeapSwap(size_t a, size_t b);
+	void HeapUp(size_t pos);
+	void HeapDown(size_t pos);
+	void HeapPush(XLine* line);
+	void HeapRemove(XLine* line);
+
  public:
 
 	/** Constructor
@@ -444,8 +623,7 @@ class CoreExport XLineManager
 	void CheckELines();
 
 	/** Get all lines of a certain type to an XLineLookup (std::map<std::string, XLine*>).
-	 * NOTE: When this function runs any expired items are removed from the list before it
-	 * is returned to the caller.
+	 * NOTE: Lines which expired within the last second may still be in the list.
 	 * @param type The type to look up
 	 * @return A list of all XLines of the given type.
 	 */
@@ -520,15 +698,22 @@ class CoreExport XLineManager
 	 */
 	void ExpireLine(ContainerIter container, LookupIter item);
 
+	/** Expire every line whose expiry time has passed. This is called each
+	 * second by a timer, and only looks at the lines which are due.
+	 * @param now The current time
+	 */
+	void ExpireLines(time_t now);
+
 	/** Apply any new lines that are pending to be applied.
 	 * This will only apply lines in the pending_lines list, to save on
-	 * CPU time.
+	 * CPU time, and each user is only tested against the pending lines
+	 * which might match them.
 	 */
 	void ApplyLines();
 
 	/** Handle /STATS for a given type.
 	 * NOTE: Any items in the list for this particular line type which have expired
-	 * will be expired and removed before the list is displayed.
+	 * are left out.
 	 * @param type The type of stats to show
 	 * @param numeric The numeric to give to each result line
 	 * @param user The username making the query
@@ -23,51 +23,111 @@
 #include "inspircd.h"
 #include "bancache.h"
 
-BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason)
+size_t BanCacheKeyHash::operator()(const irc::sockets::cidr_mask& key) const
+{
+	// FNV-1a over the address bits; the length is always 128 (or 32) so isn't mixed in
+	size_t h = 2166136261U ^ key.type;
+	for (unsigned int i = 0; i < sizeof(key.bits); i++)
+		h = (h ^ key.bits[i]) * 16777619U;
+	return h;
+}
+
+BanCacheHit *BanCacheManager::AddHit(const irc::sockets::sockaddrs& sa, const std::string &type, const std::string &reason, time_t seconds)
 {
-	BanCacheHit *b;
+	if (sa.sa.sa_family != AF_INET && sa.sa.sa_family != AF_INET6)
+		return NULL;
 
-	if (this->BanHash->find(ip) != this->BanHash->end()) // can't have two cache entries on the same IP, sorry..
+	size_t capacity = ServerInstance->Config->BanCacheSize;
+	if (!capacity)
 		return NULL;
 
-	b = new BanCacheHit(ip, type, reason);
+	irc::sockets::cidr_mask key(sa, 128);
+	BanCacheHash::iterator i = this->BanHash->find(key);
+	if (i != this->BanHash->end())
+	{
+		if (!IsStale(i->second)) // can't have two cache entries on the same IP, sorry..
+			return NULL;
+		Erase(i->second);
+	}
 
-	this->BanHash->insert(std::make_pair(ip, b));
+	// Make room by dropping the least recently used hits; more than one may go if the limit was lowered by a rehash
+	while (!lru.empty() && BanHash->size() >= capacity)
+	{
+		BanCacheHit* victim = lru.back();
+		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::AddHit(): Cache full, evicting hit on " + victim->IP);
+		Erase(victim);
+		Evictions++;
+	}
+
+	BanCacheHit* b = new BanCacheHit(sa.addr(), type, reason, seconds);
+	b->key = key;
+	b->lrupos = lru.insert(lru.begin(), b);
+	b->counter = type.empty() ? &negativegen : &positivegens[type];
+	b->generation = *b->counter;
+
+	this->BanHash->insert(std::make_pair(key, b));
 	return b;
 }
 
-BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
+BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason)
 {
-	BanCacheHit *b;
+	return AddHit(ip, type, reason, 86400); // a day. this might seem long, but entries will be removed as glines/etc expire.
+}
 
-	if (this->BanHash->find(ip) != this->BanHash->end()) // can't have two cache entries on the same IP, sorry..
+BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
+{
+	irc::sockets::sockaddrs sa;
+	if (!irc::sockets::aptosa(ip, 0, sa))
 		return NULL;
 
-	b = new BanCacheHit(ip, type, reason, seconds);
-
-	this->BanHash->insert(std::make_pair(ip, b));
-	return b;
+	return AddHit(sa, type, reason, seconds);
 }
 
-BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
+BanCacheHit *BanCacheManager::GetHit(const irc::sockets::sockaddrs& sa)
 {
-	BanCacheHash::iterator i = this->BanHash->find(ip);
+	BanCacheHash::iterator i = this->BanHash->find(irc::sockets::cidr_mask(sa, 128));
 
 	if (i == this->BanHash->end())
+	{
+		Misses++;
 		return NULL; // free and safe
+	}
 	else
 	{
-		if (ServerInstance->Time() > i->second->Expiry)
+		BanCacheHit* b = i->second;
+		if (IsStale(b))
 		{
-			ServerInstance->Logs->Log("BANCACHE", DEBUG, "Hit on " + ip + " is out of date, removing!");
-			RemoveHit(i->second);
+			ServerInstance->Logs->Log("BANCACHE", DEBUG, "Hit on " + b->IP + " is out of date, removing!");
+			Erase(b);
+			Misses++;
 			return NULL; // out of date
 		}
 
-		return i->second; // hit.
+		lru.splice(lru.begin(), lru, b->lrupos);
+		Hits++;
+		return b; // hit.
 	}
 }
 
+BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
+{
+	irc::sockets::sockaddrs sa;
+	if (!irc::sockets::aptosa(ip, 0, sa))
+	{
+		Misses++;
+		return NULL;
+	}
+
+	return GetHit(sa);
+}
+
+void BanCacheManager::Erase(BanCacheHit* b)
+{
+	BanHash->erase(b->key);
+	lru.erase(b->lrupos);
+	delete b;
+}
+
 bool BanCacheManager::RemoveHit(BanCacheHit *b)
 {
 	BanCacheHash::iterator i;
@@ -75,98 +135,51 @@ bool BanCacheManager::RemoveHit(BanCacheHit *b)
 	if (!b)
 		return false; // I don't think so.
 
-	i = this->BanHash->find(b->IP);
+	i = this->BanHash->find(b->key);
 
-	if (i == this->BanHash->end())
+	if (i == this->BanHash->end() || i->second != b)
 	{
 		// err..
 		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveHit(): I got asked to remove a hit that wasn't in the hash(?)");
+		delete b;
 	}
 	else
 	{
-		this->BanHash->erase(i);
+		Erase(b);
 	}
 
-	delete b;
 	return true;
 }
 
-unsigned int BanCacheManager::RemoveEntries(const std::string &type, bool positive)
+void BanCacheManager::RemoveEntries(const std::string &type, bool positive)
 {
-	int removed = 0;
-
-	BanCacheHash::iterator safei;
-
 	if (positive)
+	{
 		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing positive hits for " + type);
+		positivegens[type]++;
+	}
 	else
-		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing negative hits for " + type);
-
-	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); )
 	{
-		safei = n;
-		safei++;
-
-		BanCacheHit *b = n->second;
-
-		/* Safe to delete items here through iterator 'n' */
-		if (b->Type == type || !positive) // if removing negative hits, ignore type..
-		{
-			if ((positive && !b->Reason.empty()) || b->Reason.empty())
-			{
-				/* we need to remove this one. */
-				ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + b->IP);
-				delete b;
-				BanHash->erase(n); // WORD TO THE WISE: don't use RemoveHit here, because we MUST remove the iterator in a safe way.
-				removed++;
-			}
-		}
-
-		/* End of safe section */
-		n = safei;
+		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing negative hits for " + type);
+		negativegen++;
 	}
-
-
-	return removed;
 }
 
 void BanCacheManager::RehashCache()
 {
-	BanCacheHash* NewHash = new BanCacheHash();
-
-	BanCacheHash::iterator safei;
-	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); )
+	for (std::list<BanCacheHit*>::iterator n = lru.begin(); n != lru.end(); )
 	{
-		safei = n;
-		safei++;
-
-		/* Safe to delete items here through iterator 'n' */
-		BanCacheHit *b = n->second;
-
-		if (ServerInstance->Time() > b->Expiry)
-		{
-			/* we need to remove this one. */
-			delete b;
-			BanHash->erase(n); // WORD TO THE WISE: don't use RemoveHit here, because we MUST remove the iterator in a safe way.
-		}
-		else
-		{
-			/* Actually inserts a std::pair */
-			NewHash->insert(*n);
-		}
+		BanCacheHit *b = *n;
+		++n;
 
-		/* End of safe section */
-
-		n = safei;
+		if (IsStale(b))
+			Erase(b);
 	}
-
-	delete BanHash;
-	BanHash = NewHash;
 }
 
 BanCacheManager::~BanCacheManager()
 {
-	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); ++n)
-		delete n->second;
+	for (std::list<BanCacheHit*>::iterator n = lru.begin(); n != lru.end(); ++n)
+		delete *n;
 	delete BanHash;
 }
@@ -38,9 +38,16 @@ Channel::Channel(const std::string &cname, time_t ts)
 	this->age = ts ? ts : ServerInstance->Time();
 
 	maxbans = topicset = 0;
+	banversion = 0;
 	modes.reset();
 }
 
+Channel::~Channel()
+{
+	for (std::map<char, BanIndex*>::iterator i = banindexes.begin(); i != banindexes.end(); ++i)
+		delete i->second;
+}
+
 void Channel::SetMode(char mode,bool mode_on)
 {
 	modes[mode-65] = mode_on;
@@ -135,15 +142,34 @@ Membership* Channel::AddUser(User* user)
 {
 	Membership* memb = new Membership(user, this);
 	userlist[user] = memb;
+	// Extbans can match on the channels a user is on
+	user->InvalidateBanCache();
+	if (IS_LOCAL(user))
+	{
+		memb->localindex = localmembers.size();
+		localmembers.push_back(memb);
+	}
 	return memb;
 }
 
 void Channel::DelUser(User* user)
 {
 	UserMembIter a = userlist.find(user);
+	user->InvalidateBanCache();
 
 	if (a != userlist.end())
 	{
+		if (IS_LOCAL(user))
+		{
+			// Move the last local member into the hole left by this one
+			Membership* last = localmembers.back();
+			last->localindex = a->second->localindex;
+			localmembers[last->localindex] = last;
+			localmembers.pop_back();
+
+			a->second->modes.clear();
+			UpdatePrefixed(a->second);
+		}
 		a->second->cull();
 		delete a->second;
 		userlist.erase(a);
@@ -423,30 +449,62 @@ Channel* Channel::ForceChan(Channel* Ptr, User* user, const std::string &privs,
 	return Ptr;
 }
 
+/** Bumped to discard every cached ban result at once */
+static unsigned long globalbanversion = 0;
+
+void Channel::InvalidateAllBanCaches()
+{
+	globalbanversion++;
+}
+
+Membership* Channel::GetBanCache(User* user)
+{
+	Membership* memb = GetUser(user);
+	if (!memb)
+		return NULL;
+
+	unsigned long version = globalbanversion + banversion + user->banversion;
+	if (memb->bancacheversion != version)
+	{
+		memb->bancached.reset();
+		memb->bandeny.reset();
+		memb->banallow.reset();
+		memb->bancacheversion = version;
+	}
+	return memb;
+}
+
 bool Channel::IsBanned(User* user)
 {
+	Membership* memb = GetBanCache(user);
+	if (memb && memb->bancached[0])
+		return memb->bandeny[0];
+
+	bool banned = false;
 	ModResult result;
 	FIRST_MOD_RESULT(OnCheckChannelBan, result, (user, this));
 
 	if (result != MOD_RES_PASSTHRU)
-		return (result == MOD_RES_DENY);
+	{
+		banned = (result == MOD_RES_DENY);
+	}
+	else if (!bans.empty())
+	{
+		banned = CheckBans(user, 0);
+	}
 
-	for (BanList::iterator i = this->bans.begin(); i != this->bans.end(); i++)
+	if (memb)
 	{
-		if (CheckBan(user, i->data))
-			return true;
+		memb->bancached[0] = true;
+		memb->bandeny[0] = banned;
 	}
-	return false;
+	return banned;
 }
 
-bool Channel::CheckBan(User* user, const std::string& mask)
+/** The core part of Channel::CheckBan, after the hook has passed on the mask */
+static bool MatchBanMask(User* user, const std::string& mask)
 {
-	ModResult result;
-	FIRST_MOD_RESULT(OnCheckBan, result, (user, this, mask));
-	if (result != MOD_RES_PASSTHRU)
-		return (result == MOD_RES_DENY);
-
-	// extbans were handled above, if this is one it obviously didn't match
+	// extbans were handled by the hook, if this is one it obviously didn't match
 	if ((mask.length() <= 2) || (mask[1] == ':'))
 		return false;
 
@@ -468,22 +526,194 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 	return false;
 }
 
+bool Channel::CheckBan(User* user, const std::string& mask)
+{
+	ModResult result;
+	FIRST_MOD_RESULT(OnCheckBan, result, (user, this, mask));
+	if (result != MOD_RES_PASSTHRU)
+		return (result == MOD_RES_DENY);
+
+	return MatchBanMask(user, mask);
+}
+
+BanIndex* Channel::GetBanIndex(char type)
+{
+	BanIndex*& index = banindexes[type];
+	if (!index)
+	{
+		index = new BanIndex;
+		index->Build(bans, type);
+		index->version = banversion;
+	}
+	else if (index->version != banversion)
+	{
+		index->Build(bans, type);
+		index->version = banversion;
+	}
+	return index;
+}
+
+bool Channel::CheckBans(User* user, char type)
+{
+	BanIndex* index = GetBanIndex(type);
+	if (index->masks.empty())
+		return false;
+
+	// Masks a module has stopped the core from matching
+	std::vector<bool> vetoed;
+	if (!ServerInstance->Modules->EventHandlers[I_OnCheckBan].empty())
+	{
+		for (std::vector<std::string>::size_type i = 0; i < index->masks.size(); i++)
+		{
+			ModResult result;
+			FIRST_MOD_RESULT(OnCheckBan, result, (user, this, index->masks[i]));
+			if (result == MOD_RES_DENY)
+				return true;
+			if (result == MOD_RES_ALLOW)
+			{
+				vetoed.resize(index->masks.size());
+				vetoed[i] = true;
+			}
+		}
+	}
+
+	if (vetoed.empty())
+		return index->Match(user);
+
+	// The index can't leave out the vetoed masks, so match the others one at a time
+	for (std::vector<std::string>::size_type i = 0; i < index->masks.size(); i++)
+	{
+		if (!vetoed[i] && MatchBanMask(user, index->masks[i]))
+			return true;
+	}
+	return false;
+}
+
+void BanIndex::Build(const BanList& bans, char type)
+{
+	exact.clear();
+	cidrs.clear();
+	globs.clear();
+	masks.clear();
+
+	for (BanList::const_iterator i = bans.begin(); i != bans.end(); ++i)
+	{
+		const std::string& data = i->data;
+		if (!type)
+			masks.push_back(data);
+		else if (data.length() > 2 && data[0] == type && data[1] == ':')
+			masks.push_back(data.substr(2));
+		else
+			continue;
+
+		// Same checks as Channel::CheckBan; extbans are only ever matched by modules
+		const std::string& mask = masks.back();
+		if ((mask.length() <= 2) || (mask[1] == ':'))
+			continue;
+
+		std::string::size_type at = mask.find('@');
+		if (at == std::string::npos)
+			continue;
+
+		Entry entry;
+		entry.nickident.assign(mask, 0, at);
+		entry.host.assign(mask, at + 1, std::string::npos);
+
+		if (entry.host.find_first_of("*?") == std::string::npos)
+			exact[entry.host].push_back(entry.nickident);
+		else
+			globs.push_back(entry);
+
+		// MatchCIDR ignores anything up to an '@' in the host part
+		irc::sockets::cidr_mask cidr;
+		if (irc::sockets::ParseCIDR(entry.host.substr(entry.host.rfind('@') + 1), cidr))
+			cidrs.add(cidr, entry.nickident);
+	}
+}
+
+bool BanIndex::MatchExact(const std::string& nickident, const std::string& host) const
+{
+	ExactMap::const_iterator i = exact.find(host);
+	if (i == exact.end())
+		return false;
+
+	for (std::vector<std::string>::const_iterator j = i->second.begin(); j != i->second.end(); ++j)
+	{
+		if (InspIRCd::Match(nickident, *j, NULL))
+			return true;
+	}
+	return false;
+}
+
+/** Matches the nick!ident patterns of the CIDR masks found for a user */
+struct NickIdentMatcher
+{
+	const std::string& nickident;
+	NickIdentMatcher(const std::string& ni) : nickident(ni) { }
+	bool operator()(const std::string& pattern) const
+	{
+		return InspIRCd::Match(nickident, pattern, NULL);
+	}
+};
+
+bool BanIndex::Match(User* user) const
+{
+	std::string nickident = user->nick + "!" + user->ident;
+	const std::string ip = user->GetIPString();
+
+	if (!exact.empty())
+	{
+		if (MatchExact(nickident, user->host) || MatchExact(nickident, ip) ||
+			(user->dhost != user->host && MatchExact(nickident, user->dhost)))
+			return true;
+	}
+
+	if (!cidrs.empty())
+	{
+		NickIdentMatcher matcher(nickident);
+		if (cidrs.find(user->client_sa, matcher))
+			return true;
+	}
+
+	for (std::vector<Entry>::const_iterator i = globs.begin(); i != globs.end(); ++i)
+	{
+		if (InspIRCd::Match(nickident, i->nickident, NULL) &&
+			(InspIRCd::Match(user->host, i->host, NULL) ||
+			InspIRCd::Match(user->dhost, i->host, NULL) ||
+			InspIRCd::Match(ip, i->host, NULL)))
+			return true;
+	}
+	return false;
+}
+
 ModResult Channel::GetExtBanStatus(User *user, char type)
 {
+	// Only letters are cached, which covers every extban we ship
+	Membership* memb = NULL;
+	size_t slot = 0;
+	if (type >= 'A' && type <= 'z')
+	{
+		memb = GetBanCache(user);
+		slot = type - 'A' + 1;
+		if (memb && memb->bancached[slot])
+			return memb->bandeny[slot] ? MOD_RES_DENY : (memb->banallow[slot] ? MOD_RES_ALLOW : MOD_RES_PASSTHRU);
+	}
+
 	ModResult rv;
 	FIRST_MOD_RESULT(OnExtBanCheck, rv, (user, this, type));
-	if (rv != MOD_RES_PASSTHRU)
-		return rv;
-	for (BanList::iterator i = this->bans.begin(); i != this->bans.end(); i++)
+	if (rv == MOD_RES_PASSTHRU && type && !bans.empty())
 	{
-		if (i->data.length() > 2 && i->data[0] == type && i->data[1] == ':')
-		{
-			std::string val = i->data.substr(2);
-			if (CheckBan(user, val))
-				return MOD_RES_DENY;
-		}
+		if (CheckBans(user, type))
+			rv = MOD_RES_DENY;
 	}
-	return MOD_RES_PASSTHRU;
+
+	if (memb)
+	{
+		memb->bancached[slot] = true;
+		memb->bandeny[slot] = (rv == MOD_RES_DENY);
+		memb->banallow[slot] = (rv == MOD_RES_ALLOW);
+	}
+	return rv;
 }
 
 /* Channel::PartUser
@@ -596,13 +826,10 @@ void Channel::WriteChannel(User* user, const std::string &text)
 		return;
 
 	snprintf(tb,MAXBUF,":%s %s", user->GetFullHost().c_str(), text.c_str());
-	std::string out = tb;
+	reference<SendQBuffer> out = LocalUser::PrepareLine(tb);
 
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
-	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(out);
-	}
+	for (LocalMembList::const_iterator i = localmembers.begin(); i != localmembers.end(); ++i)
+		static_cast<LocalUser*>((*i)->user)->Write(out);
 }
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const char* text, ...)
@@ -625,13 +852,10 @@ void Channel::WriteChannelWithServ(const std::string& ServName, const std::strin
 	char tb[MAXBUF];
 
 	snprintf(tb,MAXBUF,":%s %s", ServName.empty() ? ServerInstance->Config->ServerName.c_str() : ServName.c_str(), text.c_str());
-	std::string out = tb;
+	reference<SendQBuffer> out = LocalUser::PrepareLine(tb);
 
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
-	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(out);
-	}
+	for (LocalMembList::const_iterator i = localmembers.begin(); i != localmembers.end(); ++i)
+		static_cast<LocalUser*>((*i)->user)->Write(out);
 }
 
 /* write formatted text from a source user to all users on a channel except
@@ -677,7 +901,7 @@ void Channel::WriteAllExcept(User* user, bool serversource, char status, CUList
 	this->RawWriteAllExcept(user, serversource, status, except_list, std::string(tb));
 }
 
-void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CUList &except_list, const std::string &out)
+void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CUList &except_list, const std::string &text)
 {
 	unsigned int minrank = 0;
 	if (status)
@@ -686,16 +910,21 @@ void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CULi
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
+
+	/* Build the line once, every recipient gets the same buffer */
+	reference<SendQBuffer> out = LocalUser::PrepareLine(text);
+
+	/* Only members holding a prefix mode can have the status we're after */
+	const LocalMembList& members = minrank ? localprefixed : localmembers;
+	for (LocalMembList::const_iterator i = members.begin(); i != members.end(); ++i)
 	{
-		if (IS_LOCAL(i->first) && (except_list.find(i->first) == except_list.end()))
-		{
-			/* User doesn't have the status we're after */
-			if (minrank && i->second->getRank() < minrank)
-				continue;
+		Membership* memb = *i;
+		/* User doesn't have the status we're after */
+		if (minrank && memb->getRank() < minrank)
+			continue;
 
-			i->first->Write(out);
-		}
+		if (except_list.find(memb->user) == except_list.end())
+			static_cast<LocalUser*>(memb->user)->Write(out);
 	}
 }
 
@@ -943,6 +1172,8 @@ bool Channel::SetPrefix(User* user, char prefix, bool adding)
 	UserMembIter m = userlist.find(user);
 	if (m == userlist.end())
 		return false;
+	// Extbans can match on the prefixes a user has on other channels
+	user->InvalidateBanCache();
 	for(unsigned int i=0; i < m->second->modes.length(); i++)
 	{
 		char mchar = m->second->modes[i];
@@ -953,11 +1184,15 @@ bool Channel::SetPrefix(User* user, char prefix, bool adding)
 				m->second->modes.substr(0,i) +
 				(adding ? std::string(1, prefix) : "") +
 				m->second->modes.substr(mchar == prefix ? i+1 : i);
+			UpdatePrefixed(m->second);
 			return adding != (mchar == prefix);
 		}
 	}
 	if (adding)
+	{
 		m->second->modes += std::string(1, prefix);
+		UpdatePrefixed(m->second);
+	}
 	return adding;
 }
 
@@ -966,7 +1201,31 @@ void Channel::RemoveAllPrefixes(User* user)
 	UserMembIter m = userlist.find(user);
 	if (m != userlist.end())
 	{
+		user->InvalidateBanCache();
 		m->second->modes.clear();
+		UpdatePrefixed(m->second);
+	}
+}
+
+void Channel::UpdatePrefixed(Membership* memb)
+{
+	if (!IS_LOCAL(memb->user))
+		return;
+
+	bool listed = (memb->prefixedindex != std::string::npos);
+	if (!memb->modes.empty() && !listed)
+	{
+		memb->prefixedindex = localprefixed.size();
+		localprefixed.push_back(memb);
+	}
+	else if (memb->modes.empty() && listed)
+	{
+		// Move the last prefixed member into the hole left by this one
+		Membership* last = localprefixed.back();
+		last->prefixedindex = memb->prefixedindex;
+		localprefixed[last->prefixedindex] = last;
+		localprefixed.pop_back();
+		memb->prefixedindex = std::string::npos;
 	}
 }
 
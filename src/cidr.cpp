@@ -65,10 +65,8 @@ bool irc::sockets::MatchCIDR(const std::string &address, const std::string &cidr
 		cidr_copy.assign(cidr_mask);
 	}
 
-	const std::string::size_type per_pos = cidr_copy.rfind('/');
-	if ((per_pos == std::string::npos) || (per_pos == cidr_copy.length()-1)
-		|| (cidr_copy.find_first_not_of("0123456789", per_pos+1) != std::string::npos)
-		|| (cidr_copy.find_first_not_of("0123456789abcdefABCDEF.:") < per_pos))
+	irc::sockets::cidr_mask mask;
+	if (!ParseCIDR(cidr_copy, mask))
 	{
 		// The CIDR mask is invalid
 		return false;
@@ -77,10 +75,21 @@ bool irc::sockets::MatchCIDR(const std::string &address, const std::string &cidr
 	irc::sockets::sockaddrs addr;
 	irc::sockets::aptosa(address_copy, 0, addr);
 
-	irc::sockets::cidr_mask mask(cidr_copy);
 	irc::sockets::cidr_mask mask2(addr, mask.length);
 
 	return mask == mask2;
 }
 
+bool irc::sockets::ParseCIDR(const std::string& text, irc::sockets::cidr_mask& mask)
+{
+	const std::string::size_type per_pos = text.rfind('/');
+	if ((per_pos == std::string::npos) || (per_pos == text.length()-1)
+		|| (text.find_first_not_of("0123456789", per_pos+1) != std::string::npos)
+		|| (text.find_first_not_of("0123456789abcdefABCDEF.:") < per_pos))
+		return false;
+
+	mask = irc::sockets::cidr_mask(text);
+	return true;
+}
+
 
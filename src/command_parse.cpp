@@ -119,7 +119,7 @@ bool CommandParser::IsValidCommand(const std::string &commandname, unsigned int
 			{
 				if (user->IsModeSet(n->second->flags_needed))
 				{
-					return (user->HasPermission(commandname));
+					return (user->HasPermission(n->second));
 				}
 			}
 			else
@@ -162,7 +162,7 @@ CmdResult CommandParser::CallHandler(const std::string &commandname, const std::
 				if (user->IsModeSet(n->second->flags_needed))
 				{
 					/* if user has the flags, and now has the permissions, go ahead */
-					if (user->HasPermission(commandname))
+					if (user->HasPermission(n->second))
 						bOkay = true;
 				}
 			}
@@ -181,42 +181,123 @@ CmdResult CommandParser::CallHandler(const std::string &commandname, const std::
 	return CMD_INVALID;
 }
 
+/** The position of one token within a line being parsed */
+struct LineToken
+{
+	std::string::size_type pos;
+	std::string::size_type len;
+};
+
+/** Split a line into tokens as per RFC1459 in a single pass, without copying
+ * it. Runs of spaces separate tokens, and a token after the first which
+ * starts with a colon runs to the end of the line (without the colon).
+ * As with irc::tokenstream, leading spaces count as an empty first token,
+ * so the token after them may be a trailing one and is never a prefix.
+ * @param line The line to split
+ * @param tokens The array to store the token positions in
+ * @param max The number of entries in the array
+ * @return The number of tokens found, at most max
+ */
+static unsigned int SplitTokens(const std::string& line, LineToken* tokens, unsigned int max)
+{
+	const char* const start = line.data();
+	const char* const end = start + line.length();
+	const char* p = start;
+	unsigned int count = 0;
+
+	while (count < max)
+	{
+		while (p != end && *p == ' ')
+			p++;
+		if (p == end)
+			break;
+
+		if ((count || p != start) && *p == ':')
+		{
+			tokens[count].pos = p + 1 - start;
+			tokens[count].len = end - p - 1;
+			count++;
+			break;
+		}
+
+		const char* tokenend = static_cast<const char*>(memchr(p, ' ', end - p));
+		if (!tokenend)
+			tokenend = end;
+		tokens[count].pos = p - start;
+		tokens[count].len = tokenend - p;
+		count++;
+		p = tokenend;
+	}
+	return count;
+}
+
+Command* CommandParser::FindCommand(const std::string& commandname)
+{
+	// A cheap hash over the name picks the cache slot; the commands clients
+	// send most often don't share a slot, so they stay in the cache
+	unsigned int hash = 5381;
+	for (std::string::const_iterator c = commandname.begin(); c != commandname.end(); ++c)
+		hash = (hash * 33) ^ static_cast<unsigned char>(*c);
+
+	Command*& slot = cmdcache[hash % CMDCACHE_SIZE];
+	if (slot && slot->name == commandname)
+		return slot;
+
+	Commandtable::iterator n = cmdlist.find(commandname);
+	if (n == cmdlist.end())
+		return NULL;
+
+	slot = n->second;
+	return slot;
+}
+
+static Privilege privnothrottle("users/flood/no-throttle");
+
 bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 {
-	std::vector<std::string> command_p;
-	irc::tokenstream tokens(cmd);
-	std::string command, token;
-	tokens.GetToken(command);
+	// A prefix, the command, and one more parameter than MAXPARAMETERS
+	LineToken tokens[MAXPARAMETERS + 3];
+	unsigned int tokencount = SplitTokens(cmd, tokens, MAXPARAMETERS + 3);
 
 	/* A client sent a nick prefix on their command (ick)
 	 * rhapsody and some braindead bouncers do this --
 	 * the rfc says they shouldnt but also says the ircd should
 	 * discard it if they do.
 	 */
-	if ((command.empty() || command[0] == ':') && !tokens.GetToken(command))
+	unsigned int first = 0;
+	if (tokencount && cmd[0] == ':')
+		first = 1;
+
+	if (first >= tokencount)
 	{
 		// Penalise the user to discourage them from spamming the server with trash.
 		user->CommandFloodPenalty += 2000;
 		return false;
 	}
 
-	while (tokens.GetToken(token) && (command_p.size() <= MAXPARAMETERS))
-		command_p.push_back(token);
+	std::string command(cmd, tokens[first].pos, tokens[first].len);
+	for (std::string::iterator c = command.begin(); c != command.end(); ++c)
+		*c = toupper(*c);
 
-	std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+	// Anything past MAXPARAMETERS + 1 parameters is dropped
+	unsigned int paramcount = std::min<unsigned int>(tokencount - first - 1, MAXPARAMETERS + 1);
+	std::vector<std::string> command_p;
+	command_p.reserve(paramcount);
+	for (unsigned int i = first + 1; i <= first + paramcount; i++)
+		command_p.push_back(std::string(cmd, tokens[i].pos, tokens[i].len));
 
 	/* find the command, check it exists */
-	Commandtable::iterator cm = cmdlist.find(command);
+	Command* cm = FindCommand(command);
 
 	// Penalty to give if the command fails before the handler is executed
 	unsigned int failpenalty = 0;
 
 	/* Modify the user's penalty regardless of whether or not the command exists */
 	bool do_more = true;
-	if (!user->HasPrivPermission("users/flood/no-throttle"))
+	if (!user->HasPrivPermission(privnothrottle))
 	{
 		// If it *doesn't* exist, give it a slightly heftier penalty than normal to deter flooding us crap
-		unsigned int penalty = (cm != cmdlist.end() ? cm->second->Penalty * 1000 : 2000);
+		unsigned int penalty = (cm ? cm->Penalty * 1000 : 2000);
 		user->CommandFloodPenalty += penalty;
 
 		// Increase their penalty later if we fail and the command has 0 penalty by default (i.e. in Command::Penalty) to
@@ -227,7 +308,7 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 	}
 
 
-	if (cm == cmdlist.end())
+	if (!cm)
 	{
 		ModResult MOD_RESULT;
 		FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, command_p, user, false, cmd));
@@ -241,8 +322,8 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 		 * Thanks dz for making me actually understand why this is necessary!
 		 * -- w00t
 		 */
-		cm = cmdlist.find(command);
-		if (cm == cmdlist.end())
+		cm = FindCommand(command);
+		if (!cm)
 		{
 			if (user->registered == REG_ALL)
 				user->WriteNumeric(ERR_UNKNOWNCOMMAND, "%s %s :Unknown command",user->nick.c_str(),command.c_str());
@@ -251,7 +332,7 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 		}
 	}
 
-	if (cm->second->max_params && command_p.size() > cm->second->max_params)
+	if (cm->max_params && command_p.size() > cm->max_params)
 	{
 		/*
 		 * command_p input (assuming max_params 1):
@@ -259,32 +340,15 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 		 *	is
 		 *	a
 		 *	test
+		 *
+		 * Join everything from the last allowed parameter onwards back
+		 * together with single spaces, giving 'this is a test'.
 		 */
-		std::string lparam;
-
-		/*
-		 * The '-1' here is a clever trick, we'll go backwards throwing everything into a temporary param
-		 * and then just toss that into the array.
-		 * -- w00t
-		 */
-		while (command_p.size() > (cm->second->max_params - 1))
-		{
-			// BE CAREFUL: .end() returns past the end of the vector, hence decrement.
-			std::vector<std::string>::iterator it = command_p.end() - 1;
-
-			lparam.insert(0, " " + *(it));
-			command_p.erase(it); // remove last element
-		}
-
-		/* we now have (each iteration):
-		 *	' test'
-		 *	' a test'
-		 *	' is a test' <-- final string
-		 * ...now remove the ' ' at the start...
-		 */
-		lparam.erase(lparam.begin());
+		std::string lparam(command_p[cm->max_params - 1]);
+		for (std::vector<std::string>::const_iterator it = command_p.begin() + cm->max_params; it != command_p.end(); ++it)
+			lparam.append(" ").append(*it);
 
-		/* param is now 'is a test', which is exactly what we wanted! */
+		command_p.resize(cm->max_params - 1);
 		command_p.push_back(lparam);
 	}
 
@@ -300,15 +364,15 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 	/* activity resets the ping pending timer */
 	user->nping = ServerInstance->Time() + user->MyClass->GetPingTime();
 
-	if (cm->second->flags_needed)
+	if (cm->flags_needed)
 	{
-		if (!user->IsModeSet(cm->second->flags_needed))
+		if (!user->IsModeSet(cm->flags_needed))
 		{
 			user->CommandFloodPenalty += failpenalty;
 			user->WriteNumeric(ERR_NOPRIVILEGES, "%s :Permission Denied - You do not have the required operator privileges",user->nick.c_str());
 			return do_more;
 		}
-		if (!user->HasPermission(command))
+		if (!user->HasPermission(cm))
 		{
 			user->CommandFloodPenalty += failpenalty;
 			user->WriteNumeric(ERR_NOPRIVILEGES, "%s :Permission Denied - Oper type %s does not have access to command %s",
@@ -316,7 +380,7 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 			return do_more;
 		}
 	}
-	if ((user->registered == REG_ALL) && (!IS_OPER(user)) && (cm->second->IsDisabled()))
+	if ((user->registered == REG_ALL) && (!IS_OPER(user)) && (cm->IsDisabled()))
 	{
 		/* command is disabled! */
 		user->CommandFloodPenalty += failpenalty;
@@ -335,18 +399,18 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 		return do_more;
 	}
 
-	if ((!command_p.empty()) && (command_p.back().empty()) && (!cm->second->allow_empty_last_param))
+	if ((!command_p.empty()) && (command_p.back().empty()) && (!cm->allow_empty_last_param))
 		command_p.pop_back();
 
-	if (command_p.size() < cm->second->min_params)
+	if (command_p.size() < cm->min_params)
 	{
 		user->CommandFloodPenalty += failpenalty;
 		user->WriteNumeric(ERR_NEEDMOREPARAMS, "%s %s :Not enough parameters.", user->nick.c_str(), command.c_str());
-		if ((ServerInstance->Config->SyntaxHints) && (user->registered == REG_ALL) && (cm->second->syntax.length()))
-			user->WriteNumeric(RPL_SYNTAX, "%s :SYNTAX %s %s", user->nick.c_str(), cm->second->name.c_str(), cm->second->syntax.c_str());
+		if ((ServerInstance->Config->SyntaxHints) && (user->registered == REG_ALL) && (cm->syntax.length()))
+			user->WriteNumeric(RPL_SYNTAX, "%s :SYNTAX %s %s", user->nick.c_str(), cm->name.c_str(), cm->syntax.c_str());
 		return do_more;
 	}
-	if ((user->registered != REG_ALL) && (!cm->second->WorksBeforeReg()))
+	if ((user->registered != REG_ALL) && (!cm->WorksBeforeReg()))
 	{
 		user->CommandFloodPenalty += failpenalty;
 		user->WriteNumeric(ERR_NOTREGISTERED, "%s %s :You have not registered", user->nick.c_str(), command.c_str());
@@ -355,8 +419,8 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 	else
 	{
 		/* passed all checks.. first, do the (ugly) stats counters. */
-		cm->second->use_count++;
-		cm->second->total_bytes += cmd.length();
+		cm->use_count++;
+		cm->total_bytes += cmd.length();
 
 		/* module calls too */
 		FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, command_p, user, true, cmd));
@@ -366,7 +430,7 @@ bool CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 		/*
 		 * WARNING: be careful, the user may be deleted soon
 		 */
-		CmdResult result = cm->second->Handle(command_p, user);
+		CmdResult result = cm->Handle(command_p, user);
 
 		FOREACH_MOD(I_OnPostCommand,OnPostCommand(command, command_p, user, result,cmd));
 		return do_more;
@@ -378,6 +442,19 @@ void CommandParser::RemoveCommand(Command* x)
 	Commandtable::iterator n = cmdlist.find(x->name);
 	if (n != cmdlist.end() && n->second == x)
 		cmdlist.erase(n);
+
+	for (unsigned int i = 0; i < CMDCACHE_SIZE; i++)
+	{
+		if (cmdcache[i] == x)
+			cmdcache[i] = NULL;
+	}
+}
+
+Command::Command(Module* me, const std::string &cmd, int minpara, int maxpara) :
+	ServiceProvider(me, cmd, SERVICE_COMMAND), flags_needed(0), min_params(minpara), max_params(maxpara),
+	use_count(0), total_bytes(0), disabled(false), works_before_reg(false), allow_empty_last_param(true),
+	Penalty(1), permid(PermissionRegistry::GetId(PermissionRegistry::COMMAND, cmd))
+{
 }
 
 Command::~Command()
@@ -408,6 +485,8 @@ bool CommandParser::AddCommand(Command *f)
 
 CommandParser::CommandParser()
 {
+	for (unsigned int i = 0; i < CMDCACHE_SIZE; i++)
+		cmdcache[i] = NULL;
 }
 
 int CommandParser::TranslateUIDs(const std::vector<TranslateType> to, const std::vector<std::string> &source, std::string &dest, bool prefix_final, Command* custom_translator)
@@ -21,6 +21,7 @@
 
 #include "inspircd.h"
 #include "xline.h"
+#include "bancache.h"
 #include "commands/cmd_whowas.h"
 
 #ifdef _WIN32
@@ -196,6 +197,7 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :Read events:  "+ConvToStr(ServerInstance->SE->ReadEvents));
 			results.push_back(sn+" 249 "+user->nick+" :Write events: "+ConvToStr(ServerInstance->SE->WriteEvents));
 			results.push_back(sn+" 249 "+user->nick+" :Error events: "+ConvToStr(ServerInstance->SE->ErrorEvents));
+			results.push_back(sn+" 249 "+user->nick+" :Event mask changes: "+ConvToStr(ServerInstance->SE->ChangeCalls)+" (at most "+ConvToStr(ServerInstance->SE->MaxChangeCalls)+" per loop)");
 		break;
 
 		/* stats m (list number of times each command has been used, plus bytecount) */
@@ -216,6 +218,9 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :Users: "+ConvToStr(ServerInstance->Users->clientlist->size()));
 			results.push_back(sn+" 249 "+user->nick+" :Channels: "+ConvToStr(ServerInstance->chanlist->size()));
 			results.push_back(sn+" 249 "+user->nick+" :Commands: "+ConvToStr(ServerInstance->Parser->cmdlist.size()));
+			results.push_back(sn+" 249 "+user->nick+" :Ban cache: "+ConvToStr(ServerInstance->BanCache->Size())+"/"+ConvToStr(ServerInstance->Config->BanCacheSize)+
+				" entries, "+ConvToStr(ServerInstance->BanCache->Hits)+" hits, "+ConvToStr(ServerInstance->BanCache->Misses)+" misses, "+
+				ConvToStr(ServerInstance->BanCache->Evictions)+" evictions");
 
 			if (ServerInstance->Config->WhoWasGroupSize && ServerInstance->Config->WhoWasMaxGroups)
 			{
@@ -522,6 +522,7 @@ void ServerConfig::Fill()
 	AdminNick = ConfValue("admin")->getString("nick", "admin");
 	ModPath = ConfValue("path")->getString("moduledir", MOD_PATH);
 	NetBufferSize = ConfValue("performance")->getInt("netbuffersize", 10240);
+	BanCacheSize = ConfValue("performance")->getInt("bancachesize", 20000);
 	dns_timeout = ConfValue("dns")->getInt("timeout", 5);
 	DisabledCommands = ConfValue("disabled")->getString("commands", "");
 	DisabledDontExist = ConfValue("disabled")->getBool("fakenonexistant");
@@ -568,6 +569,7 @@ void ServerConfig::Fill()
 		range(MaxConn, 0, SOMAXCONN, SOMAXCONN, "<performance:somaxconn>");
 	range(MaxTargets, 1, 31, 20, "<security:maxtargets>");
 	range(NetBufferSize, 1024, 65534, 10240, "<performance:netbuffersize>");
+	range(BanCacheSize, 0, 10000000, 20000, "<performance:bancachesize>");
 	range(WhoWasGroupSize, 0, 10000, 10, "<whowas:groupsize>");
 	range(WhoWasMaxGroups, 0, 1000000, 10240, "<whowas:maxgroups>");
 	range(WhoWasMaxKeep, 3600, INT_MAX, 3600, "<whowas:maxkeep>");
@@ -972,6 +974,7 @@ void ConfigReaderThread::Finish()
 		Config->ApplyDisabledCommands(Config->DisabledCommands);
 		User* user = ServerInstance->FindNick(TheUserUID);
 		FOREACH_MOD(I_OnRehash, OnRehash(user));
+		Channel::InvalidateAllBanCaches();
 		ServerInstance->BuildISupport();
 
 		ServerInstance->Logs->CloseLogs();
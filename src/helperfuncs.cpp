@@ -101,12 +101,7 @@ User* InspIRCd::FindNickOnly(const char* nick)
 
 User *InspIRCd::FindUUID(const std::string &uid)
 {
-	user_hash::iterator finduuid = this->Users->uuidlist->find(uid);
-
-	if (finduuid == this->Users->uuidlist->end())
-		return NULL;
-
-	return finduuid->second;
+	return this->Users->uuidlist->find(uid);
 }
 
 User *InspIRCd::FindUUID(const char *uid)
@@ -204,12 +204,6 @@ void InspIRCd::RehashUsersAndChans()
 		Users->clientlist->insert(*n);
 	delete old_users;
 
-	user_hash* old_uuid = Users->uuidlist;
-	Users->uuidlist = new user_hash;
-	for (user_hash::const_iterator n = old_uuid->begin(); n != old_uuid->end(); n++)
-		Users->uuidlist->insert(*n);
-	delete old_uuid;
-
 	chan_hash* old_chans = chanlist;
 	chanlist = new chan_hash;
 	for (chan_hash::const_iterator n = old_chans->begin(); n != old_chans->end(); n++)
@@ -223,11 +217,6 @@ void InspIRCd::RehashUsersAndChans()
 		(**i).already_sent = 0;
 		(**i).RemoveExpiredInvites();
 	}
-
-	// HACK: ELines are not expired properly at the moment but it can't be fixed as
-	// the 2.0 XLine system is a spaghetti nightmare. Instead we skip over expired
-	// ELines in XLineManager::CheckELines() and expire them here instead.
-	ServerInstance->XLines->GetAll("E");
 }
 
 void InspIRCd::SetSignals()
@@ -389,7 +378,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	this->Users = new UserManager;
 
 	this->Users->clientlist = new user_hash();
-	this->Users->uuidlist = new user_hash();
+	this->Users->uuidlist = new UIDTable<User>();
 	this->chanlist = new chan_hash();
 
 	this->Config = new ServerConfig;
@@ -837,7 +826,6 @@ int InspIRCd::Run()
 			}
 
 			Timers->TickTimers(TIME.tv_sec);
-			this->DoBackgroundUserStuff();
 
 			if ((TIME.tv_sec % 5) == 0)
 			{
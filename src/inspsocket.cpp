@@ -221,11 +221,13 @@ static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
 
 void StreamSocket::DoWrite()
 {
-	if (sendq.empty())
+	// An IOHook may have buffered output of its own which it needs a write event to flush
+	if (sendq.empty() && !IOHook)
 		return;
 	if (!error.empty() || fd < 0 || fd == INT_MAX)
 	{
-		ServerInstance->Logs->Log("SOCKET", DEBUG, "DoWrite on errored or closed socket");
+		if (!sendq.empty())
+			ServerInstance->Logs->Log("SOCKET", DEBUG, "DoWrite on errored or closed socket");
 		return;
 	}
 
@@ -236,55 +238,67 @@ void StreamSocket::DoWrite()
 		int rv = -1;
 		try
 		{
+			if (sendq.empty())
+			{
+				std::string buffer;
+				rv = IOHook->OnStreamSocketWrite(this, buffer);
+				if (rv < 0)
+					SetError("Write Error");
+				return;
+			}
+
 			while (error.empty() && !sendq.empty())
 			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
+				if (IOHook)
 				{
-					// Avoid multiple repeated SSL encryption invocations
-					// This adds a single copy of the queue, but avoids
-					// much more overhead in terms of system calls invoked
+					// The IOHook may modify the buffer it is given, and the buffers
+					// on the sendq can be shared with other sockets, so hand it a
+					// private copy of the front of the queue.
+					//
+					// Merge small entries into that copy to avoid multiple repeated
+					// SSL encryption invocations. This adds a single copy of the queue,
+					// but avoids much more overhead in terms of system calls invoked
 					// by the IOHook.
 					//
 					// The length limit of 1024 is to prevent merging strings
 					// more than once when writes begin to block.
-					std::string tmp;
-					tmp.reserve(1280);
-					while (!sendq.empty() && tmp.length() < 1024)
-					{
-						tmp.append(sendq.front());
+					//
+					// The merged entries stay on the queue until the IOHook has
+					// returned, so that nothing is lost if it throws.
+					std::string buffer(sendq.front().data(), sendq.front().length());
+					std::deque<SendQElement>::iterator merged = sendq.begin();
+					for (++merged; merged != sendq.end() && buffer.length() < 1024; ++merged)
+						buffer.append(merged->data(), merged->length());
+					size_t mergedcount = std::distance(sendq.begin(), merged);
+					int itemlen = buffer.length();
+					rv = IOHook->OnStreamSocketWrite(this, buffer);
+					for (size_t i = 0; i < mergedcount; i++)
 						sendq.pop_front();
-					}
-					sendq.push_front(tmp);
-				}
-				std::string& front = sendq.front();
-				int itemlen = front.length();
-				if (IOHook)
-				{
-					rv = IOHook->OnStreamSocketWrite(this, front);
 					if (rv > 0)
 					{
 						// consumed the entire string, and is ready for more
 						sendq_len -= itemlen;
-						sendq.pop_front();
+						continue;
 					}
-					else if (rv == 0)
-					{
-						// socket has blocked. Stop trying to send data.
-						// IOHook has requested unblock notification from the socketengine
 
-						// Since it is possible that a partial write took place, adjust sendq_len
-						sendq_len = sendq_len - itemlen + front.length();
-						return;
-					}
-					else
-					{
+					// Whatever the IOHook did not consume goes back on the front of the queue.
+					// Since it is possible that a partial write took place, adjust sendq_len
+					sendq_len = sendq_len - itemlen + buffer.length();
+					if (!buffer.empty())
+						sendq.push_front(SendQElement(new SendQBuffer(buffer)));
+
+					if (rv < 0)
 						SetError("Write Error"); // will not overwrite a better error message
-						return;
-					}
+
+					// otherwise the socket has blocked. Stop trying to send data.
+					// IOHook has requested unblock notification from the socketengine
+					return;
 				}
 #ifdef DISABLE_WRITEV
 				else
 				{
+					SendQElement& front = sendq.front();
+					int itemlen = front.length();
 					rv = ServerInstance->SE->Send(this, front.data(), itemlen, 0);
 					if (rv == 0)
 					{
@@ -302,7 +316,7 @@ void StreamSocket::DoWrite()
 					else if (rv < itemlen)
 					{
 						ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						front = front.substr(rv);
+						front.pos += rv;
 						sendq_len -= rv;
 						return;
 					}
@@ -343,7 +357,7 @@ void StreamSocket::DoWrite()
 			}
 
 			int rv_max = 0;
-			iovec* iovecs = new iovec[bufcount];
+			iovec iovecs[MYIOV_MAX];
 			for(int i=0; i < bufcount; i++)
 			{
 				iovecs[i].iov_base = const_cast<char*>(sendq[i].data());
@@ -351,7 +365,6 @@ void StreamSocket::DoWrite()
 				rv_max += sendq[i].length();
 			}
 			int rv = writev(fd, iovecs, bufcount);
-			delete[] iovecs;
 
 			if (rv == (int)sendq_len)
 			{
@@ -371,17 +384,17 @@ void StreamSocket::DoWrite()
 				sendq_len -= rv;
 				while (rv > 0 && !sendq.empty())
 				{
-					std::string& front = sendq.front();
+					SendQElement& front = sendq.front();
 					if (front.length() <= (size_t)rv)
 					{
-						// this string got fully written out
+						// this buffer got fully written out
 						rv -= front.length();
 						sendq.pop_front();
 					}
 					else
 					{
-						// stopped in the middle of this string
-						front = front.substr(rv);
+						// stopped in the middle of this buffer
+						front.pos += rv;
 						rv = 0;
 					}
 				}
@@ -427,12 +440,28 @@ void StreamSocket::WriteData(const std::string &data)
 	}
 
 	/* Append the data to the back of the queue ready for writing */
-	sendq.push_back(data);
+	sendq.push_back(SendQElement(new SendQBuffer(data)));
 	sendq_len += data.length();
 
 	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
 
+void StreamSocket::WriteData(const reference<SendQBuffer>& data)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", DEBUG, "Attempt to write data to dead socket: %s",
+			data->data.c_str());
+		return;
+	}
+
+	/* Append the shared buffer to the back of the queue ready for writing */
+	sendq.push_back(SendQElement(data));
+	sendq_len += data->data.length();
+
+	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
 void SocketTimeout::Tick(time_t)
 {
 	ServerInstance->Logs->Log("SOCKET", DEBUG,"SocketTimeout::Tick");
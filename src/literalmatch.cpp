@@ -0,0 +1,293 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* $Core */
+
+#include "inspircd.h"
+#include "literalmatch.h"
+
+bool LiteralMatcher::IsLiteralChar(unsigned char c)
+{
+	// rfc1459 and the national casemappings also fold these, and may fold any high character
+	return (c && c < 0x80 && !strchr("[]\\^{}|~", c));
+}
+
+/** Tracks the longest run of literal characters seen by one of the extractors below */
+struct LiteralRun
+{
+	std::string best;
+	std::string run;
+
+	void Push(char c)
+	{
+		run.push_back(c);
+	}
+
+	/** Drops the last character pushed, for when a quantifier turns out to make it optional */
+	void Pop()
+	{
+		if (!run.empty())
+			run.erase(run.length() - 1);
+	}
+
+	/** Ends the current run at something which isn't a literal character */
+	void Break()
+	{
+		if (run.length() > best.length())
+			best.swap(run);
+		run.clear();
+	}
+};
+
+std::string LiteralMatcher::GlobLiteral(const std::string& glob)
+{
+	LiteralRun lit;
+	for (std::string::const_iterator c = glob.begin(); c != glob.end(); ++c)
+	{
+		if (*c != '*' && *c != '?' && IsLiteralChar(*c))
+			lit.Push(*c);
+		else
+			lit.Break();
+	}
+	lit.Break();
+	return lit.best;
+}
+
+/** Returns the position just past the bracket expression whose '[' is at pos - 1 */
+static std::string::size_type SkipBracket(const std::string& rx, std::string::size_type pos)
+{
+	if (pos < rx.length() && rx[pos] == '^')
+		pos++;
+	if (pos < rx.length() && rx[pos] == ']')
+		pos++;
+	while (pos < rx.length())
+	{
+		if (rx[pos] == ']')
+			return pos + 1;
+
+		if (rx[pos] == '\\')
+		{
+			// PCRE allows escapes in brackets and POSIX doesn't; taking it as one keeps the bracket longer either way
+			pos += 2;
+		}
+		else if (rx[pos] == '[' && pos + 1 < rx.length() && strchr(":.=", rx[pos + 1]))
+		{
+			// [:class:], [.coll.] and [=equiv=]
+			std::string::size_type end = rx.find(std::string(1, rx[pos + 1]) + "]", pos + 2);
+			pos = (end == std::string::npos ? rx.length() : end + 2);
+		}
+		else
+			pos++;
+	}
+	return rx.length();
+}
+
+/** Returns the position just past the group whose opening parenthesis ends at pos - 1 */
+static std::string::size_type SkipGroup(const std::string& rx, std::string::size_type pos)
+{
+	// Count both ( and \( as opening, as they are the other way round in POSIX basic syntax
+	unsigned int depth = 1;
+	while (pos < rx.length())
+	{
+		char c = rx[pos++];
+		if (c == '\\' && pos < rx.length())
+			c = rx[pos++];
+		else if (c == '[')
+		{
+			pos = SkipBracket(rx, pos);
+			continue;
+		}
+
+		if (c == '(')
+			depth++;
+		else if (c == ')' && !--depth)
+			return pos;
+	}
+	return rx.length();
+}
+
+std::string LiteralMatcher::RegexLiteral(const std::string& regex)
+{
+	// \| is alternation in GNU basic syntax, and a literal | elsewhere
+	if (regex.find("\\|") != std::string::npos)
+		return "";
+
+	LiteralRun lit;
+	// True if the last atom was a literal character, which a following quantifier applies to
+	bool lastchar = false;
+	// True if that character was followed by +, so it ends the run but may still be made optional
+	bool repeated = false;
+
+	std::string::size_type pos = 0;
+	while (pos < regex.length())
+	{
+		char c = regex[pos++];
+		bool escaped = false;
+
+		if (c == '\\')
+		{
+			if (pos == regex.length())
+				break;
+			c = regex[pos++];
+			escaped = true;
+
+			if (isalnum(static_cast<unsigned char>(c)))
+			{
+				// Character classes, anchors, backreferences and numeric escapes like \x41 or \cA.
+				// Skip any digits or braced argument so that they aren't mistaken for literal text.
+				while (pos < regex.length() && isalnum(static_cast<unsigned char>(regex[pos])))
+					pos++;
+				if (pos < regex.length() && strchr("{<'", regex[pos]))
+				{
+					std::string::size_type end = regex.find(regex[pos] == '{' ? '}' : (regex[pos] == '<' ? '>' : '\''), pos + 1);
+					pos = (end == std::string::npos ? regex.length() : end + 1);
+				}
+				lit.Break();
+				lastchar = repeated = false;
+				continue;
+			}
+		}
+
+		switch (c)
+		{
+			case '|':
+				// Alternation means nothing is required
+				return "";
+
+			case '(':
+				// \( is literal outside POSIX basic syntax, and so doesn't keep an alternation inside it from applying to everything
+				if (escaped && regex.find('|') != std::string::npos)
+					return "";
+
+				if (!escaped && pos < regex.length() && regex[pos] == '?')
+				{
+					// (?x) and friends make whitespace and # comments insignificant
+					std::string::size_type end = regex.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-^", pos + 1);
+					if (regex.find('x', pos + 1) < end)
+						return "";
+				}
+				pos = SkipGroup(regex, pos);
+				lit.Break();
+				lastchar = repeated = false;
+				break;
+
+			case '[':
+				if (!escaped)
+					pos = SkipBracket(regex, pos);
+				lit.Break();
+				lastchar = repeated = false;
+				break;
+
+			case '*':
+			case '?':
+			case '{':
+				// A quantifier allowing zero repetitions (or a literal character when escaped, which doesn't matter here)
+				if (lastchar)
+					lit.Pop();
+				if (c == '{')
+				{
+					std::string::size_type end = regex.find('}', pos);
+					pos = (end == std::string::npos ? regex.length() : end + 1);
+				}
+				lit.Break();
+				lastchar = repeated = false;
+				break;
+
+			case '+':
+				// At least one repetition, so the last character stays unless something like *+ follows
+				if (lastchar)
+					repeated = true;
+				else
+					lit.Break();
+				break;
+
+			default:
+				// Of the escaped punctuation, only these are literal in every syntax (\< is a word boundary in GNU's, for one)
+				if (escaped ? (c && strchr(".$/-", c)) : (!strchr(".^$)}", c) && IsLiteralChar(c)))
+				{
+					if (repeated)
+						lit.Break();
+					lit.Push(c);
+					lastchar = true;
+					repeated = false;
+				}
+				else
+				{
+					lit.Break();
+					lastchar = repeated = false;
+				}
+				break;
+		}
+	}
+	lit.Break();
+	return lit.best;
+}
+
+void LiteralMatcher::Clear()
+{
+	nodes.clear();
+	nodes.resize(1);
+}
+
+void LiteralMatcher::Add(const std::string& literal, unsigned int id)
+{
+	unsigned int node = 0;
+	for (std::string::const_iterator c = literal.begin(); c != literal.end(); ++c)
+	{
+		unsigned char folded = ascii_case_insensitive_map[static_cast<unsigned char>(*c)];
+		unsigned int child = Child(node, folded);
+		if (child == npos)
+		{
+			child = nodes.size();
+			nodes[node].next.push_back(std::make_pair(folded, child));
+			nodes.push_back(Node());
+		}
+		node = child;
+	}
+	nodes[node].ids.push_back(id);
+}
+
+void LiteralMatcher::Compile()
+{
+	// Breadth first, so that every node's fail target is done before the node itself
+	std::vector<unsigned int> queue;
+	for (std::vector<std::pair<unsigned char, unsigned int> >::const_iterator i = nodes[0].next.begin(); i != nodes[0].next.end(); ++i)
+	{
+		nodes[i->second].fail = 0;
+		nodes[i->second].output = 0;
+		queue.push_back(i->second);
+	}
+
+	for (std::vector<unsigned int>::size_type head = 0; head < queue.size(); head++)
+	{
+		unsigned int parent = queue[head];
+		for (std::vector<std::pair<unsigned char, unsigned int> >::const_iterator i = nodes[parent].next.begin(); i != nodes[parent].next.end(); ++i)
+		{
+			unsigned int fail = nodes[parent].fail;
+			unsigned int target;
+			while ((target = Child(fail, i->first)) == npos && fail)
+				fail = nodes[fail].fail;
+			if (target == npos)
+				target = 0;
+
+			Node& child = nodes[i->second];
+			child.fail = target;
+			child.output = (nodes[target].ids.empty() ? nodes[target].output : target);
+			queue.push_back(i->second);
+		}
+	}
+}
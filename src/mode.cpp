@@ -379,6 +379,18 @@ ModeAction ModeParser::TryMode(User* user, User* targetuser, Channel* chan, bool
 	if (ma != MODEACTION_ALLOW)
 		return ma;
 
+	// Ban results cached on memberships depend on the channel's list modes and
+	// on user modes; prefix modes are handled by Channel::SetPrefix
+	if (chan)
+	{
+		if (mh->IsListMode() && !mh->GetPrefix())
+			chan->InvalidateBanCache();
+	}
+	else if (targetuser)
+	{
+		targetuser->InvalidateBanCache();
+	}
+
 	for (ModeWatchIter watchers = modewatchers[handler_id].begin(); watchers != modewatchers[handler_id].end(); watchers++)
 		(*watchers)->AfterMode(user, targetuser, chan, parameter, adding, type);
 
@@ -113,6 +113,7 @@ bool ModuleManager::Load(const std::string& name, bool defer)
 		return false;
 	}
 	FOREACH_MOD(I_OnLoadModule,OnLoadModule(mod));
+	Channel::InvalidateAllBanCaches();
 	/* We give every module a chance to re-prioritize when we introduce a new one,
 	 * not just the one thats loading, as the new module could affect the preference
 	 * of others
@@ -349,6 +349,7 @@ bool ModuleManager::CanUnload(Module* mod)
 void ModuleManager::DoSafeUnload(Module* mod)
 {
 	std::map<std::string, Module*>::iterator modfind = Modules.find(mod->ModuleSourceFile);
+	Channel::InvalidateAllBanCaches();
 
 	std::vector<reference<ExtensionItem> > items;
 	ServerInstance->Extensions.BeginUnregister(modfind->second, items);
@@ -25,6 +25,7 @@
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 #include "ssl.h"
+#include "ssl_offload.h"
 #include "m_cap.h"
 
 #ifdef _WIN32
@@ -59,6 +60,11 @@ typedef gnutls_dh_params_t gnutls_dh_params;
 # include <gcrypt.h>
 #endif
 
+// GnuTLS 3 does its own locking, which is needed to run sessions on worker threads.
+#if (GNUTLS_VERSION_MAJOR >= 3)
+# define INSPIRCD_GNUTLS_ENABLE_THREADS
+#endif
+
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING_READ, ISSL_HANDSHAKING_WRITE, ISSL_HANDSHAKEN, ISSL_CLOSING, ISSL_CLOSED };
 
 struct SSLConfig : public refcountbase
@@ -153,16 +159,83 @@ public:
 	issl_status status;
 	reference<ssl_cert> cert;
 	reference<SSLConfig> config;
+	std::string cipher;
+
+	/** Set if the session's TLS processing is done on a worker thread */
+	SSLOffloadSession* offload;
 
-	issl_session() : socket(NULL), sess(NULL), status(ISSL_NONE) {}
+	issl_session() : socket(NULL), sess(NULL), status(ISSL_NONE), offload(NULL) {}
 };
 
 static SSLConfig* GetSessionConfig(gnutls_session_t sess)
 {
-	issl_session* session = reinterpret_cast<issl_session*>(gnutls_transport_get_ptr(sess));
+	issl_session* session = reinterpret_cast<issl_session*>(gnutls_session_get_ptr(sess));
 	return session->config;
 }
 
+class ModuleSSLGnuTLS;
+
+/** Runs a GnuTLS session on a worker thread, with the transport reading from
+ * and writing to memory buffers
+ */
+class GnuTLSOffload : public SSLOffloadSession
+{
+	ModuleSSLGnuTLS* const mod;
+	StreamSocket* const user;
+	issl_session* const session;
+	gnutls_session_t const sess;
+
+	/** Ciphertext received but not yet taken by GnuTLS */
+	std::string inbuf;
+	/** Ciphertext written by GnuTLS */
+	std::string outbuf;
+	/** Plaintext waiting for the handshake to finish */
+	std::string pending;
+	/** True once the handshake has finished */
+	bool open;
+
+	static ssize_t PullWrapper(gnutls_transport_ptr_t ptr, void* buffer, size_t size)
+	{
+		GnuTLSOffload* offload = reinterpret_cast<GnuTLSOffload*>(ptr);
+		if (offload->inbuf.empty())
+		{
+			gnutls_transport_set_errno(offload->sess, EAGAIN);
+			return -1;
+		}
+
+		size_t len = std::min(size, offload->inbuf.length());
+		memcpy(buffer, offload->inbuf.data(), len);
+		offload->inbuf.erase(0, len);
+		return len;
+	}
+
+	static ssize_t PushWrapper(gnutls_transport_ptr_t ptr, const void* buffer, size_t size)
+	{
+		GnuTLSOffload* offload = reinterpret_cast<GnuTLSOffload*>(ptr);
+		offload->outbuf.append(static_cast<const char*>(buffer), size);
+		return size;
+	}
+
+ protected:
+	bool Process(const std::string& cipherdata, const std::string& plaindata, std::string& plain, std::string& cipher, bool& done, std::string& err);
+	void OnHandshake();
+	void Shutdown(std::string& cipher);
+
+ public:
+	GnuTLSOffload(ModuleSSLGnuTLS* Mod, StreamSocket* Sock, issl_session* Session, SSLOffloadWorker* Worker)
+		: SSLOffloadSession(Sock, Worker)
+		, mod(Mod)
+		, user(Sock)
+		, session(Session)
+		, sess(Session->sess)
+		, open(false)
+	{
+		gnutls_transport_set_ptr(sess, reinterpret_cast<gnutls_transport_ptr_t>(this));
+		gnutls_transport_set_push_function(sess, PushWrapper);
+		gnutls_transport_set_pull_function(sess, PullWrapper);
+	}
+};
+
 class CommandStartTLS : public SplitCommand
 {
  public:
@@ -225,6 +298,9 @@ class ModuleSSLGnuTLS : public Module
 	GenericCap capHandler;
 	ServiceProvider iohook;
 
+	/** Worker threads for TLS processing, if enabled */
+	SSLOffloadPool pool;
+
 	inline static const char* UnknownIfNULL(const char* str)
 	{
 		return str ? str : "UNKNOWN";
@@ -321,6 +397,18 @@ class ModuleSSLGnuTLS : public Module
 
 		ServerInstance->Modules->AddService(iohook);
 		ServerInstance->Modules->AddService(starttls);
+
+		// Changing this needs a module reload
+		unsigned int threads = ServerInstance->Config->ConfValue("gnutls")->getInt("threads");
+		if (threads)
+		{
+#ifdef INSPIRCD_GNUTLS_ENABLE_THREADS
+			pool.Start(threads);
+			ServerInstance->Logs->Log("m_ssl_gnutls", DEFAULT, "m_ssl_gnutls.so: Running TLS sessions on %u worker threads", threads);
+#else
+			ServerInstance->Logs->Log("m_ssl_gnutls", DEFAULT, "m_ssl_gnutls.so: <gnutls:threads> needs GnuTLS 3.0 or later, ignoring it");
+#endif
+		}
 	}
 
 	void OnRehash(User* user)
@@ -561,6 +649,7 @@ class ModuleSSLGnuTLS : public Module
 
 	~ModuleSSLGnuTLS()
 	{
+		pool.Stop();
 		currconf = NULL;
 
 		gnutls_global_deinit();
@@ -639,13 +728,24 @@ class ModuleSSLGnuTLS : public Module
 		#endif
 		gnutls_credentials_set(session->sess, GNUTLS_CRD_CERTIFICATE, currconf->x509_cred);
 		gnutls_dh_set_prime_bits(session->sess, dh_bits);
-		gnutls_transport_set_ptr(session->sess, reinterpret_cast<gnutls_transport_ptr_t>(session));
-		gnutls_transport_set_push_function(session->sess, gnutls_push_wrapper);
-		gnutls_transport_set_pull_function(session->sess, gnutls_pull_wrapper);
+		gnutls_session_set_ptr(session->sess, session);
 
 		if (me_server)
 			gnutls_certificate_server_set_request(session->sess, GNUTLS_CERT_REQUEST); // Request client certificate if any.
 
+		if (pool.IsActive())
+		{
+			session->status = ISSL_HANDSHAKING_READ;
+			session->offload = new GnuTLSOffload(this, user, session, pool.GetWorker());
+			session->offload->Start();
+			ServerInstance->SE->ChangeEventMask(user, FD_WANT_FAST_READ | FD_WANT_NO_WRITE);
+			return;
+		}
+
+		gnutls_transport_set_ptr(session->sess, reinterpret_cast<gnutls_transport_ptr_t>(session));
+		gnutls_transport_set_push_function(session->sess, gnutls_push_wrapper);
+		gnutls_transport_set_pull_function(session->sess, gnutls_pull_wrapper);
+
 		Handshake(session, user);
 	}
 
@@ -674,6 +774,9 @@ class ModuleSSLGnuTLS : public Module
 	{
 		issl_session* session = &sessions[user->GetFd()];
 
+		if (session->offload)
+			return session->offload->OnRead(recvq);
+
 		if (!session->sess)
 		{
 			CloseSession(session);
@@ -735,6 +838,9 @@ class ModuleSSLGnuTLS : public Module
 	{
 		issl_session* session = &sessions[user->GetFd()];
 
+		if (session->offload)
+			return session->offload->OnWrite(sendq);
+
 		if (!session->sess)
 		{
 			CloseSession(session);
@@ -751,6 +857,9 @@ class ModuleSSLGnuTLS : public Module
 			return -1;
 		}
 
+		if (sendq.empty())
+			return 1;
+
 		int ret = 0;
 
 		if (session->status == ISSL_HANDSHAKEN)
@@ -822,6 +931,7 @@ class ModuleSSLGnuTLS : public Module
 			session->status = ISSL_HANDSHAKEN;
 
 			VerifyCertificate(session,user);
+			session->cipher = GetCipherName(session->sess);
 
 			// Finish writing, if any left
 			ServerInstance->SE->ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
@@ -834,12 +944,9 @@ class ModuleSSLGnuTLS : public Module
 	{
 		if (user->eh.GetIOHook() == this)
 		{
-			if (sessions[user->eh.GetFd()].sess)
+			if (sessions[user->eh.GetFd()].sess && sessions[user->eh.GetFd()].cert)
 			{
-				const gnutls_session_t& sess = sessions[user->eh.GetFd()].sess;
-				std::string cipher = UnknownIfNULL(gnutls_kx_get_name(gnutls_kx_get(sess)));
-				cipher.append("-").append(UnknownIfNULL(gnutls_cipher_get_name(gnutls_cipher_get(sess)))).append("-");
-				cipher.append(UnknownIfNULL(gnutls_mac_get_name(gnutls_mac_get(sess))));
+				const std::string& cipher = sessions[user->eh.GetFd()].cipher;
 
 				ssl_cert* cert = sessions[user->eh.GetFd()].cert;
 				if (cert->fingerprint.empty())
@@ -851,18 +958,35 @@ class ModuleSSLGnuTLS : public Module
 		}
 	}
 
+	static std::string GetCipherName(gnutls_session_t sess)
+	{
+		std::string cipher = UnknownIfNULL(gnutls_kx_get_name(gnutls_kx_get(sess)));
+		cipher.append("-").append(UnknownIfNULL(gnutls_cipher_get_name(gnutls_cipher_get(sess)))).append("-");
+		cipher.append(UnknownIfNULL(gnutls_mac_get_name(gnutls_mac_get(sess))));
+		return cipher;
+	}
+
 	void CloseSession(issl_session* session)
 	{
-		if (session->sess)
+		if (session->offload)
+		{
+			// This sends the bye, and leaves the GnuTLS session to us
+			session->offload->Close();
+			session->offload = NULL;
+		}
+		else if (session->sess)
 		{
 			gnutls_bye(session->sess, GNUTLS_SHUT_WR);
-			gnutls_deinit(session->sess);
 		}
+
+		if (session->sess)
+			gnutls_deinit(session->sess);
 		session->socket = NULL;
 		session->sess = NULL;
 		session->cert = NULL;
 		session->status = ISSL_NONE;
 		session->config = NULL;
+		session->cipher.clear();
 	}
 
 	void VerifyCertificate(issl_session* session, StreamSocket* user)
@@ -986,4 +1110,87 @@ info_done_dealloc:
 	}
 };
 
+bool GnuTLSOffload::Process(const std::string& cipherdata, const std::string& plaindata, std::string& plain, std::string& cipher, bool& done, std::string& err)
+{
+	bool ok = true;
+
+	inbuf.append(cipherdata);
+	pending.append(plaindata);
+
+	if (!open)
+	{
+		int ret = gnutls_handshake(sess);
+		if (ret == 0)
+		{
+			open = true;
+			done = true;
+		}
+		else if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED)
+		{
+			err = "Handshake Failed - " + std::string(gnutls_strerror(ret));
+			ok = false;
+		}
+	}
+
+	if (open)
+	{
+		char buffer[16384];
+		while (ok)
+		{
+			int ret = gnutls_record_recv(sess, buffer, sizeof(buffer));
+			if (ret > 0)
+			{
+				plain.append(buffer, ret);
+			}
+			else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+			{
+				break;
+			}
+			else
+			{
+				err = ret ? gnutls_strerror(ret) : "Connection closed";
+				ok = false;
+			}
+		}
+
+		// The push function never blocks, so this only stops on an error
+		while (ok && !pending.empty())
+		{
+			int ret = gnutls_record_send(sess, pending.data(), pending.length());
+			if (ret > 0)
+			{
+				pending.erase(0, ret);
+			}
+			else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
+			{
+				break;
+			}
+			else
+			{
+				err = gnutls_strerror(ret);
+				ok = false;
+			}
+		}
+	}
+
+	cipher.append(outbuf);
+	outbuf.clear();
+	return ok;
+}
+
+void GnuTLSOffload::OnHandshake()
+{
+	session->status = ISSL_HANDSHAKEN;
+	mod->VerifyCertificate(session, user);
+	session->cipher = ModuleSSLGnuTLS::GetCipherName(sess);
+}
+
+void GnuTLSOffload::Shutdown(std::string& cipher)
+{
+	if (open)
+		gnutls_bye(sess, GNUTLS_SHUT_WR);
+	cipher.append(outbuf);
+	outbuf.clear();
+}
+
 MODULE_INIT(ModuleSSLGnuTLS)
@@ -36,6 +36,7 @@
 #include <openssl/dh.h>
 #include <openssl/x509.h>
 #include "ssl.h"
+#include "ssl_offload.h"
 
 #ifdef _WIN32
 # pragma comment(lib, "ssleay32.lib")
@@ -53,6 +54,11 @@
 	SSL_load_error_strings();
 #endif
 
+// OpenSSL 1.1 does its own locking, which is needed to run sessions on worker threads.
+#if ((!defined LIBRESSL_VERSION_NUMBER) && (OPENSSL_VERSION_NUMBER >= 0x10100000L))
+# define INSPIRCD_OPENSSL_ENABLE_THREADS
+#endif
+
 /* $ModDesc: Provides SSL support for clients */
 
 /* $LinkerFlags: if("USE_FREEBSD_BASE_SSL") -lssl -lcrypto */
@@ -66,8 +72,6 @@ class ModuleSSLOpenSSL;
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING, ISSL_OPEN };
 
-static bool SelfSigned = false;
-
 #ifdef INSPIRCD_OPENSSL_ENABLE_RENEGO_DETECTION
 static ModuleSSLOpenSSL* opensslmod = NULL;
 #endif
@@ -91,13 +95,70 @@ public:
 
 	bool outbound;
 	bool data_to_write;
+	bool selfsigned;
+	std::string cipher;
+
+	/** Set if the session's TLS processing is done on a worker thread */
+	SSLOffloadSession* offload;
 
 	issl_session()
 		: sess(NULL)
 		, status(ISSL_NONE)
+		, offload(NULL)
 	{
 		outbound = false;
 		data_to_write = false;
+		selfsigned = false;
+	}
+};
+
+/** Runs an OpenSSL session on a worker thread, through a pair of memory BIOs
+ */
+class OpenSSLOffload : public SSLOffloadSession
+{
+	ModuleSSLOpenSSL* const mod;
+	StreamSocket* const user;
+	issl_session* const session;
+	SSL* const sess;
+	BIO* const rbio;
+	BIO* const wbio;
+
+	/** Plaintext waiting for the handshake to finish */
+	std::string pending;
+	/** True once the handshake has finished */
+	bool open;
+
+	static std::string GetError(const std::string& prefix)
+	{
+		char buf[256];
+		unsigned long err = ERR_get_error();
+		if (!err)
+			return prefix + "unknown";
+		ERR_error_string_n(err, buf, sizeof(buf));
+		return prefix + buf;
+	}
+
+ protected:
+	bool Process(const std::string& cipherdata, const std::string& plaindata, std::string& plain, std::string& cipher, bool& done, std::string& err);
+	void OnHandshake();
+	void Shutdown(std::string& cipher);
+
+ public:
+	OpenSSLOffload(ModuleSSLOpenSSL* Mod, StreamSocket* Sock, issl_session* Session, SSLOffloadWorker* Worker)
+		: SSLOffloadSession(Sock, Worker)
+		, mod(Mod)
+		, user(Sock)
+		, session(Session)
+		, sess(Session->sess)
+		, rbio(BIO_new(BIO_s_mem()))
+		, wbio(BIO_new(BIO_s_mem()))
+		, open(false)
+	{
+		SSL_set_bio(sess, rbio, wbio);
+		if (session->outbound)
+			SSL_set_connect_state(sess);
+		else
+			SSL_set_accept_state(sess);
 	}
 };
 
@@ -110,7 +171,11 @@ static int OnVerify(int preverify_ok, X509_STORE_CTX *ctx)
 	 */
 	int ve = X509_STORE_CTX_get_error(ctx);
 
-	SelfSigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
+	// This may be running on a worker thread, so record it in the session
+	SSL* ssl = static_cast<SSL*>(X509_STORE_CTX_get_ex_data(ctx, SSL_get_ex_data_X509_STORE_CTX_idx()));
+	issl_session* session = static_cast<issl_session*>(SSL_get_app_data(ssl));
+	if (session)
+		session->selfsigned = (ve == X509_V_ERR_DEPTH_ZERO_SELF_SIGNED_CERT);
 
 	return 1;
 }
@@ -134,6 +199,9 @@ class ModuleSSLOpenSSL : public Module
 
 	ServiceProvider iohook;
 
+	/** Worker threads for TLS processing, if enabled */
+	SSLOffloadPool pool;
+
 	static void SetContextOptions(SSL_CTX* ctx, long defoptions, const std::string& ctxname, ConfigTag* tag)
 	{
 		long setoptions = tag->getInt(ctxname + "setoptions");
@@ -199,6 +267,9 @@ class ModuleSSLOpenSSL : public Module
 	static void SSLInfoCallback(const SSL* ssl, int where, int rc)
 	{
 		int fd = SSL_get_fd(const_cast<SSL*>(ssl));
+		// Offloaded sessions have no fd, and are created with SSL_OP_NO_RENEGOTIATION instead
+		if (fd < 0)
+			return;
 		issl_session& session = opensslmod->sessions[fd];
 
 		if ((where & SSL_CB_HANDSHAKE_START) && (session.status == ISSL_OPEN))
@@ -270,6 +341,18 @@ class ModuleSSLOpenSSL : public Module
 		Implementation eventlist[] = { I_On005Numeric, I_OnRehash, I_OnModuleRehash, I_OnHookIO, I_OnUserConnect };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 		ServerInstance->Modules->AddService(iohook);
+
+		// Changing this needs a module reload
+		unsigned int threads = ServerInstance->Config->ConfValue("openssl")->getInt("threads");
+		if (threads)
+		{
+#ifdef INSPIRCD_OPENSSL_ENABLE_THREADS
+			pool.Start(threads);
+			ServerInstance->Logs->Log("m_ssl_openssl", DEFAULT, "m_ssl_openssl.so: Running TLS sessions on %u worker threads", threads);
+#else
+			ServerInstance->Logs->Log("m_ssl_openssl", DEFAULT, "m_ssl_openssl.so: <openssl:threads> needs OpenSSL 1.1.0 or later, ignoring it");
+#endif
+		}
 	}
 
 	void OnHookIO(StreamSocket* user, ListenSocket* lsb)
@@ -579,6 +662,7 @@ class ModuleSSLOpenSSL : public Module
 
 	~ModuleSSLOpenSSL()
 	{
+		pool.Stop();
 		SSL_CTX_free(ctx);
 		SSL_CTX_free(clictx);
 		delete[] sessions;
@@ -588,13 +672,14 @@ class ModuleSSLOpenSSL : public Module
 	{
 		if (user->eh.GetIOHook() == this)
 		{
-			if (sessions[user->eh.GetFd()].sess)
+			issl_session& session = sessions[user->eh.GetFd()];
+			if (session.sess && session.cert)
 			{
-				if (!sessions[user->eh.GetFd()].cert->fingerprint.empty())
+				if (!session.cert->fingerprint.empty())
 					user->WriteServ("NOTICE %s :*** You are connected using SSL cipher \"%s\""
-						" and your SSL fingerprint is %s", user->nick.c_str(), SSL_get_cipher(sessions[user->eh.GetFd()].sess), sessions[user->eh.GetFd()].cert->fingerprint.c_str());
+						" and your SSL fingerprint is %s", user->nick.c_str(), session.cipher.c_str(), session.cert->fingerprint.c_str());
 				else
-					user->WriteServ("NOTICE %s :*** You are connected using SSL cipher \"%s\"", user->nick.c_str(), SSL_get_cipher(sessions[user->eh.GetFd()].sess));
+					user->WriteServ("NOTICE %s :*** You are connected using SSL cipher \"%s\"", user->nick.c_str(), session.cipher.c_str());
 			}
 		}
 	}
@@ -659,6 +744,13 @@ class ModuleSSLOpenSSL : public Module
 		if (session->sess == NULL)
 			return;
 
+		SSL_set_app_data(session->sess, session);
+		if (pool.IsActive())
+		{
+			StartOffload(user, session);
+			return;
+		}
+
 		if (SSL_set_fd(session->sess, fd) == 0)
 		{
 			ServerInstance->Logs->Log("m_ssl_openssl",DEBUG,"BUG: Can't set fd with SSL_set_fd: %d", fd);
@@ -685,6 +777,13 @@ class ModuleSSLOpenSSL : public Module
 		if (session->sess == NULL)
 			return;
 
+		SSL_set_app_data(session->sess, session);
+		if (pool.IsActive())
+		{
+			StartOffload(user, session);
+			return;
+		}
+
 		if (SSL_set_fd(session->sess, fd) == 0)
 		{
 			ServerInstance->Logs->Log("m_ssl_openssl",DEBUG,"BUG: Can't set fd with SSL_set_fd: %d", fd);
@@ -694,6 +793,19 @@ class ModuleSSLOpenSSL : public Module
 		Handshake(user, session);
 	}
 
+	void StartOffload(StreamSocket* user, issl_session* session)
+	{
+#if defined INSPIRCD_OPENSSL_ENABLE_RENEGO_DETECTION && defined SSL_OP_NO_RENEGOTIATION
+		// The info callback is only installed when renegotiation is disallowed
+		if (SSL_CTX_get_info_callback(session->outbound ? clictx : ctx))
+			SSL_set_options(session->sess, SSL_OP_NO_RENEGOTIATION);
+#endif
+		session->status = ISSL_HANDSHAKING;
+		session->offload = new OpenSSLOffload(this, user, session, pool.GetWorker());
+		session->offload->Start();
+		ServerInstance->SE->ChangeEventMask(user, FD_WANT_FAST_READ | FD_WANT_NO_WRITE);
+	}
+
 	void OnStreamSocketClose(StreamSocket* user)
 	{
 		int fd = user->GetFd();
@@ -713,6 +825,9 @@ class ModuleSSLOpenSSL : public Module
 
 		issl_session* session = &sessions[fd];
 
+		if (session->offload)
+			return session->offload->OnRead(recvq);
+
 		if (!session->sess)
 		{
 			CloseSession(session);
@@ -797,6 +912,12 @@ class ModuleSSLOpenSSL : public Module
 
 		issl_session* session = &sessions[fd];
 
+		if (session->offload)
+			return session->offload->OnWrite(buffer);
+
+		if (buffer.empty())
+			return 1;
+
 		if (!session->sess)
 		{
 			CloseSession(session);
@@ -903,6 +1024,7 @@ class ModuleSSLOpenSSL : public Module
 			VerifyChain(session, user);
 
 			session->status = ISSL_OPEN;
+			session->cipher = SSL_get_cipher(session->sess);
 
 			ServerInstance->SE->ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
 
@@ -919,19 +1041,28 @@ class ModuleSSLOpenSSL : public Module
 
 	void CloseSession(issl_session* session)
 	{
-		if (session->sess)
+		if (session->offload)
+		{
+			// This sends the close notify, and leaves the SSL object to us
+			session->offload->Close();
+			session->offload = NULL;
+		}
+		else if (session->sess)
 		{
 			SSL_shutdown(session->sess);
-			SSL_free(session->sess);
 		}
 
+		if (session->sess)
+			SSL_free(session->sess);
+
 		session->sess = NULL;
 		session->status = ISSL_NONE;
 		session->cert = NULL;
 		session->chain.clear();
+		session->cipher.clear();
 	}
 
-	void VerifyCertificate(ssl_cert* certinfo, X509* cert)
+	void VerifyCertificate(ssl_cert* certinfo, X509* cert, bool selfsigned)
 	{
 		std::string error;
 		unsigned int n;
@@ -944,7 +1075,7 @@ class ModuleSSLOpenSSL : public Module
 			certinfo->error = error;
 		}
 
-		if (!SelfSigned)
+		if (!selfsigned)
 		{
 			certinfo->unknownsigner = false;
 			certinfo->trusted = true;
@@ -1002,7 +1133,7 @@ class ModuleSSLOpenSSL : public Module
 		if (certinfo->invalid) {
 			certinfo->error = X509_verify_cert_error_string(x509_ret);
 		}
-		VerifyCertificate(certinfo, cert);
+		VerifyCertificate(certinfo, cert, session->selfsigned);
 		X509_free(cert);
 
 		// Verify certificate chain.
@@ -1013,7 +1144,7 @@ class ModuleSSLOpenSSL : public Module
 		for (int i = 0; i < sk_X509_num(chain); i++ ) {
 			ssl_cert* chaininfo = new ssl_cert;
 			session->chain.push_back(chaininfo);
-			VerifyCertificate(chaininfo, sk_X509_value(chain, i));
+			VerifyCertificate(chaininfo, sk_X509_value(chain, i), session->selfsigned);
 			if (!chaininfo->error.empty()) {
 				// Append chain errors to the main cert (hacky)
 				if (!certinfo->error.empty()) {
@@ -1087,6 +1218,96 @@ class ModuleSSLOpenSSL : public Module
 	}
 };
 
+bool OpenSSLOffload::Process(const std::string& cipherdata, const std::string& plaindata, std::string& plain, std::string& cipher, bool& done, std::string& err)
+{
+	char buffer[16384];
+	bool ok = true;
+
+	ERR_clear_error();
+	if (!cipherdata.empty())
+		BIO_write(rbio, cipherdata.data(), cipherdata.length());
+	pending.append(plaindata);
+
+	if (!open)
+	{
+		int ret = SSL_do_handshake(sess);
+		if (ret == 1)
+		{
+			open = true;
+			done = true;
+		}
+		else
+		{
+			int sslerr = SSL_get_error(sess, ret);
+			if ((sslerr != SSL_ERROR_WANT_READ) && (sslerr != SSL_ERROR_WANT_WRITE))
+			{
+				err = GetError("Handshake Failed - ");
+				ok = false;
+			}
+		}
+	}
+
+	if (open)
+	{
+		while (ok)
+		{
+			int ret = SSL_read(sess, buffer, sizeof(buffer));
+			if (ret > 0)
+			{
+				plain.append(buffer, ret);
+				continue;
+			}
+
+			int sslerr = SSL_get_error(sess, ret);
+			if ((sslerr == SSL_ERROR_WANT_READ) || (sslerr == SSL_ERROR_WANT_WRITE))
+				break;
+
+			err = (sslerr == SSL_ERROR_ZERO_RETURN) ? "Connection closed" : GetError("SSL error - ");
+			ok = false;
+		}
+
+		// Memory BIOs never block, so this only stops on an error
+		while (ok && !pending.empty())
+		{
+			int ret = SSL_write(sess, pending.data(), pending.length());
+			if (ret > 0)
+			{
+				pending.erase(0, ret);
+			}
+			else
+			{
+				err = GetError("SSL error - ");
+				ok = false;
+			}
+		}
+	}
+
+	// Collect everything for the peer, including the alert for a failed handshake
+	int len;
+	while ((len = BIO_read(wbio, buffer, sizeof(buffer))) > 0)
+		cipher.append(buffer, len);
+
+	return ok;
+}
+
+void OpenSSLOffload::OnHandshake()
+{
+	mod->VerifyChain(session, user);
+	session->status = ISSL_OPEN;
+	session->cipher = SSL_get_cipher(sess);
+}
+
+void OpenSSLOffload::Shutdown(std::string& cipher)
+{
+	char buffer[1024];
+	if (open)
+		SSL_shutdown(sess);
+
+	int len;
+	while ((len = BIO_read(wbio, buffer, sizeof(buffer))) > 0)
+		cipher.append(buffer, len);
+}
+
 static int error_callback(const char *str, size_t len, void *u)
 {
 	ServerInstance->Logs->Log("m_ssl_openssl",DEFAULT, "SSL error: " + std::string(str, len - 1));
@@ -0,0 +1,335 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include <zlib.h>
+#include "ziplink.h"
+
+/* $ModDesc: Provides zlib compression for server links */
+/* $ModDep: ziplink.h */
+/* $LinkerFlags: -lz */
+
+#ifdef _WIN32
+# pragma comment(lib, "zlib.lib")
+#endif
+
+/** Compression state for one socket */
+class zip_session
+{
+ public:
+	StreamSocket* sock;
+	z_stream deflater;
+	z_stream inflater;
+	bool deflating;
+	bool inflating;
+	/** Bytes at the front of the sendq which were queued before compression started */
+	size_t rawleft;
+	/** Output which has been compressed but not yet sent */
+	std::string outbuf;
+	ZipLinkStats stats;
+
+	zip_session()
+	{
+		Reset();
+	}
+
+	/** Forgets the socket and any compression state, which must already have been ended */
+	void Reset()
+	{
+		sock = NULL;
+		memset(&deflater, 0, sizeof(deflater));
+		memset(&inflater, 0, sizeof(inflater));
+		deflating = inflating = false;
+		rawleft = 0;
+		std::string().swap(outbuf);
+		memset(&stats, 0, sizeof(stats));
+	}
+};
+
+class ZlibProvider : public ZipLinkProvider
+{
+ public:
+	zip_session* sessions;
+	int level;
+
+	ZlibProvider(Module* mod) : ZipLinkProvider(mod, "zlib"), level(Z_DEFAULT_COMPRESSION)
+	{
+		sessions = new zip_session[ServerInstance->SE->GetMaxFds()];
+	}
+
+	~ZlibProvider()
+	{
+		delete[] sessions;
+	}
+
+	/** Returns the socket's session, hooking the socket if this is the first use of it */
+	zip_session* GetSession(StreamSocket* sock)
+	{
+		zip_session* session = &sessions[sock->GetFd()];
+		if (session->sock != sock)
+		{
+			CloseSession(session);
+			session->sock = sock;
+			sock->AddIOHook(creator);
+		}
+		return session;
+	}
+
+	void CloseSession(zip_session* session)
+	{
+		if (session->deflating)
+			deflateEnd(&session->deflater);
+		if (session->inflating)
+			inflateEnd(&session->inflater);
+		session->Reset();
+	}
+
+	void StartCompress(StreamSocket* sock)
+	{
+		zip_session* session = GetSession(sock);
+		if (session->deflating)
+			return;
+
+		memset(&session->deflater, 0, sizeof(session->deflater));
+		if (deflateInit(&session->deflater, level) != Z_OK)
+		{
+			sock->SetError("Could not start compression");
+			return;
+		}
+		session->deflating = true;
+		session->rawleft = sock->getSendQSize();
+	}
+
+	bool StartDecompress(StreamSocket* sock, std::string& recvq)
+	{
+		zip_session* session = GetSession(sock);
+		if (!session->inflating)
+		{
+			memset(&session->inflater, 0, sizeof(session->inflater));
+			if (inflateInit(&session->inflater) != Z_OK)
+				return false;
+			session->inflating = true;
+		}
+
+		std::string data;
+		data.swap(recvq);
+		return Inflate(session, data.data(), data.length(), recvq);
+	}
+
+	bool GetStats(StreamSocket* sock, ZipLinkStats& stats)
+	{
+		if (sock->GetFd() < 0)
+			return false;
+		zip_session* session = &sessions[sock->GetFd()];
+		if (session->sock != sock || sock->GetIOHook() != creator)
+			return false;
+		stats = session->stats;
+		return true;
+	}
+
+	bool Inflate(zip_session* session, const char* data, size_t len, std::string& recvq)
+	{
+		session->stats.zip_in += len;
+		char buffer[16384];
+		z_stream& z = session->inflater;
+		z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		z.avail_in = len;
+		do
+		{
+			z.next_out = reinterpret_cast<Bytef*>(buffer);
+			z.avail_out = sizeof(buffer);
+			int ret = inflate(&z, Z_SYNC_FLUSH);
+			if (ret != Z_OK && ret != Z_BUF_ERROR)
+			{
+				session->sock->SetError(std::string("Compressed data error: ") + (z.msg ? z.msg : "stream ended"));
+				return false;
+			}
+			size_t have = sizeof(buffer) - z.avail_out;
+			recvq.append(buffer, have);
+			session->stats.raw_in += have;
+		} while (z.avail_in || !z.avail_out);
+		return true;
+	}
+
+	void Deflate(zip_session* session, const std::string& data)
+	{
+		session->stats.raw_out += data.length();
+		size_t before = session->outbuf.length();
+		char buffer[16384];
+		z_stream& z = session->deflater;
+		z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		z.avail_in = data.length();
+		/* Flush at the end of every write, so that the other side can act on every line we've sent */
+		do
+		{
+			z.next_out = reinterpret_cast<Bytef*>(buffer);
+			z.avail_out = sizeof(buffer);
+			deflate(&z, Z_SYNC_FLUSH);
+			session->outbuf.append(buffer, sizeof(buffer) - z.avail_out);
+		} while (!z.avail_out);
+		session->stats.zip_out += session->outbuf.length() - before;
+	}
+
+	/** Sends as much of the compressed output as the socket will take
+	 * @return 1 if it was all sent, 0 if the socket blocked, -1 on error
+	 */
+	int Flush(zip_session* session)
+	{
+		StreamSocket* sock = session->sock;
+		while (!session->outbuf.empty())
+		{
+			int n = ServerInstance->SE->Send(sock, session->outbuf.data(), session->outbuf.length(), 0);
+			if (n > 0)
+			{
+				session->outbuf.erase(0, n);
+			}
+			else if (n == 0)
+			{
+				sock->SetError("Connection closed");
+				return -1;
+			}
+			else if (errno == EINTR || SocketEngine::IgnoreError())
+			{
+				ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
+				return 0;
+			}
+			else
+			{
+				sock->SetError(SocketEngine::LastError());
+				return -1;
+			}
+		}
+		ServerInstance->SE->ChangeEventMask(sock, FD_WANT_NO_WRITE);
+		return 1;
+	}
+};
+
+class ModuleZipLink : public Module
+{
+	ZlibProvider zlib;
+
+ public:
+	ModuleZipLink() : zlib(this)
+	{
+	}
+
+	void init()
+	{
+		OnRehash(NULL);
+		ServerInstance->Modules->AddService(zlib);
+		Implementation eventlist[] = { I_OnRehash };
+		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
+	}
+
+	void OnRehash(User* user)
+	{
+		int level = ServerInstance->Config->ConfValue("ziplink")->getInt("level", Z_DEFAULT_COMPRESSION);
+		zlib.level = (level >= Z_NO_COMPRESSION && level <= Z_BEST_COMPRESSION) ? level : Z_DEFAULT_COMPRESSION;
+	}
+
+	CullResult cull()
+	{
+		/* Links can't carry on without us once they are compressed, so close them */
+		for (int fd = 0; fd < ServerInstance->SE->GetMaxFds(); fd++)
+		{
+			zip_session* session = &zlib.sessions[fd];
+			if (session->sock && session->sock->GetIOHook() == this)
+			{
+				session->sock->DelIOHook();
+				session->sock->SetError("Compression module unloading");
+			}
+			zlib.CloseSession(session);
+		}
+		return Module::cull();
+	}
+
+	void OnStreamSocketClose(StreamSocket* sock)
+	{
+		zlib.CloseSession(&zlib.sessions[sock->GetFd()]);
+	}
+
+	int OnStreamSocketRead(StreamSocket* sock, std::string& recvq)
+	{
+		zip_session* session = &zlib.sessions[sock->GetFd()];
+
+		char* buffer = ServerInstance->GetReadBuffer();
+		int n = ServerInstance->SE->Recv(sock, buffer, ServerInstance->Config->NetBufferSize, 0);
+		if (n > 0)
+		{
+			if (n == ServerInstance->Config->NetBufferSize)
+				ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+			else
+				ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ);
+
+			if (!session->inflating)
+			{
+				/* The other end hasn't started compressing yet */
+				recvq.append(buffer, n);
+				return 1;
+			}
+			return zlib.Inflate(session, buffer, n, recvq) ? 1 : -1;
+		}
+		else if (n == 0)
+		{
+			sock->SetError("Connection closed");
+			return -1;
+		}
+		else if (SocketEngine::IgnoreError() || errno == EINTR)
+		{
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_READ_WILL_BLOCK);
+			return 0;
+		}
+		sock->SetError(SocketEngine::LastError());
+		return -1;
+	}
+
+	int OnStreamSocketWrite(StreamSocket* sock, std::string& sendq)
+	{
+		zip_session* session = &zlib.sessions[sock->GetFd()];
+
+		/* Don't take any more until what we have already compressed has gone, so that
+		 * the socket's sendq still reflects how far behind the link is
+		 */
+		int ret = zlib.Flush(session);
+		if (ret <= 0 || sendq.empty())
+			return ret;
+
+		if (session->rawleft)
+		{
+			size_t raw = std::min(session->rawleft, sendq.length());
+			session->outbuf.append(sendq, 0, raw);
+			session->rawleft -= raw;
+			sendq.erase(0, raw);
+		}
+		if (!sendq.empty())
+		{
+			if (session->deflating)
+				zlib.Deflate(session, sendq);
+			else
+				session->outbuf.append(sendq);
+			sendq.clear();
+		}
+		return zlib.Flush(session);
+	}
+
+	Version GetVersion()
+	{
+		return Version("Provides zlib compression for server links", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleZipLink)
@@ -23,6 +23,7 @@
 #include "inspircd.h"
 #include "xline.h"
 #include "m_regex.h"
+#include "literalmatch.h"
 
 /* $ModDesc: Text (spam) filtering */
 
@@ -159,6 +160,9 @@ class ImplFilter : public FilterResult
  public:
 	Regex* regex;
 
+	/** A literal that every text matching this filter contains, or empty if none is known */
+	std::string literal;
+
 	ImplFilter(ModuleFilter* mymodule, const std::string &rea, FilterAction act, long glinetime, const std::string &pat, const std::string &flgs);
 };
 
@@ -176,6 +180,14 @@ class ModuleFilter : public Module
 	std::vector<ImplFilter> filters;
 	int flags;
 
+	/** Finds the filters whose literal occurs in a text, so only those need their regex run */
+	LiteralMatcher prefilter;
+	/** True if filters changed since the prefilter was built */
+	bool prefilterdirty;
+	/** Per filter, bit 1 if its literal was found in the text and bit 2 if in the colour stripped text */
+	std::vector<unsigned char> candidates;
+	void BuildPrefilter();
+
 	std::set<std::string> exemptfromfilter; // List of channel names excluded from filtering.
 
 	ModuleFilter();
@@ -297,7 +309,7 @@ bool ModuleFilter::AppliesToMe(User* user, FilterResult* filter, int iflags)
 }
 
 ModuleFilter::ModuleFilter()
-	: initing(true), filtcommand(this), RegexEngine(this, "regex")
+	: initing(true), filtcommand(this), RegexEngine(this, "regex"), prefilterdirty(true)
 {
 }
 
@@ -321,6 +333,7 @@ void ModuleFilter::FreeFilters()
 		delete i->regex;
 
 	filters.clear();
+	prefilterdirty = true;
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user,void* dest,int target_type, std::string &text, char status, CUList &exempt_list)
@@ -584,12 +597,47 @@ ImplFilter::ImplFilter(ModuleFilter* mymodule, const std::string &rea, FilterAct
 	if (!mymodule->RegexEngine)
 		throw ModuleException("Regex module implementing '"+mymodule->RegexEngine.GetProvider()+"' is not loaded!");
 	regex = mymodule->RegexEngine->Create(pat);
+
+	// Engines we don't know the syntax of get no literal, and so are always run
+	const std::string& engine = mymodule->RegexEngine->name;
+	if (engine == "regex/glob")
+		literal = LiteralMatcher::GlobLiteral(pat);
+	else if (engine == "regex/pcre" || engine == "regex/posix" || engine == "regex/tre" || engine == "regex/stdregex")
+		literal = LiteralMatcher::RegexLiteral(pat);
+}
+
+/** Marks the filters whose literal was found by the prefilter */
+struct CandidateMarker
+{
+	std::vector<unsigned char>& candidates;
+	const unsigned char bit;
+
+	CandidateMarker(std::vector<unsigned char>& c, unsigned char b) : candidates(c), bit(b) { }
+	void operator()(unsigned int id) { candidates[id] |= bit; }
+};
+
+void ModuleFilter::BuildPrefilter()
+{
+	prefilter.Clear();
+	for (std::vector<ImplFilter>::size_type i = 0; i < filters.size(); i++)
+		if (!filters[i].literal.empty())
+			prefilter.Add(filters[i].literal, i);
+	prefilter.Compile();
+	candidates.resize(filters.size());
+	prefilterdirty = false;
 }
 
 FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int flgs)
 {
 	static std::string stripped_text;
 	stripped_text.clear();
+	bool stripped_scanned = false;
+
+	if (prefilterdirty)
+		BuildPrefilter();
+	std::fill(candidates.begin(), candidates.end(), 0);
+	CandidateMarker rawmarker(candidates, 1);
+	prefilter.Scan(text, rawmarker);
 
 	for (std::vector<ImplFilter>::iterator index = filters.begin(); index != filters.end(); index++)
 	{
@@ -605,6 +653,19 @@ FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int
 			InspIRCd::StripColor(stripped_text);
 		}
 
+		/* Skip ones whose literal isn't in the text, as their regex can't match it */
+		if (!index->literal.empty())
+		{
+			if (filter->flag_strip_color && !stripped_scanned)
+			{
+				CandidateMarker strippedmarker(candidates, 2);
+				prefilter.Scan(stripped_text, strippedmarker);
+				stripped_scanned = true;
+			}
+			if (!(candidates[index - filters.begin()] & (filter->flag_strip_color ? 2 : 1)))
+				continue;
+		}
+
 		//ServerInstance->Logs->Log("m_filter", DEBUG, "Match '%s' against '%s'", text.c_str(), index->freeform.c_str());
 		if (index->regex->Matches(filter->flag_strip_color ? stripped_text : text))
 		{
@@ -624,6 +685,7 @@ bool ModuleFilter::DeleteFilter(const std::string &freeform)
 		{
 			delete i->regex;
 			filters.erase(i);
+			prefilterdirty = true;
 			return true;
 		}
 	}
@@ -643,6 +705,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string &freeform
 	try
 	{
 		filters.push_back(ImplFilter(this, reason, type, duration, freeform, flgs));
+		prefilterdirty = true;
 	}
 	catch (ModuleException &e)
 	{
@@ -706,6 +769,7 @@ void ModuleFilter::ReadFilters()
 		try
 		{
 			filters.push_back(ImplFilter(this, reason, fa, gline_time, pattern, flgs));
+			prefilterdirty = true;
 			ServerInstance->Logs->Log("m_filter", DEFAULT, "Regular expression %s loaded.", pattern.c_str());
 		}
 		catch (ModuleException &e)
@@ -35,39 +35,15 @@ class ModuleIRCv3 : public Module
 
 	void WriteNeighboursWithExt(User* user, const std::string& line, const LocalIntExt& ext)
 	{
-		UserChanList chans(user->chans);
+		reference<SendQBuffer> out = LocalUser::PrepareLine(line);
 
-		std::map<User*, bool> exceptions;
-		FOREACH_MOD(I_OnBuildNeighborList, OnBuildNeighborList(user, chans, exceptions));
-
-		// Send it to all local users who were explicitly marked as neighbours by modules and have the required ext
-		for (std::map<User*, bool>::const_iterator i = exceptions.begin(); i != exceptions.end(); ++i)
-		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if ((u) && (i->second) && (ext.get(u)))
-				u->Write(line);
-		}
-
-		// Now consider sending it to all other users who has at least a common channel with the user
-		std::set<User*> already_sent;
-		for (UCListIter i = chans.begin(); i != chans.end(); ++i)
+		// Send it to all local neighbours of the user (including those explicitly
+		// marked as neighbours by modules) who have the required ext
+		NeighborIterator neighbors(user, false);
+		while (LocalUser* u = neighbors.Next())
 		{
-			const UserMembList* userlist = (*i)->GetUsers();
-			for (UserMembList::const_iterator m = userlist->begin(); m != userlist->end(); ++m)
-			{
-				/*
-				 * Send the line if the channel member in question meets all of the following criteria:
-				 * - local
-				 * - not the user who is doing the action (i.e. whose channels we're iterating)
-				 * - has the given extension
-				 * - not on the except list built by modules
-				 * - we haven't sent the line to the member yet
-				 *
-				 */
-				LocalUser* member = IS_LOCAL(m->first);
-				if ((member) && (member != user) && (ext.get(member)) && (exceptions.find(member) == exceptions.end()) && (already_sent.insert(member).second))
-					member->Write(line);
-			}
+			if (ext.get(u))
+				u->Write(out);
 		}
 	}
 
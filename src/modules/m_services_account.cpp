@@ -294,6 +294,8 @@ class ModuleServicesAccount : public Module
 		// check if its our metadata key, and its associated with a user
 		if (dest && (extname == "accountname"))
 		{
+			// R: and U: extbans match on the account
+			dest->InvalidateBanCache();
 			std::string *account = accountname.get(dest);
 			if (account && !account->empty())
 			{
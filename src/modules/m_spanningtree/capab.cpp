@@ -28,6 +28,7 @@
 #include "link.h"
 #include "main.h"
 #include "../hash.h"
+#include "../ziplink.h"
 
 std::string TreeSocket::MyModules(int filter)
 {
@@ -142,6 +143,9 @@ void TreeSocket::SendCapabilities(int phase)
 	}
 	if (proto_version < 1202)
 		extra += ServerInstance->Modes->FindMode('h', MODETYPE_CHANNEL) ? " HALFOP=1" : " HALFOP=0";
+	/* Offer to compress the link, unless it is already hooked by SSL */
+	if (!GetIOHook() && ServerInstance->Modules->FindDataService<ZipLinkProvider>("ziplink/zlib"))
+		extra += " COMPRESS=zlib";
 
 	this->WriteLine("CAPAB CAPABILITIES " /* Preprocessor does this one. */
 			":NICKMAX="+ConvToStr(ServerInstance->Config->Limits.NickMax)+
@@ -319,6 +323,18 @@ bool TreeSocket::Capab(const parameterlist &params)
 				reason = "One or more of the user modes on the remote server are invalid on this server.";
 		}
 
+		/* If they can decompress what we send, tell them that everything after this line is compressed */
+		std::map<std::string,std::string>::iterator z = this->capab->CapKeys.find("COMPRESS");
+		if (reason.empty() && (z != this->capab->CapKeys.end()) && !GetIOHook())
+		{
+			ZipLinkProvider* zip = ServerInstance->Modules->FindDataService<ZipLinkProvider>("ziplink/" + z->second);
+			if (zip)
+			{
+				this->WriteLine("CAPAB COMPRESS " + zip->method);
+				zip->StartCompress(this);
+			}
+		}
+
 		/* Challenge response, store their challenge for our password */
 		std::map<std::string,std::string>::iterator n = this->capab->CapKeys.find("CHALLENGE");
 		if (Utils->ChallengeResponse && (n != this->capab->CapKeys.end()) && (ServerInstance->Modules->FindDataService<HashProvider>("hash/sha256")))
@@ -347,6 +363,16 @@ bool TreeSocket::Capab(const parameterlist &params)
 			return false;
 		}
 	}
+	else if ((params[0] == "COMPRESS") && (params.size() == 2))
+	{
+		/* What is left in the recvq was sent after this, so is compressed too */
+		ZipLinkProvider* zip = ServerInstance->Modules->FindDataService<ZipLinkProvider>("ziplink/" + params[1]);
+		if (!zip || (GetIOHook() && GetIOHook() != zip->creator) || !zip->StartDecompress(this, recvq))
+		{
+			this->SendError("Unable to decompress link using " + params[1]);
+			return false;
+		}
+	}
 	else if ((params[0] == "MODULES") && (params.size() == 2))
 	{
 		if (!capab->ModuleList.length())
@@ -120,6 +120,19 @@ void TreeSocket::WriteLine(std::string line)
 			ServerInstance->Logs->Log("m_spanningtree", DEFAULT, "Sending line without server prefix!");
 			line = ":" + ServerInstance->Config->GetSID() + " " + line;
 		}
+		if (burst && !burst->writing)
+		{
+			/* Lines about things which are yet to be burst would be dropped by the other side,
+			 * so hold everything back until the burst is done. Keepalives and errors can't wait.
+			 */
+			std::string::size_type a = line.find(' ');
+			std::string command = line.substr(a + 1, line.find(' ', a + 1) - a - 1);
+			if (command != "PING" && command != "PONG" && command != "ERROR")
+			{
+				burst->deferred.push_back(line);
+				return;
+			}
+		}
 		if (proto_version != ProtocolVersion)
 		{
 			std::string::size_type a = line.find(' ');
@@ -194,3 +207,16 @@ void TreeSocket::WriteLine(std::string line)
 	else
 		this->WriteData(newline);
 }
+
+void TreeSocket::WriteLine(const reference<SendQBuffer>& line)
+{
+	/* Lines which need translating or holding back for a burst go the long way round */
+	if (LinkState != CONNECTED || proto_version != ProtocolVersion || burst)
+	{
+		WriteLine(line->data.substr(0, line->data.length() - 1));
+		return;
+	}
+
+	ServerInstance->Logs->Log("m_spanningtree", RAWIO, "S[%d] O %.*s", this->GetFd(), (int)line->data.length() - 1, line->data.c_str());
+	this->WriteData(line);
+}
@@ -28,6 +28,7 @@
 #include "xline.h"
 
 #include "cachetimer.h"
+#include "splitqueue.h"
 #include "resolvers.h"
 #include "main.h"
 #include "utils.h"
@@ -36,6 +37,7 @@
 #include "treesocket.h"
 #include "commands.h"
 #include "protocolinterface.h"
+#include <iostream>
 
 ModuleSpanningTree::ModuleSpanningTree()
 	: KeepNickTS(false)
@@ -43,6 +45,7 @@ ModuleSpanningTree::ModuleSpanningTree()
 	Utils = new SpanningTreeUtilities(this);
 	commands = new SpanningTreeCommands(this);
 	RefreshTimer = NULL;
+	Splits = NULL;
 }
 
 SpanningTreeCommands::SpanningTreeCommands(ModuleSpanningTree* module)
@@ -71,6 +74,8 @@ void ModuleSpanningTree::init()
 	ServerInstance->Modules->AddService(commands->fname);
 	RefreshTimer = new CacheRefreshTimer(Utils);
 	ServerInstance->Timers->AddTimer(RefreshTimer);
+	Splits = new SplitQueue(Utils);
+	ServerInstance->Timers->AddTimer(Splits);
 
 	Implementation eventlist[] =
 	{
@@ -79,7 +84,8 @@ void ModuleSpanningTree::init()
 		I_OnChangeHost, I_OnChangeName, I_OnChangeIdent, I_OnUserPart, I_OnUnloadModule,
 		I_OnUserQuit, I_OnUserPostNick, I_OnUserKick, I_OnRemoteKill, I_OnRehash, I_OnPreRehash,
 		I_OnOper, I_OnAddLine, I_OnDelLine, I_OnMode, I_OnLoadModule, I_OnStats,
-		I_OnSetAway, I_OnPostCommand, I_OnUserConnect, I_OnAcceptConnection
+		I_OnSetAway, I_OnPostCommand, I_OnUserConnect, I_OnAcceptConnection, I_OnRunTestSuite,
+		I_OnUserPreMessage, I_OnUserPreNotice, I_OnUserPreNick, I_OnNamesListItem
 	};
 	ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
 
@@ -570,6 +576,38 @@ void ModuleSpanningTree::OnUserMessage(User* user, void* dest, int target_type,
 	}
 }
 
+ModResult ModuleSpanningTree::OnUserPreMessage(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list)
+{
+	/* A user left over from a split can't be reached, so tell the sender they have gone */
+	if ((target_type == TYPE_USER) && (IS_LOCAL(user)) && (Splits->Reap((User*)dest)))
+	{
+		user->WriteNumeric(ERR_NOSUCHNICK, "%s %s :No such nick/channel", user->nick.c_str(), ((User*)dest)->nick.c_str());
+		return MOD_RES_DENY;
+	}
+	return MOD_RES_PASSTHRU;
+}
+
+ModResult ModuleSpanningTree::OnUserPreNotice(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list)
+{
+	return OnUserPreMessage(user, dest, target_type, text, status, exempt_list);
+}
+
+ModResult ModuleSpanningTree::OnUserPreNick(User* user, const std::string &newnick)
+{
+	/* Users left over from a split give up their nick to anyone who wants it */
+	User* holder = ServerInstance->FindNickOnly(newnick);
+	if ((holder) && (holder != user))
+		Splits->Reap(holder);
+	return MOD_RES_PASSTHRU;
+}
+
+void ModuleSpanningTree::OnNamesListItem(User* issuer, Membership* item, std::string &prefixes, std::string &nick)
+{
+	/* Can't quit them in the middle of the channel's user list, so just leave them out */
+	if (Splits->IsGhost(item->user))
+		nick.clear();
+}
+
 void ModuleSpanningTree::OnBackgroundTimer(time_t curtime)
 {
 	AutoConnectServers(curtime);
@@ -975,9 +1013,67 @@ CullResult ModuleSpanningTree::cull()
 {
 	Utils->cull();
 	ServerInstance->Timers->DelTimer(RefreshTimer);
+	if (Splits)
+	{
+		Splits->FinishAll();
+		ServerInstance->Timers->DelTimer(Splits);
+	}
 	return this->Module::cull();
 }
 
+void ModuleSpanningTree::OnRunTestSuite()
+{
+	const unsigned int messages = 1000000;
+	const unsigned int links = 9;
+	/* How often the sendqs are written out */
+	const unsigned int flush = 1000;
+
+	std::cout << "\n\nRelaying " << messages << " PRIVMSGs to " << links << " linked servers\n";
+
+	parameterlist params;
+	params.push_back("#relaybench");
+	params.push_back(":" + std::string(200, 'x'));
+	std::vector<std::vector<reference<SendQBuffer> > > sendqs(links);
+
+	/* What DoOneToMany and TreeSocket::WriteLine used to do for each message */
+	clock_t start = clock();
+	for (unsigned int m = 0; m < messages; m++)
+	{
+		std::string FullLine = ":" + ConvToStr(m % 10000) + " PRIVMSG";
+		for (unsigned int x = 0; x < params.size(); x++)
+			FullLine = FullLine + " " + params[x];
+		for (unsigned int l = 0; l < links; l++)
+		{
+			std::string line = FullLine;
+			sendqs[l].push_back(new SendQBuffer(line));
+			sendqs[l].push_back(new SendQBuffer("\n"));
+		}
+		if (m % flush == flush - 1)
+			for (unsigned int l = 0; l < links; l++)
+				sendqs[l].clear();
+	}
+	clock_t oldtime = clock() - start;
+
+	start = clock();
+	for (unsigned int m = 0; m < messages; m++)
+	{
+		reference<SendQBuffer> line = SpanningTreeUtilities::PrepareLine(ConvToStr(m % 10000), "PRIVMSG", params);
+		for (unsigned int l = 0; l < links; l++)
+			sendqs[l].push_back(line);
+		if (m % flush == flush - 1)
+			for (unsigned int l = 0; l < links; l++)
+				sendqs[l].clear();
+	}
+	clock_t newtime = clock() - start;
+
+	reference<SendQBuffer> line = SpanningTreeUtilities::PrepareLine("123", "PRIVMSG", params);
+	bool passed = (line->data == ":123 PRIVMSG #relaybench :" + std::string(200, 'x') + "\n");
+
+	std::cout << "Per-server copies: " << (oldtime * 1000 / CLOCKS_PER_SEC) << "ms\n";
+	std::cout << "Shared lines: " << (newtime * 1000 / CLOCKS_PER_SEC) << "ms\n";
+	std::cout << (passed ? "\nSUCCESS!\n" : "\nFAILURE\n");
+}
+
 ModuleSpanningTree::~ModuleSpanningTree()
 {
 	delete ServerInstance->PI;
@@ -44,6 +44,7 @@ const long MinCompatProtocol = 1201;
 class SpanningTreeCommands;
 class SpanningTreeUtilities;
 class CacheRefreshTimer;
+class SplitQueue;
 class TreeServer;
 class Link;
 class Autoconnect;
@@ -58,6 +59,9 @@ class ModuleSpanningTree : public Module
 	SpanningTreeUtilities* Utils;
 
 	CacheRefreshTimer *RefreshTimer;
+	/** Users behind netsplits who haven't been quit yet
+	 */
+	SplitQueue *Splits;
 	/** Set to true if inside a spanningtree call, to prevent sending
 	 * xlines and other things back to their source
 	 */
@@ -154,6 +158,10 @@ class ModuleSpanningTree : public Module
 	void OnWallops(User* user, const std::string &text);
 	void OnUserNotice(User* user, void* dest, int target_type, const std::string &text, char status, const CUList &exempt_list);
 	void OnUserMessage(User* user, void* dest, int target_type, const std::string &text, char status, const CUList &exempt_list);
+	ModResult OnUserPreMessage(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list);
+	ModResult OnUserPreNotice(User* user, void* dest, int target_type, std::string &text, char status, CUList &exempt_list);
+	ModResult OnUserPreNick(User* user, const std::string &newnick);
+	void OnNamesListItem(User* issuer, Membership* item, std::string &prefixes, std::string &nick);
 	void OnBackgroundTimer(time_t curtime);
 	void OnUserJoin(Membership* memb, bool sync, bool created, CUList& excepts);
 	void OnChangeHost(User* user, const std::string &newhost);
@@ -179,6 +187,7 @@ class ModuleSpanningTree : public Module
 	void OnUnloadModule(Module* mod);
 	ModResult OnAcceptConnection(int newsock, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
 	void OnRequest(Request& request);
+	void OnRunTestSuite();
 	CullResult cull();
 	~ModuleSpanningTree();
 	Version GetVersion();
@@ -26,6 +26,7 @@
 #include "treeserver.h"
 #include "utils.h"
 #include "main.h"
+#include "splitqueue.h"
 
 /** This function is called when we want to send a netburst to a local
  * server. There is a set order we must do this, because for example
@@ -45,14 +46,107 @@ void TreeSocket::DoBurst(TreeServer* s)
 	this->WriteLine(":" + ServerInstance->Config->GetSID() + " VERSION :"+ServerInstance->GetVersionString());
 	/* Send server tree */
 	this->SendServers(Utils->TreeRoot,s,1);
-	/* Send users and their oper status */
-	this->SendUsers();
-	/* Send everything else (channel modes, xlines etc) */
-	this->SendChannelModes();
-	this->SendXLines();
-	FOREACH_MOD(I_OnSyncNetwork,OnSyncNetwork(Utils->Creator,(void*)this));
-	this->WriteLine(":" + ServerInstance->Config->GetSID() + " ENDBURST");
-	ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2"+ s->GetName()+"\2.");
+
+	/* Users, channels, xlines etc follow as the link drains; see ContinueBurst() */
+	burst = new BurstState;
+	burst->users.reserve(ServerInstance->Users->clientlist->size());
+	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); ++u)
+		if (u->second->registered == REG_ALL && !Utils->Creator->Splits->IsGhost(u->second))
+			burst->users.push_back(u->second->uuid);
+	burst->channels.reserve(ServerInstance->chanlist->size());
+	for (chan_hash::iterator c = ServerInstance->chanlist->begin(); c != ServerInstance->chanlist->end(); ++c)
+		burst->channels.push_back(c->first);
+
+	this->ContinueBurst();
+}
+
+void TreeSocket::ContinueBurst()
+{
+	size_t queued = getSendQSize();
+	burst->writing = true;
+
+	while (burst->stage != BurstState::BURST_DONE && getSendQSize() < BURST_SLICE_LENGTH)
+	{
+		switch (burst->stage)
+		{
+			case BurstState::BURST_USERS:
+				/* Send users and their oper status */
+				if (burst->pos < burst->users.size())
+				{
+					User* u = ServerInstance->FindUUID(burst->users[burst->pos++]);
+					if (u && u->registered == REG_ALL)
+						this->SendUser(u);
+				}
+				else
+				{
+					burst->stage = BurstState::BURST_CHANNELS;
+					burst->pos = 0;
+				}
+			break;
+			case BurstState::BURST_CHANNELS:
+				/* Send channel modes, topics and members */
+				if (burst->pos < burst->channels.size())
+				{
+					const std::string& name = burst->channels[burst->pos++];
+					Channel* c = ServerInstance->FindChan(name);
+					if (c && HasOnlyGhosts(c))
+					{
+						/* It would go when they do, so let it go now rather than send it empty */
+						Utils->Creator->Splits->ReapChannel(c);
+						c = ServerInstance->FindChan(name);
+					}
+					if (c)
+						this->SendChannel(c);
+				}
+				else
+					burst->stage = BurstState::BURST_REST;
+			break;
+			case BurstState::BURST_REST:
+				/* Send everything else (xlines etc) */
+				this->SendXLines();
+				FOREACH_MOD(I_OnSyncNetwork,OnSyncNetwork(Utils->Creator,(void*)this));
+				this->WriteLine(":" + ServerInstance->Config->GetSID() + " ENDBURST");
+				burst->stage = BurstState::BURST_DONE;
+			break;
+			case BurstState::BURST_DONE:
+			break;
+		}
+	}
+
+	burst->bytes += getSendQSize() - queued;
+	burst->writing = false;
+
+	if (burst->stage == BurstState::BURST_DONE)
+	{
+		ServerInstance->SNO->WriteToSnoMask('l',"Finished bursting to \2%s\2 (%llu bytes in %lu seconds).", linkID.c_str(),
+			burst->bytes, (unsigned long)(ServerInstance->Time() - burst->started));
+
+		/* Now the server knows everything they can refer to, send what was held back */
+		std::deque<std::string> deferred;
+		deferred.swap(burst->deferred);
+		delete burst;
+		burst = NULL;
+		for (std::deque<std::string>::iterator i = deferred.begin(); i != deferred.end(); ++i)
+			this->WriteLine(*i);
+	}
+}
+
+void TreeSocket::DoWrite()
+{
+	BufferedSocket::DoWrite();
+
+	/* Only generate more burst when the last slice has gone out in full, i.e. the link isn't blocked.
+	 * If it is, the socket engine will call us again when it unblocks.
+	 */
+	unsigned int slices = 0;
+	while (burst && LinkState == CONNECTED && getError().empty() && !getSendQSize())
+	{
+		this->ContinueBurst();
+		/* Leave the last slice to the next trial write, so that other sockets get a turn */
+		if (++slices == BURST_SLICES_PER_WRITE)
+			break;
+		BufferedSocket::DoWrite();
+	}
 }
 
 /** Recursively send the server tree with distances as hops.
@@ -88,6 +182,17 @@ void TreeSocket::SendServers(TreeServer* Current, TreeServer* s, int hops)
  * If the length of a single line is more than 480-NICKMAX
  * in length, it is split over multiple lines.
  */
+bool TreeSocket::HasOnlyGhosts(Channel* c)
+{
+	const UserMembList* ulist = c->GetUsers();
+	if (ulist->empty())
+		return false;
+	for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
+		if (!Utils->Creator->Splits->IsGhost(i->first))
+			return false;
+	return true;
+}
+
 void TreeSocket::SendFJoins(Channel* c)
 {
 	std::string buffer;
@@ -106,6 +211,10 @@ void TreeSocket::SendFJoins(Channel* c)
 
 	for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
 	{
+		/* Users left over from a split weren't sent, so the other side doesn't know them */
+		if (Utils->Creator->Splits->IsGhost(i->first))
+			continue;
+
 		size_t ptrlen = 0;
 		std::string modestr = i->second->modes;
 
@@ -212,79 +321,68 @@ void TreeSocket::SendXLines()
 }
 
 /** Send channel topic, modes and metadata */
-void TreeSocket::SendChannelModes()
+void TreeSocket::SendChannel(Channel* c)
 {
 	char data[MAXBUF];
-	std::string n = ServerInstance->Config->GetSID();
-	const char* sn = n.c_str();
 
-	for (chan_hash::iterator c = ServerInstance->chanlist->begin(); c != ServerInstance->chanlist->end(); c++)
+	SendFJoins(c);
+	if (!c->topic.empty())
 	{
-		SendFJoins(c->second);
-		if (!c->second->topic.empty())
-		{
-			snprintf(data,MAXBUF,":%s FTOPIC %s %lu %s :%s", sn, c->second->name.c_str(), (unsigned long)c->second->topicset, c->second->setby.c_str(), c->second->topic.c_str());
-			this->WriteLine(data);
-		}
-
-		for(Extensible::ExtensibleStore::const_iterator i = c->second->GetExtList().begin(); i != c->second->GetExtList().end(); i++)
-		{
-			ExtensionItem* item = i->first;
-			std::string value = item->serialize(FORMAT_NETWORK, c->second, i->second);
-			if (!value.empty())
-				Utils->Creator->ProtoSendMetaData(this, c->second, item->name, value);
-		}
+		snprintf(data,MAXBUF,":%s FTOPIC %s %lu %s :%s", ServerInstance->Config->GetSID().c_str(), c->name.c_str(), (unsigned long)c->topicset, c->setby.c_str(), c->topic.c_str());
+		this->WriteLine(data);
+	}
 
-		FOREACH_MOD(I_OnSyncChannel,OnSyncChannel(c->second,Utils->Creator,this));
+	for(Extensible::ExtensibleStore::const_iterator i = c->GetExtList().begin(); i != c->GetExtList().end(); i++)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, c, i->second);
+		if (!value.empty())
+			Utils->Creator->ProtoSendMetaData(this, c, item->name, value);
 	}
+
+	FOREACH_MOD(I_OnSyncChannel,OnSyncChannel(c,Utils->Creator,this));
 }
 
-/** send all users and their oper state/modes */
-void TreeSocket::SendUsers()
+/** send a user and their oper state/modes */
+void TreeSocket::SendUser(User* u)
 {
 	char data[MAXBUF];
-	for (user_hash::iterator u = ServerInstance->Users->clientlist->begin(); u != ServerInstance->Users->clientlist->end(); u++)
+	TreeServer* theirserver = Utils->FindServer(u->server);
+	/* Left over from a split; the other side will never hear of them */
+	if (!theirserver)
+		return;
+
+	snprintf(data,MAXBUF,":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
+			theirserver->GetID().c_str(),	/* Prefix: SID */
+			u->uuid.c_str(),	/* 0: UUID */
+			(unsigned long)u->age,	/* 1: TS */
+			u->nick.c_str(),	/* 2: Nick */
+			u->host.c_str(),	/* 3: Displayed Host */
+			u->dhost.c_str(),	/* 4: Real host */
+			u->ident.c_str(),	/* 5: Ident */
+			u->GetIPString(),	/* 6: IP string */
+			(unsigned long)u->signon, /* 7: Signon time for WHOWAS */
+			u->FormatModes(true),	/* 8...n: Modes and params */
+			u->fullname.c_str());	/* size-1: GECOS */
+	this->WriteLine(data);
+	if (IS_OPER(u))
 	{
-		if (u->second->registered == REG_ALL)
-		{
-			TreeServer* theirserver = Utils->FindServer(u->second->server);
-			if (theirserver)
-			{
-				snprintf(data,MAXBUF,":%s UID %s %lu %s %s %s %s %s %lu +%s :%s",
-						theirserver->GetID().c_str(),	/* Prefix: SID */
-						u->second->uuid.c_str(),	/* 0: UUID */
-						(unsigned long)u->second->age,	/* 1: TS */
-						u->second->nick.c_str(),	/* 2: Nick */
-						u->second->host.c_str(),	/* 3: Displayed Host */
-						u->second->dhost.c_str(),	/* 4: Real host */
-						u->second->ident.c_str(),	/* 5: Ident */
-						u->second->GetIPString(),	/* 6: IP string */
-						(unsigned long)u->second->signon, /* 7: Signon time for WHOWAS */
-						u->second->FormatModes(true),	/* 8...n: Modes and params */
-						u->second->fullname.c_str());	/* size-1: GECOS */
-				this->WriteLine(data);
-				if (IS_OPER(u->second))
-				{
-					snprintf(data,MAXBUF,":%s OPERTYPE %s", u->second->uuid.c_str(), u->second->oper->name.c_str());
-					this->WriteLine(data);
-				}
-				if (IS_AWAY(u->second))
-				{
-					snprintf(data,MAXBUF,":%s AWAY %ld :%s", u->second->uuid.c_str(), (long)u->second->awaytime, u->second->awaymsg.c_str());
-					this->WriteLine(data);
-				}
-			}
-
-			for(Extensible::ExtensibleStore::const_iterator i = u->second->GetExtList().begin(); i != u->second->GetExtList().end(); i++)
-			{
-				ExtensionItem* item = i->first;
-				std::string value = item->serialize(FORMAT_NETWORK, u->second, i->second);
-				if (!value.empty())
-					Utils->Creator->ProtoSendMetaData(this, u->second, item->name, value);
-			}
+		snprintf(data,MAXBUF,":%s OPERTYPE %s", u->uuid.c_str(), u->oper->name.c_str());
+		this->WriteLine(data);
+	}
+	if (IS_AWAY(u))
+	{
+		snprintf(data,MAXBUF,":%s AWAY %ld :%s", u->uuid.c_str(), (long)u->awaytime, u->awaymsg.c_str());
+		this->WriteLine(data);
+	}
 
-			FOREACH_MOD(I_OnSyncUser,OnSyncUser(u->second,Utils->Creator,this));
-		}
+	for(Extensible::ExtensibleStore::const_iterator i = u->GetExtList().begin(); i != u->GetExtList().end(); i++)
+	{
+		ExtensionItem* item = i->first;
+		std::string value = item->serialize(FORMAT_NETWORK, u, i->second);
+		if (!value.empty())
+			Utils->Creator->ProtoSendMetaData(this, u, item->name, value);
 	}
-}
 
+	FOREACH_MOD(I_OnSyncUser,OnSyncUser(u,Utils->Creator,this));
+}
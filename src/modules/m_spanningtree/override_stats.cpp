@@ -28,6 +28,7 @@
 #include "treeserver.h"
 #include "link.h"
 #include "treesocket.h"
+#include "../ziplink.h"
 
 ModResult ModuleSpanningTree::OnStats(char statschar, User* user, string_list &results)
 {
@@ -42,6 +43,41 @@ ModResult ModuleSpanningTree::OnStats(char statschar, User* user, string_list &r
 		}
 		return MOD_RES_DENY;
 	}
+
+	if (statschar == 'b')
+	{
+		static const char* const stages[] = { "users", "channels", "other", "done" };
+		for (unsigned int j = 0; j < Utils->TreeRoot->ChildCount(); j++)
+		{
+			TreeServer* s = Utils->TreeRoot->GetChild(j);
+			const BurstState* b = s->GetSocket() ? s->GetSocket()->GetBurst() : NULL;
+			if (!b)
+				continue;
+
+			size_t total = (b->stage == BurstState::BURST_USERS ? b->users.size() : b->channels.size());
+			results.push_back(std::string(ServerInstance->Config->ServerName)+" 249 "+user->nick+" :"+s->GetName()+" "+stages[b->stage]+" "+
+				ConvToStr(b->pos)+"/"+ConvToStr(total)+", "+ConvToStr(b->bytes)+" bytes sent, "+ConvToStr(ServerInstance->Time() - b->started)+
+				" seconds, "+ConvToStr(b->deferred.size())+" lines held back");
+		}
+		return MOD_RES_DENY;
+	}
+
+	if (statschar == 'x')
+	{
+		ZipLinkProvider* zip = ServerInstance->Modules->FindDataService<ZipLinkProvider>("ziplink/zlib");
+		for (unsigned int j = 0; zip && j < Utils->TreeRoot->ChildCount(); j++)
+		{
+			TreeServer* s = Utils->TreeRoot->GetChild(j);
+			ZipLinkStats zs;
+			if (!s->GetSocket() || !zip->GetStats(s->GetSocket(), zs))
+				continue;
+
+			results.push_back(std::string(ServerInstance->Config->ServerName)+" 249 "+user->nick+" :"+s->GetName()+" "+zip->method+": sent "+
+				ConvToStr(zs.raw_out)+" bytes as "+ConvToStr(zs.zip_out)+" ("+ConvToStr(zs.raw_out ? zs.zip_out * 100 / zs.raw_out : 100)+"%), received "+
+				ConvToStr(zs.raw_in)+" bytes as "+ConvToStr(zs.zip_in)+" ("+ConvToStr(zs.raw_in ? zs.zip_in * 100 / zs.raw_in : 100)+"%)");
+		}
+		return MOD_RES_DENY;
+	}
 	return MOD_RES_PASSTHRU;
 }
 
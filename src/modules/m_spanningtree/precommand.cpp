@@ -28,8 +28,9 @@
 #include "utils.h"
 #include "treeserver.h"
 #include "treesocket.h"
+#include "splitqueue.h"
 
-/* $ModDep: m_spanningtree/main.h m_spanningtree/utils.h m_spanningtree/treeserver.h m_spanningtree/treesocket.h */
+/* $ModDep: m_spanningtree/main.h m_spanningtree/utils.h m_spanningtree/treeserver.h m_spanningtree/treesocket.h m_spanningtree/splitqueue.h */
 
 ModResult ModuleSpanningTree::OnPreCommand(std::string &command, std::vector<std::string>& parameters, LocalUser *user, bool validated, const std::string &original_line)
 {
@@ -37,6 +38,13 @@ ModResult ModuleSpanningTree::OnPreCommand(std::string &command, std::vector<std
 	if (!validated)
 		return MOD_RES_PASSTHRU;
 
+	/* Quit any user left over from a split before the core shows them as still here,
+	 * or lets them count towards a limit. Messages have their own hooks for this, and
+	 * looking up every word of their text would be pointless.
+	 */
+	if (command != "PRIVMSG" && command != "NOTICE")
+		Splits->ReapParameters(parameters);
+
 	if (command == "CONNECT")
 	{
 		return this->HandleConnect(parameters,user);
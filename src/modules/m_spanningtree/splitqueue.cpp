@@ -0,0 +1,192 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+#include "splitqueue.h"
+#include "utils.h"
+#include "treeserver.h"
+
+/* $ModDep: m_spanningtree/splitqueue.h m_spanningtree/utils.h m_spanningtree/treeserver.h */
+
+SplitQueue::SplitQueue(SpanningTreeUtilities* Util) : Timer(1, ServerInstance->Time(), true), Utils(Util)
+{
+}
+
+size_t SplitQueue::Add(TreeServer* server, const std::string& reason)
+{
+	splits.push_back(Split());
+	Split& split = splits.back();
+	split.server = server->GetName().c_str();
+	split.sid = server->GetID();
+	split.reason = reason;
+	split.pos = 0;
+
+	for (user_hash::const_iterator i = ServerInstance->Users->clientlist->begin(); i != ServerInstance->Users->clientlist->end(); ++i)
+	{
+		if (i->second->server == split.server && !IS_LOCAL(i->second))
+			split.users.push_back(PackUID(i->second->uuid));
+	}
+
+	size_t count = split.users.size();
+	Run();
+	return count;
+}
+
+void SplitQueue::QuitBatch(Split& split)
+{
+	std::vector<User*> batch;
+	size_t end = std::min(split.pos + BATCH_SIZE, split.users.size());
+	for (; split.pos < end; split.pos++)
+	{
+		User* user = ServerInstance->Users->uuidlist->find(split.users[split.pos]);
+		if (!user || IS_LOCAL(user) || user->quitting)
+			continue;
+
+		if (Utils->quiet_bursts)
+			user->quietquit = true;
+		batch.push_back(user);
+	}
+
+	if (ServerInstance->Config->HideSplits)
+		ServerInstance->Users->QuitUsers(batch, "*.net *.split", split.reason.c_str());
+	else
+		ServerInstance->Users->QuitUsers(batch, split.reason);
+}
+
+bool SplitQueue::Run()
+{
+	// Leave most of every second to everything else
+	const clock_t slice = CLOCKS_PER_SEC / 5;
+	clock_t start = clock();
+	while (!splits.empty())
+	{
+		QuitBatch(splits.front());
+		if (splits.front().pos == splits.front().users.size())
+			splits.pop_front();
+		if (clock() - start >= slice)
+			break;
+	}
+	return !splits.empty();
+}
+
+void SplitQueue::Finish(const std::string& server, const std::string& sid)
+{
+	for (std::deque<Split>::iterator i = splits.begin(); i != splits.end(); )
+	{
+		if (irc::string(i->server.c_str()) == server.c_str() || i->sid == sid)
+		{
+			while (i->pos < i->users.size())
+				QuitBatch(*i);
+			i = splits.erase(i);
+		}
+		else
+			++i;
+	}
+}
+
+void SplitQueue::FinishAll()
+{
+	while (!splits.empty())
+	{
+		while (splits.front().pos < splits.front().users.size())
+			QuitBatch(splits.front());
+		splits.pop_front();
+	}
+}
+
+bool SplitQueue::IsGhost(User* user) const
+{
+	return (!splits.empty() && !IS_LOCAL(user) && !IS_SERVER(user) && !user->quitting && !Utils->FindServer(user->server));
+}
+
+bool SplitQueue::Reap(User* user)
+{
+	if (!IsGhost(user))
+		return false;
+
+	for (std::deque<Split>::const_iterator i = splits.begin(); i != splits.end(); ++i)
+	{
+		if (i->server == user->server)
+		{
+			if (Utils->quiet_bursts)
+				user->quietquit = true;
+			if (ServerInstance->Config->HideSplits)
+				ServerInstance->Users->QuitUser(user, "*.net *.split", i->reason.c_str());
+			else
+				ServerInstance->Users->QuitUser(user, i->reason);
+			return true;
+		}
+	}
+	return false;
+}
+
+void SplitQueue::ReapChannel(Channel* chan)
+{
+	if (splits.empty())
+		return;
+
+	// Quitting takes them off the channel, so find them all first
+	std::vector<User*> ghosts;
+	const UserMembList* users = chan->GetUsers();
+	for (UserMembCIter i = users->begin(); i != users->end(); ++i)
+		if (IsGhost(i->first))
+			ghosts.push_back(i->first);
+
+	for (std::vector<User*>::const_iterator i = ghosts.begin(); i != ghosts.end(); ++i)
+		Reap(*i);
+}
+
+void SplitQueue::ReapParameters(const std::vector<std::string>& parameters)
+{
+	if (splits.empty())
+		return;
+
+	// Any nick or channel named anywhere in the command, including lists such as
+	// the nicks of ISON and USERHOST or the targets of KICK and MODE +o
+	for (std::vector<std::string>::const_iterator i = parameters.begin(); i != parameters.end(); ++i)
+	{
+		irc::spacesepstream words(*i);
+		std::string word;
+		while (words.GetToken(word))
+		{
+			irc::commasepstream targets(word);
+			std::string target;
+			while (targets.GetToken(target))
+			{
+				if (target.empty())
+					continue;
+
+				if (ServerInstance->IsChannel(target.c_str(), ServerInstance->Config->Limits.ChanMax))
+				{
+					Channel* c = ServerInstance->FindChan(target);
+					if (c)
+						ReapChannel(c);
+				}
+				else if (User* u = ServerInstance->FindNickOnly(target))
+				{
+					Reap(u);
+				}
+			}
+		}
+	}
+}
+
+void SplitQueue::Tick(time_t TIME)
+{
+	Run();
+}
@@ -0,0 +1,94 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef M_SPANNINGTREE_SPLITQUEUE_H
+#define M_SPANNINGTREE_SPLITQUEUE_H
+
+#include "timer.h"
+#include <deque>
+
+class SpanningTreeUtilities;
+class TreeServer;
+
+/** Quits the users behind a netsplit a batch at a time, so that losing a big
+ * server doesn't stall the server for seconds. Each call to Run() quits users
+ * until it has used up its slice of time, and the rest are left to the next
+ * Tick() a second later. Until then the users are still there as ghosts, and
+ * the module quits any ghost straight away when a command refers to it or to a
+ * channel it is on, or someone wants its nick; see Reap().
+ */
+class SplitQueue : public Timer
+{
+	struct Split
+	{
+		/** Name and SID of the server the users were on */
+		std::string server;
+		std::string sid;
+		std::string reason;
+		/** The users still to quit, from pos on */
+		std::vector<uid_key> users;
+		size_t pos;
+	};
+
+	SpanningTreeUtilities* Utils;
+	std::deque<Split> splits;
+
+	/** Number of users given to UserManager::QuitUsers() in one go */
+	static const size_t BATCH_SIZE = 1000;
+
+	/** Quits the next batch of users from a split */
+	void QuitBatch(Split& split);
+
+ public:
+	SplitQueue(SpanningTreeUtilities* Util);
+
+	/** Queues the users on a server which has split and quits the first of them
+	 * @return The number of users queued
+	 */
+	size_t Add(TreeServer* server, const std::string& reason);
+
+	/** Quits users until the time slice runs out
+	 * @return True if there are users left to quit
+	 */
+	bool Run();
+
+	/** Quits every user left over from earlier splits of a server, for when it links again */
+	void Finish(const std::string& server, const std::string& sid);
+
+	/** Quits every queued user */
+	void FinishAll();
+
+	/** Returns true if a user is left over from a split: their server has gone, but they haven't been quit yet */
+	bool IsGhost(User* user) const;
+
+	/** Quits a user straight away if they are left over from a split, as when someone else wants their nick
+	 * @return True if the user was quit
+	 */
+	bool Reap(User* user);
+
+	/** Quits every user on a channel who is left over from a split */
+	void ReapChannel(Channel* chan);
+
+	/** Quits every user left over from a split who is named by a command, either
+	 * by nick or as a member of a channel it names
+	 */
+	void ReapParameters(const std::vector<std::string>& parameters);
+
+	virtual void Tick(time_t TIME);
+};
+
+#endif
@@ -28,8 +28,9 @@
 
 #include "utils.h"
 #include "treeserver.h"
+#include "splitqueue.h"
 
-/* $ModDep: m_spanningtree/utils.h m_spanningtree/treeserver.h */
+/* $ModDep: m_spanningtree/utils.h m_spanningtree/treeserver.h m_spanningtree/splitqueue.h */
 
 /** We use this constructor only to create the 'root' item, Utils->TreeRoot, which
  * represents our own server. Therefore, it has no route, no parent, and
@@ -123,6 +124,9 @@ TreeServer::TreeServer(SpanningTreeUtilities* Util, std::string Name, std::strin
 	 * servers.
 	 */
 
+	/* If this server split recently, anyone still left over from then has to go before its users come back */
+	Utils->Creator->Splits->Finish(ServerName.c_str(), id);
+
 	this->AddHashEntry();
 
 	SetID(id);
@@ -160,35 +164,12 @@ void TreeServer::SetID(const std::string &id)
 {
 	ServerInstance->Logs->Log("m_spanningtree",DEBUG, "Setting SID to " + id);
 	sid = id;
-	Utils->sidlist[sid] = this;
+	Utils->sidlist.set(PackUID(sid), this);
 }
 
 int TreeServer::QuitUsers(const std::string &reason)
 {
-	const char* reason_s = reason.c_str();
-	std::vector<User*> time_to_die;
-	for (user_hash::iterator n = ServerInstance->Users->clientlist->begin(); n != ServerInstance->Users->clientlist->end(); n++)
-	{
-		if (n->second->server == ServerName)
-		{
-			time_to_die.push_back(n->second);
-		}
-	}
-	for (std::vector<User*>::iterator n = time_to_die.begin(); n != time_to_die.end(); n++)
-	{
-		User* a = (User*)*n;
-		if (!IS_LOCAL(a))
-		{
-			if (this->Utils->quiet_bursts)
-				a->quietquit = true;
-
-			if (ServerInstance->Config->HideSplits)
-				ServerInstance->Users->QuitUser(a, "*.net *.split", reason_s);
-			else
-				ServerInstance->Users->QuitUser(a, reason_s);
-		}
-	}
-	return time_to_die.size();
+	return Utils->Creator->Splits->Add(this, reason);
 }
 
 /** This method is used to add the structure to the
@@ -363,7 +344,5 @@ TreeServer::~TreeServer()
 	if (ServerUser != ServerInstance->FakeClient)
 		delete ServerUser;
 
-	server_hash::iterator iter = Utils->sidlist.find(GetID());
-	if (iter != Utils->sidlist.end())
-		Utils->sidlist.erase(iter);
+	Utils->sidlist.erase(GetID());
 }
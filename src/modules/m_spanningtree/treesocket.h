@@ -86,6 +86,40 @@ struct CapabData
 	bool hidden;
 };
 
+/** Progress of a netburst being sent to a newly linked server.
+ * Rather than serialising the whole network into the sendq in one go, the
+ * burst is generated a slice at a time as the link drains (see
+ * TreeSocket::DoWrite()). Anything else sent to the server meanwhile is held
+ * back until the burst is complete, so that it can't refer to something the
+ * server hasn't been told about yet.
+ */
+struct BurstState
+{
+	enum Stage { BURST_USERS, BURST_CHANNELS, BURST_REST, BURST_DONE };
+
+	/** What is being sent */
+	Stage stage;
+	/** UUIDs of the users to send, taken when the burst started. Users are
+	 * looked up again when their turn comes, so ones which quit are skipped,
+	 * and ones which connected since are introduced by the held back lines.
+	 */
+	std::vector<std::string> users;
+	/** Names of the channels to send, taken when the burst started */
+	std::vector<std::string> channels;
+	/** Index of the next user or channel to send */
+	size_t pos;
+	/** Lines sent to the server by anything other than the burst */
+	std::deque<std::string> deferred;
+	/** True while the burst itself is writing to the socket */
+	bool writing;
+	/** When the burst started */
+	time_t started;
+	/** Bytes of burst queued so far */
+	unsigned long long bytes;
+
+	BurstState() : stage(BURST_USERS), pos(0), writing(false), started(ServerInstance->Time()), bytes(0) { }
+};
+
 /** Every SERVER connection inbound or outbound is represented by an object of
  * type TreeSocket. During setup, the object can be found in Utils->timeoutlist;
  * after setup, MyRoot will have been created as a child of Utils->TreeRoot
@@ -99,9 +133,14 @@ class TreeSocket : public BufferedSocket
 	TreeServer* MyRoot;			/* The server we are talking to */
 	int proto_version;			/* Remote protocol version */
 	bool ConnectionFailureShown; /* Set to true if a connection failure message was shown */
+	BurstState* burst;			/* Netburst being sent, or NULL */
 
 	static const unsigned int FMODE_MAX_LENGTH = 350;
 
+	/** Bytes of netburst queued at a time, and slices sent per write event */
+	static const unsigned int BURST_SLICE_LENGTH = 65536;
+	static const unsigned int BURST_SLICES_PER_WRITE = 16;
+
 	/** Checks if the given servername and sid are both free
 	 */
 	bool CheckDuplicate(const std::string& servername, const std::string& sid);
@@ -229,22 +268,41 @@ class TreeSocket : public BufferedSocket
 	 */
 	void SendFJoins(Channel* c);
 
+	/** Returns true if everyone on a channel is left over from a split
+	 */
+	bool HasOnlyGhosts(Channel* c);
+
 	/** Send G, Q, Z and E lines */
 	void SendXLines();
 
-	/** Send channel modes and topics */
-	void SendChannelModes();
+	/** Send a channel's members, modes, topic and metadata */
+	void SendChannel(Channel* c);
 
-	/** send all users and their oper state/modes */
-	void SendUsers();
+	/** Send a user, their oper state, away message and metadata */
+	void SendUser(User* u);
+
+	/** Queue the next slice of the netburst, up to BURST_SLICE_LENGTH bytes.
+	 * When the end of the burst is reached, sends the lines held back during it.
+	 */
+	void ContinueBurst();
+
+	/** Returns the netburst being sent to this server, or NULL if there is none */
+	const BurstState* GetBurst() const { return burst; }
 
 	/** This function is called when we want to send a netburst to a local
 	 * server. There is a set order we must do this, because for example
 	 * users require their servers to exist, and channels require their
 	 * users to exist. You get the idea.
+	 * The servers are sent immediately; everything else follows a slice at a
+	 * time from DoWrite() as the link drains.
 	 */
 	void DoBurst(TreeServer* s);
 
+	/** Writes out the sendq, then keeps the netburst going while the link
+	 * accepts more without blocking
+	 */
+	void DoWrite();
+
 	/** This function is called when we receive data from a remote
 	 * server.
 	 */
@@ -254,6 +312,11 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLine(std::string line);
 
+	/** Send a line built by SpanningTreeUtilities::PrepareLine(), sharing
+	 * the buffer with any other servers it is sent to where possible
+	 */
+	void WriteLine(const reference<SendQBuffer>& line);
+
 	/** Handle ERROR command */
 	void Error(parameterlist &params);
 
@@ -50,6 +50,7 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, Link* link, Autoconnect* mya
 	MyRoot = NULL;
 	proto_version = 0;
 	ConnectionFailureShown = false;
+	burst = NULL;
 	LinkState = CONNECTING;
 	if (!link->Hook.empty())
 	{
@@ -80,6 +81,7 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, int newfd, ListenSocket* via
 	LinkState = WAIT_AUTH_1;
 	proto_version = 0;
 	ConnectionFailureShown = false;
+	burst = NULL;
 	linkID = "inbound from " + client->addr();
 
 	FOREACH_MOD(I_OnHookIO, OnHookIO(this, via));
@@ -116,6 +118,7 @@ TreeSocket::~TreeSocket()
 {
 	if (capab)
 		delete capab;
+	delete burst;
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -144,8 +147,9 @@ void TreeSocket::OnError(BufferedSocketError e)
 void TreeSocket::SendError(const std::string &errormessage)
 {
 	WriteLine("ERROR :"+errormessage);
-	DoWrite();
+	/* Set this first so that DoWrite() doesn't carry on with a burst */
 	LinkState = DYING;
+	DoWrite();
 	SetError(errormessage);
 }
 
@@ -33,6 +33,7 @@
 #include "link.h"
 #include "treesocket.h"
 #include "resolvers.h"
+#include "splitqueue.h"
 
 /* Handle ERROR command */
 void TreeSocket::Error(parameterlist &params)
@@ -447,7 +448,7 @@ void TreeSocket::ProcessConnectedLine(std::string& prefix, std::string& command,
 		 */
 		bool callfnc = true;
 		User* x = ServerInstance->FindNickOnly(params[0]);
-		if ((x) && (x != who) && (x->registered == REG_ALL))
+		if ((x) && (x != who) && (x->registered == REG_ALL) && (!Utils->Creator->Splits->Reap(x)))
 		{
 			int collideret = 0;
 			/* x is local, who is remote */
@@ -22,7 +22,9 @@
 #include "inspircd.h"
 #include "commands.h"
 
+#include "main.h"
 #include "utils.h"
+#include "splitqueue.h"
 #include "link.h"
 #include "treesocket.h"
 #include "treeserver.h"
@@ -45,7 +47,7 @@ CmdResult CommandUID::Handle(const parameterlist &params, User* serversrc)
 	if (!remoteserver)
 		return CMD_INVALID;
 	/* Is this a valid UID, and not misrouted? */
-	if (params[0].length() != 9 || params[0].substr(0,3) != serversrc->uuid)
+	if (params[0].length() != 9 || params[0].substr(0,3) != serversrc->uuid || !PackUID(params[0]))
 		return CMD_INVALID;
 	/* Check parameters for validity before introducing the client, discovered by dmb */
 	if (!age_t)
@@ -57,7 +59,11 @@ CmdResult CommandUID::Handle(const parameterlist &params, User* serversrc)
 	TreeSocket* sock = remoteserver->GetRoute()->GetSocket();
 
 	/* check for collision */
-	User* const collideswith = ServerInstance->FindNickOnly(params[2]);
+	User* collideswith = ServerInstance->FindNickOnly(params[2]);
+
+	/* Someone left over from a split we are still processing gives up their nick without a fight */
+	if ((collideswith) && (Utils->Creator->Splits->Reap(collideswith)))
+		collideswith = NULL;
 
 	if ((collideswith) && (collideswith->registered != REG_ALL))
 	{
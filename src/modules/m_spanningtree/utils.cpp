@@ -123,11 +123,7 @@ TreeServer* SpanningTreeUtilities::FindServerMask(const std::string &ServerName)
 
 TreeServer* SpanningTreeUtilities::FindServerID(const std::string &id)
 {
-	server_hash::iterator iter = sidlist.find(id);
-	if (iter != sidlist.end())
-		return iter->second;
-	else
-		return NULL;
+	return sidlist.find(id);
 }
 
 SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C) : Creator(C)
@@ -202,15 +198,25 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeServerLis
 	return;
 }
 
+SendQBuffer* SpanningTreeUtilities::PrepareLine(const std::string &prefix, const std::string &command, const parameterlist &params)
+{
+	size_t length = prefix.length() + command.length() + 3;
+	for (parameterlist::const_iterator i = params.begin(); i != params.end(); ++i)
+		length += i->length() + 1;
+
+	std::string line;
+	line.reserve(length);
+	line.append(1, ':').append(prefix).append(1, ' ').append(command);
+	for (parameterlist::const_iterator i = params.begin(); i != params.end(); ++i)
+		line.append(1, ' ').append(*i);
+	line.push_back('\n');
+	return new SendQBuffer(line);
+}
+
 bool SpanningTreeUtilities::DoOneToAllButSender(const std::string &prefix, const std::string &command, const parameterlist &params, const std::string& omit)
 {
 	TreeServer* omitroute = this->BestRouteTo(omit);
-	std::string FullLine = ":" + prefix + " " + command;
-	unsigned int words = params.size();
-	for (unsigned int x = 0; x < words; x++)
-	{
-		FullLine = FullLine + " " + params[x];
-	}
+	reference<SendQBuffer> line;
 	unsigned int items = this->TreeRoot->ChildCount();
 	for (unsigned int x = 0; x < items; x++)
 	{
@@ -222,8 +228,9 @@ bool SpanningTreeUtilities::DoOneToAllButSender(const std::string &prefix, const
 		if ((Route) && (Route->GetSocket()) && (Route->GetName() != omit) && (omitroute != Route))
 		{
 			TreeSocket* Sock = Route->GetSocket();
-			if (Sock)
-				Sock->WriteLine(FullLine);
+			if (!line)
+				line = PrepareLine(prefix, command, params);
+			Sock->WriteLine(line);
 		}
 	}
 	return true;
@@ -231,12 +238,7 @@ bool SpanningTreeUtilities::DoOneToAllButSender(const std::string &prefix, const
 
 bool SpanningTreeUtilities::DoOneToMany(const std::string &prefix, const std::string &command, const parameterlist &params)
 {
-	std::string FullLine = ":" + prefix + " " + command;
-	unsigned int words = params.size();
-	for (unsigned int x = 0; x < words; x++)
-	{
-		FullLine = FullLine + " " + params[x];
-	}
+	reference<SendQBuffer> line;
 	unsigned int items = this->TreeRoot->ChildCount();
 	for (unsigned int x = 0; x < items; x++)
 	{
@@ -244,8 +246,9 @@ bool SpanningTreeUtilities::DoOneToMany(const std::string &prefix, const std::st
 		if (Route && Route->GetSocket())
 		{
 			TreeSocket* Sock = Route->GetSocket();
-			if (Sock)
-				Sock->WriteLine(FullLine);
+			if (!line)
+				line = PrepareLine(prefix, command, params);
+			Sock->WriteLine(line);
 		}
 	}
 	return true;
@@ -256,17 +259,10 @@ bool SpanningTreeUtilities::DoOneToOne(const std::string &prefix, const std::str
 	TreeServer* Route = this->BestRouteTo(target);
 	if (Route)
 	{
-		std::string FullLine = ":" + prefix + " " + command;
-		unsigned int words = params.size();
-		for (unsigned int x = 0; x < words; x++)
-		{
-			FullLine = FullLine + " " + params[x];
-		}
-		if (Route && Route->GetSocket())
+		if (Route->GetSocket())
 		{
 			TreeSocket* Sock = Route->GetSocket();
-			if (Sock)
-				Sock->WriteLine(FullLine);
+			Sock->WriteLine(reference<SendQBuffer>(PrepareLine(prefix, command, params)));
 		}
 		return true;
 	}
@@ -435,9 +431,4 @@ void SpanningTreeUtilities::Rehash()
 	for (server_hash::const_iterator i = serverlist.begin(); i != serverlist.end(); ++i)
 		temp.insert(std::make_pair(i->first, i->second));
 	serverlist.swap(temp);
-	temp.clear();
-
-	for (server_hash::const_iterator i = sidlist.begin(); i != sidlist.end(); ++i)
-		temp.insert(std::make_pair(i->first, i->second));
-	sidlist.swap(temp);
 }
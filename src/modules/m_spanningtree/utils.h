@@ -89,7 +89,7 @@ class SpanningTreeUtilities : public classbase
 	server_hash serverlist;
 	/** Hash of currently known server ids
 	 */
-	server_hash sidlist;
+	UIDTable<TreeServer> sidlist;
 	/** List of all outgoing sockets and their timeouts
 	 */
 	TimeoutList timeoutlist;
@@ -126,6 +126,11 @@ class SpanningTreeUtilities : public classbase
 
 	void RouteCommand(TreeServer*, const std::string&, const parameterlist&, User*);
 
+	/** Builds a line from this server, newline included, which can be passed
+	 * to TreeSocket::WriteLine() for any number of servers without being copied
+	 */
+	static SendQBuffer* PrepareLine(const std::string &prefix, const std::string &command, const parameterlist &params);
+
 	/** Send a message from this server to one other local or remote
 	 */
 	bool DoOneToOne(const std::string &prefix, const std::string &command, const parameterlist &params, const std::string& target);
@@ -174,7 +179,7 @@ class SpanningTreeUtilities : public classbase
 	 */
 	void RefreshIPCache();
 
-	/** Recreate serverlist and sidlist, this is needed because of m_nationalchars changing
+	/** Recreate serverlist, this is needed because of m_nationalchars changing
 	 * national_case_insensitive_map which is used by the hash function
 	 */
 	void Rehash();
@@ -0,0 +1,579 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SSL_OFFLOAD_H
+#define SSL_OFFLOAD_H
+
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+#include "threadengine.h"
+
+/* Moves the TLS record layer of the SSL modules onto a pool of worker threads.
+ *
+ * The main thread still owns the socket: it reads ciphertext into the session,
+ * hands plaintext from the sendq to it, and writes out whatever ciphertext the
+ * worker produced. The worker only ever sees buffers, so nothing IRC related
+ * (users, channels, the socket engine) is touched off the main thread.
+ *
+ * Each session is pinned to one worker, which keeps its records in order and
+ * means a library session object is never used by two workers at once.
+ */
+
+class SSLOffloadWorker;
+
+/** The offloaded state of one TLS connection. The SSL modules derive from this
+ * to drive their library's session object from memory buffers.
+ */
+class SSLOffloadSession
+{
+	friend class SSLOffloadWorker;
+
+	/** Guards the exchange buffers and flags below */
+	ThreadQueueData lock;
+
+	/** Ciphertext read from the socket which the worker has not yet decrypted */
+	std::string cipherin;
+	/** Plaintext taken from the sendq which the worker has not yet encrypted */
+	std::string plainout;
+	/** Plaintext decrypted by the worker, waiting to be moved to the recvq */
+	std::string plainin;
+	/** Ciphertext produced by the worker, waiting to be written to the socket */
+	std::string cipherout;
+	/** Set when the session has failed; the socket is closed with this error */
+	std::string error;
+
+	/** True from the time the session is given to its worker until the worker
+	 * has finished with it
+	 */
+	bool queued;
+	/** True while the worker is running Process() without holding the lock */
+	bool busy;
+	/** True while the session is on its worker's list of completed sessions */
+	bool posted;
+	/** True if Process() must run even without input, to start a handshake */
+	bool kick;
+	/** True once the handshake has completed. The worker does no more work on
+	 * the session until the main thread has seen this and set released.
+	 */
+	bool handshaken;
+	bool released;
+	/** True once the socket has been closed. The worker will not touch the
+	 * session any more, and whichever side sees it last deletes it.
+	 */
+	bool closing;
+
+	/** The worker this session is pinned to */
+	SSLOffloadWorker* const worker;
+
+	/** The socket this session belongs to; main thread only */
+	StreamSocket* sock;
+	/** Ciphertext which could not be written to the socket yet; main thread only */
+	std::string sendbuf;
+	/** True if reading from the socket was paused because the worker is
+	 * behind; main thread only
+	 */
+	bool readpaused;
+
+	/** Hand the session to its worker if it is not already there.
+	 * Must be called with the lock held.
+	 */
+	inline void Queue();
+
+	/** Write out as much of sendbuf as the socket will take.
+	 * @return False if the socket failed, in which case error has been set
+	 */
+	bool Flush()
+	{
+		while (!sendbuf.empty())
+		{
+			int rv = ServerInstance->SE->Send(sock, sendbuf.data(), sendbuf.length(), 0);
+			if (rv > 0)
+			{
+				sendbuf.erase(0, rv);
+			}
+			else if (rv < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			else if (rv < 0 && SocketEngine::IgnoreError())
+			{
+				ServerInstance->SE->ChangeEventMask(sock, FD_WANT_SINGLE_WRITE);
+				return true;
+			}
+			else
+			{
+				lock.Lock();
+				if (error.empty())
+					error = rv ? SocketEngine::LastError() : "Connection closed";
+				lock.Unlock();
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** @return The reason the session failed, if it has */
+	std::string GetError()
+	{
+		lock.Lock();
+		std::string err = error;
+		lock.Unlock();
+		return err;
+	}
+
+	/** Called by the worker thread to run the session
+	 * @return True if the session should be put on the worker's completed list
+	 */
+	bool Work()
+	{
+		lock.Lock();
+		while (!closing && error.empty() && (!handshaken || released) && (kick || !cipherin.empty() || !plainout.empty()))
+		{
+			std::string cipherdata;
+			std::string plaindata;
+			cipherdata.swap(cipherin);
+			plaindata.swap(plainout);
+			kick = false;
+			busy = true;
+			lock.Unlock();
+
+			std::string plain;
+			std::string cipher;
+			std::string err;
+			bool done = false;
+			bool ok = Process(cipherdata, plaindata, plain, cipher, done, err);
+
+			lock.Lock();
+			busy = false;
+			plainin.append(plain);
+			cipherout.append(cipher);
+			if (done)
+				handshaken = true;
+			if (!ok && error.empty())
+				error = err.empty() ? "SSL error" : err;
+		}
+		queued = false;
+		bool post = !posted;
+		posted = true;
+		// The main thread may be waiting in Close() for us to finish
+		lock.Wakeup();
+		lock.Unlock();
+		return post;
+	}
+
+ protected:
+	/** How much unprocessed data a session may have before the main thread
+	 * stops feeding it more, in each direction
+	 */
+	size_t BufferLimit() const
+	{
+		return 4 * ServerInstance->Config->NetBufferSize;
+	}
+
+	/** Run the library's TLS state machine. This is called on the worker
+	 * thread, or on the main thread while the socket is being closed, and
+	 * only ever by one thread at a time.
+	 * @param cipherdata Ciphertext received from the peer since the last call
+	 * @param plaindata Plaintext to send to the peer. Implementations must
+	 * hold on to it themselves if the handshake has not finished yet.
+	 * @param plain Decrypted data should be appended to this
+	 * @param cipher Data to send to the peer should be appended to this
+	 * @param done Set this to true when the handshake completes
+	 * @param err Set this to the reason for failure when returning false
+	 * @return False if the session has failed and should be closed
+	 */
+	virtual bool Process(const std::string& cipherdata, const std::string& plaindata, std::string& plain, std::string& cipher, bool& done, std::string& err) = 0;
+
+	/** Called on the main thread once the handshake has completed. The worker
+	 * is held off until this returns, so the library session object may be
+	 * used freely here, e.g. to verify the peer's certificate.
+	 */
+	virtual void OnHandshake() = 0;
+
+	/** Called on the main thread when the socket is closed, with the worker
+	 * held off for good. Implementations should append any closing alert for
+	 * the peer to @a cipher.
+	 */
+	virtual void Shutdown(std::string& cipher) = 0;
+
+ public:
+	inline SSLOffloadSession(StreamSocket* s, SSLOffloadWorker* w);
+
+	virtual ~SSLOffloadSession()
+	{
+	}
+
+	/** Start the session going. This must be called once the derived class is
+	 * fully constructed, and starts the handshake for outbound connections.
+	 */
+	void Start()
+	{
+		lock.Lock();
+		kick = true;
+		Queue();
+		lock.Unlock();
+	}
+
+	/** Called from the IOHook's OnStreamSocketRead. Reads ciphertext from the
+	 * socket and hands back whatever the worker has decrypted so far.
+	 */
+	int OnRead(std::string& recvq)
+	{
+		char* buffer = ServerInstance->GetReadBuffer();
+		bool paused = readpaused;
+		int n = 0;
+		if (!paused)
+			n = ServerInstance->SE->Recv(sock, buffer, ServerInstance->Config->NetBufferSize, 0);
+
+		lock.Lock();
+		if (n > 0)
+		{
+			cipherin.append(buffer, n);
+			Queue();
+		}
+		bool full = (cipherin.length() >= BufferLimit());
+		int rv = 0;
+		if (!plainin.empty())
+		{
+			recvq.append(plainin);
+			plainin.clear();
+			rv = 1;
+		}
+		std::string err = error;
+		lock.Unlock();
+
+		if (!err.empty())
+		{
+			sock->SetError(err);
+			return -1;
+		}
+
+		if (n == 0 && !paused)
+		{
+			sock->SetError("Connection closed");
+			return -1;
+		}
+		else if (n < 0 && errno != EINTR && !SocketEngine::IgnoreError())
+		{
+			sock->SetError(SocketEngine::LastError());
+			return -1;
+		}
+
+		// Stop reading while the worker catches up; OnNotify() resumes it
+		readpaused = full;
+		if (full)
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_NO_READ);
+		else if (paused || n == ServerInstance->Config->NetBufferSize)
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+		else
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ);
+		return rv;
+	}
+
+	/** Called from the IOHook's OnStreamSocketWrite. Flushes ciphertext which
+	 * is already waiting and then hands the plaintext to the worker. The
+	 * buffer may be empty, in which case only the flush is done.
+	 */
+	int OnWrite(std::string& buffer)
+	{
+		if (!Flush())
+		{
+			sock->SetError(GetError());
+			return -1;
+		}
+
+		if (!sendbuf.empty())
+			return 0;
+
+		if (buffer.empty())
+			return 1;
+
+		lock.Lock();
+		if (!error.empty())
+		{
+			std::string err = error;
+			lock.Unlock();
+			sock->SetError(err);
+			return -1;
+		}
+
+		if (plainout.length() >= BufferLimit())
+		{
+			// OnNotify() gives us a trial write once the worker has caught up
+			lock.Unlock();
+			return 0;
+		}
+
+		plainout.append(buffer);
+		Queue();
+		lock.Unlock();
+		return 1;
+	}
+
+	/** Called on the main thread when the worker has finished with the session */
+	void OnNotify()
+	{
+		lock.Lock();
+		posted = false;
+		if (closing)
+		{
+			bool del = !queued;
+			lock.Unlock();
+			if (del)
+				delete this;
+			return;
+		}
+
+		if (handshaken && !released)
+		{
+			lock.Unlock();
+			OnHandshake();
+			lock.Lock();
+			released = true;
+			if (!cipherin.empty() || !plainout.empty())
+				Queue();
+		}
+
+		sendbuf.append(cipherout);
+		cipherout.clear();
+		bool readable = (!plainin.empty() || !error.empty());
+		if (readpaused && cipherin.length() < BufferLimit())
+		{
+			readpaused = false;
+			readable = true;
+		}
+		bool writable = (plainout.length() < BufferLimit());
+		lock.Unlock();
+
+		if (!Flush())
+			readable = true;
+
+		// The recvq is only filled from OnRead(), and errors are only reported
+		// from there too, so ask for a read event to deliver them.
+		if (readable)
+			ServerInstance->SE->ChangeEventMask(sock, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
+		if (writable && sendbuf.empty() && sock->getSendQSize())
+			ServerInstance->SE->ChangeEventMask(sock, FD_ADD_TRIAL_WRITE);
+	}
+
+	/** Called from the IOHook's OnStreamSocketClose. Waits for the worker to
+	 * finish with the session, encrypts anything left on it and makes a final
+	 * attempt to write it out. Once this returns the worker will not touch the
+	 * library session object again, so it may be freed. The offload session
+	 * itself is deleted by this call or by a later OnNotify().
+	 */
+	void Close()
+	{
+		lock.Lock();
+		while (busy)
+			lock.Wait();
+		closing = true;
+		std::string plaindata;
+		plaindata.swap(plainout);
+		cipherin.clear();
+		plainin.clear();
+		sendbuf.append(cipherout);
+		cipherout.clear();
+		bool ok = error.empty();
+		lock.Unlock();
+
+		if (ok && !plaindata.empty())
+		{
+			std::string plain;
+			std::string err;
+			bool done = false;
+			ok = Process(std::string(), plaindata, plain, sendbuf, done, err);
+		}
+		if (ok)
+			Shutdown(sendbuf);
+		if (!sendbuf.empty())
+			ServerInstance->SE->Send(sock, sendbuf.data(), sendbuf.length(), 0);
+		sock = NULL;
+
+		lock.Lock();
+		bool del = (!queued && !posted);
+		lock.Unlock();
+		if (del)
+			delete this;
+	}
+};
+
+/** A worker thread which runs offloaded TLS sessions */
+class SSLOffloadWorker : public SocketThread
+{
+	/** Sessions waiting for this worker, guarded by the queue lock */
+	std::deque<SSLOffloadSession*> work;
+	/** Sessions this worker has finished with, guarded by the queue lock */
+	std::vector<SSLOffloadSession*> done;
+
+ public:
+	/** Add a session to the queue. Called on the main thread. */
+	void Add(SSLOffloadSession* session)
+	{
+		LockQueue();
+		work.push_back(session);
+		UnlockQueueWakeup();
+	}
+
+	void Run()
+	{
+		LockQueue();
+		while (!GetExitFlag())
+		{
+			if (work.empty())
+			{
+				WaitForQueue();
+				continue;
+			}
+
+			SSLOffloadSession* session = work.front();
+			work.pop_front();
+			UnlockQueue();
+
+			bool post = session->Work();
+
+			LockQueue();
+			if (post)
+			{
+				// One wakeup covers everything up to the next OnNotify()
+				bool wake = done.empty();
+				done.push_back(session);
+				if (wake)
+					NotifyParent();
+			}
+		}
+		UnlockQueue();
+	}
+
+	void OnNotify()
+	{
+		std::vector<SSLOffloadSession*> list;
+		LockQueue();
+		list.swap(done);
+		UnlockQueue();
+
+		for (std::vector<SSLOffloadSession*>::iterator i = list.begin(); i != list.end(); ++i)
+			(*i)->OnNotify();
+	}
+
+	/** Delete the sessions still held by the worker after it has been joined.
+	 * Only sessions whose socket has gone are deleted; live ones still belong
+	 * to the SSL module.
+	 */
+	void Purge()
+	{
+		std::set<SSLOffloadSession*> list(work.begin(), work.end());
+		list.insert(done.begin(), done.end());
+		work.clear();
+		done.clear();
+
+		for (std::set<SSLOffloadSession*>::iterator i = list.begin(); i != list.end(); ++i)
+		{
+			if ((*i)->closing)
+				delete *i;
+		}
+	}
+};
+
+/** The set of worker threads used by one SSL module */
+class SSLOffloadPool
+{
+	std::vector<SSLOffloadWorker*> workers;
+	size_t next;
+
+ public:
+	SSLOffloadPool() : next(0)
+	{
+	}
+
+	~SSLOffloadPool()
+	{
+		Stop();
+	}
+
+	/** Start the given number of worker threads */
+	void Start(unsigned int count)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			SSLOffloadWorker* worker = new SSLOffloadWorker;
+			ServerInstance->Threads->Start(worker);
+			workers.push_back(worker);
+		}
+	}
+
+	/** Join all worker threads. Any session still on a worker is left alone
+	 * until Purge() is called.
+	 */
+	void Join()
+	{
+		for (std::vector<SSLOffloadWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			if ((*i)->state)
+				(*i)->join();
+		}
+	}
+
+	/** Join and delete all worker threads */
+	void Stop()
+	{
+		Join();
+		for (std::vector<SSLOffloadWorker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		{
+			(*i)->Purge();
+			delete *i;
+		}
+		workers.clear();
+	}
+
+	/** @return True if sessions should be offloaded */
+	bool IsActive() const
+	{
+		return !workers.empty();
+	}
+
+	/** @return The number of worker threads */
+	size_t GetCount() const
+	{
+		return workers.size();
+	}
+
+	/** Pick the worker for a new session */
+	SSLOffloadWorker* GetWorker()
+	{
+		SSLOffloadWorker* worker = workers[next++ % workers.size()];
+		return worker;
+	}
+};
+
+inline SSLOffloadSession::SSLOffloadSession(StreamSocket* s, SSLOffloadWorker* w)
+	: queued(false), busy(false), posted(false), kick(false), handshaken(false), released(false), closing(false)
+	, worker(w), sock(s), readpaused(false)
+{
+}
+
+inline void SSLOffloadSession::Queue()
+{
+	if (queued || closing)
+		return;
+	queued = true;
+	worker->Add(this);
+}
+
+#endif
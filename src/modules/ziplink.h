@@ -0,0 +1,68 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ZIPLINK_H
+#define ZIPLINK_H
+
+#include "modules.h"
+
+/** Byte counts for one compressed socket */
+struct ZipLinkStats
+{
+	/** Bytes given to the socket to send, before and after compression */
+	unsigned long long raw_out, zip_out;
+	/** Bytes read from the socket, before and after decompression */
+	unsigned long long zip_in, raw_in;
+};
+
+/** Compresses a StreamSocket by installing an IOHook on it. Each direction
+ * is switched on separately, so that the two ends of a link can each agree a
+ * point in their stream after which everything they send is compressed.
+ * The compression state is kept for the life of the socket, so later data
+ * compresses against everything sent before it.
+ *
+ * Providers are registered as "ziplink/<method>", e.g. "ziplink/zlib".
+ */
+class ZipLinkProvider : public DataProvider
+{
+ public:
+	/** The method name, as advertised to the other end */
+	const std::string method;
+
+	ZipLinkProvider(Module* mod, const std::string& Method)
+		: DataProvider(mod, "ziplink/" + Method), method(Method) {}
+
+	/** Compresses everything queued on the socket from now on. Data already on
+	 * its sendq is still sent as it is.
+	 */
+	virtual void StartCompress(StreamSocket* sock) = 0;
+
+	/** Decompresses everything read from the socket from now on.
+	 * @param sock The socket
+	 * @param recvq The socket's recvq, the contents of which were read after
+	 *  the other end started compressing, and are replaced with their decompressed form
+	 * @return False if the data could not be decompressed
+	 */
+	virtual bool StartDecompress(StreamSocket* sock, std::string& recvq) = 0;
+
+	/** Gets the byte counts for a socket
+	 * @return False if the socket isn't compressed in either direction
+	 */
+	virtual bool GetStats(StreamSocket* sock, ZipLinkStats& stats) = 0;
+};
+
+#endif
@@ -37,6 +37,7 @@ void EventHandler::SetFd(int FD)
 SocketEngine::SocketEngine()
 {
 	TotalEvents = WriteEvents = ReadEvents = ErrorEvents = 0;
+	ChangeCalls = MaxChangeCalls = 0;
 	lastempty = ServerInstance->Time();
 	indata = outdata = 0;
 }
@@ -29,6 +29,11 @@
 #include <iostream>
 #define EP_DELAY 5
 
+/** The most events harvested from a single epoll_wait() call. Anything left over
+ * stays on the kernel's ready list and is picked up by the next loop iteration.
+ */
+#define EP_MAXEVENTS 1024
+
 /** A specialisation of the SocketEngine class, designed to use linux 2.6 epoll().
  */
 class EPollEngine : public SocketEngine
@@ -37,7 +42,24 @@ private:
 	/** These are used by epoll() to hold socket events
 	 */
 	struct epoll_event* events;
+	/** Size of the events array
+	 */
+	int maxevents;
 	int EngineHandle;
+	/** The epoll events the kernel currently has for each fd
+	 */
+	unsigned* kernelevents;
+	/** Set for each fd that is on the changes list
+	 */
+	bool* changed;
+	/** Fds whose event mask changed since the kernel was last told about them
+	 */
+	std::vector<int> changes;
+
+	/** Tell the kernel about every event mask that changed during this loop iteration.
+	 * A socket which flipped modes and back again is left alone.
+	 */
+	void ApplyChanges();
 public:
 	/** Create a new EPollEngine
 	 */
@@ -80,10 +102,15 @@ EPollEngine::EPollEngine()
 		ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
 	}
 
+	maxevents = std::min(GetMaxFds(), EP_MAXEVENTS);
 	ref = new EventHandler* [GetMaxFds()];
-	events = new struct epoll_event[GetMaxFds()];
+	events = new struct epoll_event[maxevents];
+	kernelevents = new unsigned[GetMaxFds()];
+	changed = new bool[GetMaxFds()];
 
 	memset(ref, 0, GetMaxFds() * sizeof(EventHandler*));
+	memset(kernelevents, 0, GetMaxFds() * sizeof(unsigned));
+	memset(changed, 0, GetMaxFds() * sizeof(bool));
 }
 
 EPollEngine::~EPollEngine()
@@ -91,6 +118,8 @@ EPollEngine::~EPollEngine()
 	this->Close(EngineHandle);
 	delete[] ref;
 	delete[] events;
+	delete[] kernelevents;
+	delete[] changed;
 }
 
 static unsigned mask_to_epoll(int event_mask)
@@ -145,6 +174,7 @@ bool EPollEngine::AddFd(EventHandler* eh, int event_mask)
 	ServerInstance->Logs->Log("SOCKET",DEBUG,"New file descriptor: %d", fd);
 
 	ref[fd] = eh;
+	kernelevents[fd] = ev.events;
 	SocketEngine::SetEventMask(eh, event_mask);
 	CurrentSetSize++;
 	return true;
@@ -152,17 +182,48 @@ bool EPollEngine::AddFd(EventHandler* eh, int event_mask)
 
 void EPollEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 {
-	unsigned old_events = mask_to_epoll(old_mask);
-	unsigned new_events = mask_to_epoll(new_mask);
-	if (old_events != new_events)
+	// Sockets flip between edge-triggered and polled modes as their sendq fills and
+	// drains, so only note the change here. ApplyChanges() works out whether the
+	// kernel needs to hear about it before we next wait for events.
+	int fd = eh->GetFd();
+	if (mask_to_epoll(old_mask) != mask_to_epoll(new_mask) && !changed[fd])
 	{
+		changed[fd] = true;
+		changes.push_back(fd);
+	}
+}
+
+void EPollEngine::ApplyChanges()
+{
+	unsigned long calls = 0;
+	for (std::vector<int>::const_iterator i = changes.begin(); i != changes.end(); ++i)
+	{
+		int fd = *i;
+		changed[fd] = false;
+
+		// Removed from the engine since the change was noted
+		EventHandler* eh = ref[fd];
+		if (!eh)
+			continue;
+
+		unsigned new_events = mask_to_epoll(eh->GetEventMask());
+		if (new_events == kernelevents[fd])
+			continue;
+
 		// ok, we actually have something to tell the kernel about
 		struct epoll_event ev;
 		memset(&ev,0,sizeof(ev));
 		ev.events = new_events;
-		ev.data.fd = eh->GetFd();
-		epoll_ctl(EngineHandle, EPOLL_CTL_MOD, eh->GetFd(), &ev);
+		ev.data.fd = fd;
+		epoll_ctl(EngineHandle, EPOLL_CTL_MOD, fd, &ev);
+		kernelevents[fd] = new_events;
+		calls++;
 	}
+	changes.clear();
+
+	ChangeCalls += calls;
+	if (calls > MaxChangeCalls)
+		MaxChangeCalls = calls;
 }
 
 void EPollEngine::DelFd(EventHandler* eh)
@@ -194,7 +255,12 @@ int EPollEngine::DispatchEvents()
 {
 	socklen_t codesize = sizeof(int);
 	int errcode;
-	int i = epoll_wait(EngineHandle, events, GetMaxFds() - 1, 1000);
+
+	ApplyChanges();
+
+	// Timers are due on whole seconds, so wait no longer than the start of the next one
+	int timeout = 1000 - ServerInstance->Time_ns() / 1000000;
+	int i = epoll_wait(EngineHandle, events, maxevents, timeout);
 	ServerInstance->UpdateTime();
 
 	TotalEvents += i;
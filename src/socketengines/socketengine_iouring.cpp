@@ -0,0 +1,471 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <vector>
+#include <string>
+#include "inspircd.h"
+#include "exitcodes.h"
+#include "socketengine.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <iostream>
+
+/** Number of submission queue entries. The kernel makes the completion queue
+ * twice this size, and keeps any overflow itself (IORING_FEAT_NODROP).
+ */
+#define IOURING_ENTRIES 1024
+
+/** The most completions dispatched from a single DispatchEvents() call. Anything left
+ * over stays on the completion queue and is picked up by the next loop iteration.
+ */
+#define IOURING_MAXEVENTS 1024
+
+/** A specialisation of the SocketEngine class, designed to use the linux io_uring interface.
+ *
+ * The rest of the ircd does its own reads and writes when a socket becomes ready, so this
+ * engine uses io_uring as a readiness notifier: each fd has at most one one-shot
+ * IORING_OP_POLL_ADD request outstanding, which is re-armed after it completes. All poll
+ * requests and cancellations made during a loop iteration are submitted together with
+ * the wait for events, in a single io_uring_enter() call.
+ */
+class IOUringEngine : public SocketEngine
+{
+private:
+	/** The io_uring instance
+	 */
+	int RingHandle;
+
+	/** Submission queue, mapped from the kernel
+	 */
+	void* sq_ring;
+	size_t sq_ring_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+
+	/** Our copy of the submission queue tail, and the tail as of the last io_uring_enter()
+	 */
+	unsigned sq_local_tail;
+	unsigned sq_submitted;
+
+	/** Completion queue, mapped from the kernel
+	 */
+	void* cq_ring;
+	size_t cq_ring_size;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+
+	/** Ticket of the poll request outstanding for each fd, or 0 if there is none.
+	 * Completions carry the ticket they were submitted with, so completions of
+	 * cancelled requests and of requests for an fd that has since been reused
+	 * can be told apart from current ones.
+	 */
+	unsigned* tickets;
+	/** The poll events of the request outstanding for each fd
+	 */
+	unsigned* armed;
+	unsigned nextticket;
+
+	/** Set for each fd that is on the changes list
+	 */
+	bool* changed;
+	/** Fds which need their poll request (re)submitted
+	 */
+	std::vector<int> changes;
+
+	/** Timeout given to the kernel with each wait
+	 */
+	struct __kernel_timespec timeout;
+
+	/** Get a free submission queue entry, submitting the queue to the kernel if it is full
+	 */
+	struct io_uring_sqe* GetSQE();
+
+	/** Submit all queued entries and, if wait is true, wait for at least one completion
+	 */
+	int Enter(bool wait);
+
+	/** Note that the poll request of an fd needs to be looked at before the next wait
+	 */
+	void MarkChanged(int fd);
+
+	/** Queue the cancellation of the poll request outstanding for an fd
+	 */
+	void CancelPoll(int fd);
+
+	/** Queue poll requests for every fd whose event mask changed or whose request completed
+	 */
+	void ApplyChanges();
+
+public:
+	/** Create a new IOUringEngine
+	 */
+	IOUringEngine();
+	/** Delete an IOUringEngine
+	 */
+	virtual ~IOUringEngine();
+	virtual bool AddFd(EventHandler* eh, int event_mask);
+	virtual void OnSetEvent(EventHandler* eh, int old_mask, int new_mask);
+	virtual void DelFd(EventHandler* eh);
+	virtual int DispatchEvents();
+	virtual std::string GetName();
+};
+
+static unsigned mask_to_poll(int event_mask)
+{
+	unsigned rv = 0;
+	if (event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ))
+		rv |= POLLIN;
+	if (event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+		rv |= POLLOUT;
+	return rv;
+}
+
+static inline __u64 make_data(unsigned ticket, int fd)
+{
+	return ((__u64)ticket << 32) | (unsigned)fd;
+}
+
+IOUringEngine::IOUringEngine()
+{
+	CurrentSetSize = 0;
+
+	struct rlimit limit;
+	if (!getrlimit(RLIMIT_NOFILE, &limit))
+	{
+		MAX_DESCRIPTORS = limit.rlim_cur;
+	}
+	else
+	{
+		ServerInstance->Logs->Log("SOCKET", DEFAULT, "ERROR: Can't determine maximum number of open sockets!");
+		std::cout << "ERROR: Can't determine maximum number of open sockets!" << std::endl;
+		ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
+	}
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	RingHandle = syscall(__NR_io_uring_setup, IOURING_ENTRIES, &params);
+
+	if (RingHandle == -1 || !(params.features & IORING_FEAT_NODROP))
+	{
+		ServerInstance->Logs->Log("SOCKET",DEFAULT, "ERROR: Could not initialize socket engine: %s", RingHandle == -1 ? strerror(errno) : "io_uring may drop events");
+		ServerInstance->Logs->Log("SOCKET",DEFAULT, "ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now.");
+		std::cout << "ERROR: Could not initialize io_uring socket engine: " << (RingHandle == -1 ? strerror(errno) : "io_uring may drop events") << std::endl;
+		std::cout << "ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now." << std::endl;
+		ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
+	}
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingHandle, IORING_OFF_SQ_RING);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ring = sq_ring;
+	else
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingHandle, IORING_OFF_CQ_RING);
+	sqes = (struct io_uring_sqe*)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, RingHandle, IORING_OFF_SQES);
+
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		ServerInstance->Logs->Log("SOCKET",DEFAULT, "ERROR: Could not map io_uring queues: %s", strerror(errno));
+		std::cout << "ERROR: Could not map io_uring queues: " << strerror(errno) << std::endl;
+		ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
+	}
+
+	char* sq = (char*)sq_ring;
+	sq_head = (unsigned*)(sq + params.sq_off.head);
+	sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	sq_entries = params.sq_entries;
+	sq_local_tail = sq_submitted = *sq_tail;
+
+	// Submission queue entries are always used in order, so the index array never changes
+	unsigned* sq_array = (unsigned*)(sq + params.sq_off.array);
+	for (unsigned i = 0; i < sq_entries; i++)
+		sq_array[i] = i;
+
+	char* cq = (char*)cq_ring;
+	cq_head = (unsigned*)(cq + params.cq_off.head);
+	cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	ref = new EventHandler* [GetMaxFds()];
+	tickets = new unsigned[GetMaxFds()];
+	armed = new unsigned[GetMaxFds()];
+	changed = new bool[GetMaxFds()];
+	nextticket = 1;
+
+	memset(ref, 0, GetMaxFds() * sizeof(EventHandler*));
+	memset(tickets, 0, GetMaxFds() * sizeof(unsigned));
+	memset(armed, 0, GetMaxFds() * sizeof(unsigned));
+	memset(changed, 0, GetMaxFds() * sizeof(bool));
+}
+
+IOUringEngine::~IOUringEngine()
+{
+	munmap(sqes, sqes_size);
+	if (cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	munmap(sq_ring, sq_ring_size);
+	this->Close(RingHandle);
+	delete[] ref;
+	delete[] tickets;
+	delete[] armed;
+	delete[] changed;
+}
+
+struct io_uring_sqe* IOUringEngine::GetSQE()
+{
+	if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+		Enter(false);
+
+	struct io_uring_sqe* sqe = &sqes[sq_local_tail & sq_mask];
+	sq_local_tail++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int IOUringEngine::Enter(bool wait)
+{
+	unsigned submit = sq_local_tail - sq_submitted;
+	__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+	sq_submitted = sq_local_tail;
+
+	int rv = syscall(__NR_io_uring_enter, RingHandle, submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (rv < 0 && errno != EINTR)
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"io_uring_enter failed: %s", strerror(errno));
+	return rv;
+}
+
+void IOUringEngine::MarkChanged(int fd)
+{
+	if (!changed[fd])
+	{
+		changed[fd] = true;
+		changes.push_back(fd);
+	}
+}
+
+void IOUringEngine::CancelPoll(int fd)
+{
+	struct io_uring_sqe* sqe = GetSQE();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = make_data(tickets[fd], fd);
+	// Ticket 0 is never current, so the completion of the removal itself is ignored
+	sqe->user_data = make_data(0, fd);
+	tickets[fd] = 0;
+	armed[fd] = 0;
+}
+
+void IOUringEngine::ApplyChanges()
+{
+	for (std::vector<int>::const_iterator i = changes.begin(); i != changes.end(); ++i)
+	{
+		int fd = *i;
+		changed[fd] = false;
+
+		EventHandler* eh = ref[fd];
+		unsigned events = eh ? mask_to_poll(eh->GetEventMask()) : 0;
+		if (tickets[fd] && events == armed[fd])
+			continue;
+
+		if (tickets[fd])
+			CancelPoll(fd);
+
+		if (events)
+		{
+			if (!++nextticket)
+				nextticket = 1;
+
+			struct io_uring_sqe* sqe = GetSQE();
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->fd = fd;
+			sqe->poll_events = events;
+			sqe->user_data = make_data(nextticket, fd);
+			tickets[fd] = nextticket;
+			armed[fd] = events;
+		}
+	}
+	changes.clear();
+}
+
+bool IOUringEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"AddFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return false;
+	}
+
+	if (ref[fd])
+	{
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	ServerInstance->Logs->Log("SOCKET",DEBUG,"New file descriptor: %d", fd);
+
+	ref[fd] = eh;
+	SocketEngine::SetEventMask(eh, event_mask);
+	MarkChanged(fd);
+	CurrentSetSize++;
+	return true;
+}
+
+void IOUringEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	if (mask_to_poll(old_mask) != mask_to_poll(new_mask))
+		MarkChanged(eh->GetFd());
+}
+
+void IOUringEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"DelFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return;
+	}
+
+	if (tickets[fd])
+		CancelPoll(fd);
+
+	ref[fd] = NULL;
+
+	ServerInstance->Logs->Log("SOCKET",DEBUG,"Remove file descriptor: %d", fd);
+	CurrentSetSize--;
+}
+
+int IOUringEngine::DispatchEvents()
+{
+	socklen_t codesize = sizeof(int);
+	int errcode;
+
+	ApplyChanges();
+
+	// Completions left over from the last call mean there is no need to wait
+	bool wait = (__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) == *cq_head);
+	if (wait)
+	{
+		// Timers are due on whole seconds, so wait no longer than the start of the next one.
+		// The timeout also completes as soon as any other request does.
+		long nsecs = 1000000000 - ServerInstance->Time_ns();
+		timeout.tv_sec = nsecs / 1000000000;
+		timeout.tv_nsec = nsecs % 1000000000;
+
+		struct io_uring_sqe* sqe = GetSQE();
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (unsigned long)&timeout;
+		sqe->len = 1;
+		sqe->off = 1;
+		sqe->user_data = make_data(0, 0);
+	}
+	Enter(wait);
+	ServerInstance->UpdateTime();
+
+	int i = 0;
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail && i < IOURING_MAXEVENTS)
+	{
+		struct io_uring_cqe* cqe = &cqes[head & cq_mask];
+		__u64 data = cqe->user_data;
+		int res = cqe->res;
+		__atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+
+		int fd = data & 0xFFFFFFFF;
+		unsigned ticket = data >> 32;
+		if (!ticket || fd >= GetMaxFds() || tickets[fd] != ticket)
+			continue;
+
+		// The request was one-shot, it is re-armed before the next wait
+		tickets[fd] = 0;
+		armed[fd] = 0;
+
+		EventHandler* eh = ref[fd];
+		if (!eh)
+			continue;
+
+		MarkChanged(fd);
+		TotalEvents++;
+		i++;
+
+		if (res < 0)
+		{
+			ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, -res);
+			continue;
+		}
+		if (res & POLLHUP)
+		{
+			ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, 0);
+			continue;
+		}
+		if (res & POLLERR)
+		{
+			ErrorEvents++;
+			/* Get error number */
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+				errcode = errno;
+			eh->HandleEvent(EVENT_ERROR, errcode);
+			continue;
+		}
+		if (res & POLLIN)
+		{
+			SetEventMask(eh, eh->GetEventMask() & ~FD_READ_WILL_BLOCK);
+			ReadEvents++;
+			eh->HandleEvent(EVENT_READ);
+			if (eh != ref[fd])
+				// whoa! we got deleted, better not give out the write event
+				continue;
+		}
+		if (res & POLLOUT)
+		{
+			SetEventMask(eh, eh->GetEventMask() & ~(FD_WRITE_WILL_BLOCK | FD_WANT_SINGLE_WRITE));
+			WriteEvents++;
+			eh->HandleEvent(EVENT_WRITE);
+		}
+	}
+
+	return i;
+}
+
+std::string IOUringEngine::GetName()
+{
+	return "io_uring";
+}
+
+SocketEngine* CreateSocketEngine()
+{
+	return new IOUringEngine;
+}
@@ -23,6 +23,8 @@
 
 #include "inspircd.h"
 #include "testsuite.h"
+#include "xline.h"
+#include "literalmatch.h"
 #include "threadengine.h"
 #include <iostream>
 
@@ -64,6 +66,13 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Common neighbour iteration benchmark\n";
+		std::cout << "(T) Timer wheel tests\n";
+		std::cout << "(L) Line splitter benchmark\n";
+		std::cout << "(B) Ban list benchmark\n";
+		std::cout << "(Z) X-line index benchmark\n";
+		std::cout << "(F) Filter prefilter benchmark\n";
+		std::cout << "(U) UUID table benchmark\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -107,6 +116,27 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoNeighborTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'T':
+				std::cout << (DoTimerTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'L':
+				std::cout << (DoLineSplitTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'B':
+				std::cout << (DoBanListTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'Z':
+				std::cout << (DoXLineIndexTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'F':
+				std::cout << (DoLiteralMatchTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'U':
+				std::cout << (DoUIDTableTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -402,8 +432,779 @@ bool TestSuite::RealGenerateUIDTests()
 	return true;
 }
 
+/** Fake local users for the benchmarks below, which are deleted again when
+ * this goes out of scope. They must not be on any channels by then.
+ */
+class TestUsers
+{
+ public:
+	std::vector<LocalUser*> users;
+
+	/** Creates a user connecting from an IP address */
+	LocalUser* Add(const std::string& ip)
+	{
+		irc::sockets::sockaddrs sa;
+		irc::sockets::aptosa(ip, 0, sa);
+		LocalUser* u = new LocalUser(-1, &sa, &sa);
+		users.push_back(u);
+		return u;
+	}
+
+	~TestUsers()
+	{
+		for (std::vector<LocalUser*>::iterator u = users.begin(); u != users.end(); ++u)
+		{
+			ServerInstance->Users->uuidlist->erase((*u)->uuid);
+			delete *u;
+		}
+		ServerInstance->GlobalCulls.Apply();
+	}
+};
+
+/** Measures the CPU time taken by the parts of a benchmark */
+class TestClock
+{
+	clock_t start;
+
+ public:
+	TestClock() : start(clock()) { }
+
+	/** Returns the milliseconds since the clock was created or last read, and starts it again */
+	unsigned long Lap()
+	{
+		clock_t now = clock();
+		unsigned long ms = (now - start) * 1000 / CLOCKS_PER_SEC;
+		start = now;
+		return ms;
+	}
+
+	/** Prints the milliseconds since the clock was created or last read, and starts it again */
+	void Report(const char* what, unsigned int rounds = 1)
+	{
+		std::cout << what << ": " << Lap() << "ms";
+		if (rounds > 1)
+			std::cout << " for " << rounds << " rounds";
+		std::cout << "\n";
+	}
+};
+
+/* The neighbour walk used before NeighborIterator, kept here for comparison */
+static unsigned long OldNeighborWalk(User* source)
+{
+	unsigned long count = 0;
+	already_sent_t uniq_id = ++LocalUser::already_sent_id;
+
+	UserChanList include_c(source->chans);
+	std::map<User*,bool> exceptions;
+	exceptions[source] = false;
+
+	FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(source, include_c, exceptions));
+
+	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	{
+		LocalUser* u = IS_LOCAL(i->first);
+		if (u && !u->quitting)
+		{
+			u->already_sent = uniq_id;
+			if (i->second)
+				count++;
+		}
+	}
+	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
+	{
+		const UserMembList* ulist = (*v)->GetUsers();
+		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		{
+			LocalUser* u = IS_LOCAL(i->first);
+			if (u && !u->quitting && u->already_sent != uniq_id)
+			{
+				u->already_sent = uniq_id;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+bool TestSuite::DoNeighborTests()
+{
+	const unsigned int chancount = 100;
+	const unsigned int usercount = 2000;
+	const unsigned int membercount = 500;
+	const unsigned int rounds = 200;
+
+	std::cout << "\n\nBuilding " << usercount << " users in " << chancount << " channels of " << membercount << " members\n";
+
+	TestUsers fixture;
+	std::vector<LocalUser*>& users = fixture.users;
+	for (unsigned int i = 0; i < usercount; i++)
+	{
+		LocalUser* u = fixture.Add("127.0.0.1");
+		u->nick = "bench" + ConvToStr(i);
+		u->registered = REG_ALL;
+	}
+
+	// users[0] is on every channel, everyone else on a pseudo-random selection
+	std::vector<Channel*> chans;
+	for (unsigned int c = 0; c < chancount; c++)
+	{
+		Channel* chan = new Channel("#neighborbench" + ConvToStr(c), ServerInstance->Time());
+		chans.push_back(chan);
+		for (unsigned int n = 0; n < membercount; n++)
+		{
+			User* u = users[n ? (n * 7919 + c * 104729) % usercount : 0];
+			if (chan->HasUser(u))
+				continue;
+			chan->AddUser(u);
+			u->chans.insert(chan);
+		}
+	}
+
+	unsigned long expected = OldNeighborWalk(users[0]);
+	TestClock watch;
+	for (unsigned int r = 0; r < rounds; r++)
+		OldNeighborWalk(users[0]);
+	watch.Report("Old walk", rounds);
+
+	unsigned long count = 0;
+	for (unsigned int r = 0; r < rounds; r++)
+	{
+		count = 0;
+		NeighborIterator neighbors(users[0], false);
+		while (neighbors.Next())
+			count++;
+	}
+	watch.Report("NeighborIterator", rounds);
+
+	std::cout << "Neighbours of a user in " << users[0]->chans.size() << " channels: " << count << " (expected " << expected << ")\n";
+
+	for (std::vector<Channel*>::iterator c = chans.begin(); c != chans.end(); ++c)
+	{
+		while (!(*c)->userlist.empty())
+		{
+			User* u = (*c)->userlist.begin()->first;
+			u->chans.erase(*c);
+			(*c)->DelUser(u);
+		}
+	}
+
+	return (count == expected);
+}
+
+class TestTimer : public Timer
+{
+ public:
+	static unsigned long fired;
+	static unsigned long late;
+
+	TestTimer(long secs_from_now, time_t now) : Timer(secs_from_now, now) { }
+
+	void Tick(time_t TIME)
+	{
+		fired++;
+		if (TIME != GetTimer() + 1)
+			late++;
+	}
+};
+
+unsigned long TestTimer::fired = 0;
+unsigned long TestTimer::late = 0;
+
+bool TestSuite::DoTimerTests()
+{
+	const unsigned int timercount = 500000;
+	TimerManager timers;
+	time_t now = ServerInstance->Time();
+	long maxsecs = 0;
+
+	std::cout << "\n\nAdding " << timercount << " timers\n";
+
+	std::vector<Timer*> added;
+	added.reserve(timercount);
+	TestClock watch;
+	for (unsigned int i = 0; i < timercount; i++)
+	{
+		// Mostly short timers like DNS and socket timeouts, with some long ones mixed in
+		long secs = (i % 100) ? 1 + (i * 7919) % 3600 : 20000 + i % 50000;
+		maxsecs = std::max(maxsecs, secs);
+		Timer* t = new TestTimer(secs, now);
+		timers.AddTimer(t);
+		added.push_back(t);
+	}
+	unsigned long addtime = watch.Lap();
+
+	for (unsigned int i = 0; i < timercount; i += 4)
+		timers.DelTimer(added[i]);
+	unsigned long deltime = watch.Lap();
+
+	unsigned long expected = timers.GetTimerCount();
+	TestTimer::fired = TestTimer::late = 0;
+	watch.Lap();
+	for (time_t t = now + 1; t <= now + maxsecs + 1; t++)
+		timers.TickTimers(t);
+	unsigned long ticktime = watch.Lap();
+
+	std::cout << "Add: " << addtime << "ms, delete " << (timercount / 4) << ": "
+		<< deltime << "ms, tick " << maxsecs << " seconds: " << ticktime << "ms\n";
+	std::cout << "Fired " << TestTimer::fired << " of " << expected << ", " << TestTimer::late << " at the wrong time, "
+		<< timers.GetTimerCount() << " left over\n";
+
+	bool passed = ((TestTimer::fired == expected) && (!TestTimer::late) && (!timers.GetTimerCount()));
+
+	// The clock jumping forwards: the timer that was due meanwhile fires straight
+	// away (late, of course), and everything else still fires on time.
+	{
+		TimerManager jumped;
+		TestTimer::fired = TestTimer::late = 0;
+		jumped.AddTimer(new TestTimer(10, now));
+		jumped.AddTimer(new TestTimer(100000, now));
+		watch.Lap();
+		jumped.TickTimers(now + 50000);
+		unsigned long jumptime = watch.Lap();
+		bool overdue = (TestTimer::fired == 1);
+		jumped.AddTimer(new TestTimer(5, now + 50000));
+		for (time_t t = now + 50001; t <= now + 100001; t++)
+			jumped.TickTimers(t);
+
+		std::cout << "Clock forwards 50000 seconds: " << jumptime << "ms, fired " << TestTimer::fired << " of 3, "
+			<< TestTimer::late << " late (expected 1)\n";
+		if (!overdue || TestTimer::fired != 3 || TestTimer::late != 1 || jumped.GetTimerCount())
+			passed = false;
+	}
+
+	// The clock going backwards: timers added afterwards must not be held back to the old time
+	{
+		TimerManager rewound;
+		TestTimer::fired = TestTimer::late = 0;
+		for (time_t t = now + 1; t <= now + 100; t++)
+			rewound.TickTimers(t);
+		rewound.AddTimer(new TestTimer(10, now));
+		for (time_t t = now + 1; t <= now + 11; t++)
+			rewound.TickTimers(t);
+
+		std::cout << "Clock backwards 100 seconds: fired " << TestTimer::fired << " of 1, " << TestTimer::late << " late\n";
+		if (TestTimer::fired != 1 || TestTimer::late || rewound.GetTimerCount())
+			passed = false;
+	}
+
+	return passed;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
 }
 
+/* The line splitter UserIOHandler::OnDataReady used to have: copy each line
+ * out byte by byte, then copy the rest of the recvq down over it.
+ */
+static unsigned long OldLineSplit(std::string recvq, std::vector<std::string>* lines)
+{
+	unsigned long count = 0;
+	while (1)
+	{
+		std::string line;
+		line.reserve(MAXBUF);
+		std::string::size_type qpos = 0;
+		while (qpos < recvq.length())
+		{
+			char c = recvq[qpos++];
+			switch (c)
+			{
+			case '\0':
+				c = ' ';
+				break;
+			case '\r':
+				continue;
+			case '\n':
+				goto eol_found;
+			}
+			if (line.length() < MAXBUF - 2)
+				line.push_back(c);
+		}
+		return count;
+eol_found:
+		recvq = recvq.substr(qpos);
+		if (lines)
+			lines->push_back(line);
+		count++;
+	}
+}
+
+bool TestSuite::DoLineSplitTests()
+{
+	const unsigned int burstsize = 65536;
+	const unsigned int rounds = 200;
+
+	// A bouncer replaying a backlog, with a few odd lines mixed in
+	static const char oddline[] = "PRIVMSG #chan :embedded\0nul and\rcr\n";
+	std::string burst;
+	for (unsigned int i = 0; burst.length() < burstsize; i++)
+	{
+		if (i % 97 == 0)
+			burst.append(oddline, sizeof(oddline) - 1);
+		else if (i % 89 == 0)
+			burst.append("PRIVMSG #chan :").append(700, 'x').append("\r\n");
+		else if (i % 13 == 0)
+			burst.append("PING :lf.only\n");
+		else
+			burst.append("PRIVMSG #channel :pipelined backlog line number ").append(ConvToStr(i)).append("\r\n");
+	}
+	// Partial trailing line, which must be left alone
+	burst.append("PRIVMSG #chan :incompl");
+
+	std::cout << "\n\nSplitting a burst of " << burst.length() << " bytes\n";
+
+	std::vector<std::string> expected;
+	OldLineSplit(burst, &expected);
+
+	bool passed = true;
+	std::string line;
+	std::string::size_type pos = 0;
+	for (std::vector<std::string>::iterator i = expected.begin(); i != expected.end(); ++i)
+	{
+		if (!UserIOHandler::SplitLine(burst, pos, line) || line != *i)
+		{
+			std::cout << "Line mismatch: \"" << line << "\" expected \"" << *i << "\"\n";
+			passed = false;
+			break;
+		}
+	}
+	if (passed && UserIOHandler::SplitLine(burst, pos, line))
+	{
+		std::cout << "Split a line out of an incomplete tail\n";
+		passed = false;
+	}
+	if (passed && burst.substr(pos) != "PRIVMSG #chan :incompl")
+	{
+		std::cout << "Wrong tail left: \"" << burst.substr(pos) << "\"\n";
+		passed = false;
+	}
+
+	std::cout << expected.size() << " lines\n";
+
+	TestClock watch;
+	for (unsigned int r = 0; r < rounds; r++)
+		OldLineSplit(burst, NULL);
+	watch.Report("Old splitter", rounds);
+
+	for (unsigned int r = 0; r < rounds; r++)
+	{
+		std::string recvq(burst);
+		pos = 0;
+		while (UserIOHandler::SplitLine(recvq, pos, line))
+			;
+		recvq.erase(0, pos);
+	}
+	watch.Report("SplitLine", rounds);
+
+	return passed;
+}
+
+/* How Channel::IsBanned used to check the ban list: every mask in turn */
+static bool OldBanScan(Channel* chan, User* user)
+{
+	for (BanList::iterator i = chan->bans.begin(); i != chan->bans.end(); i++)
+		if (chan->CheckBan(user, i->data))
+			return true;
+	return false;
+}
+
+/* And Channel::GetExtBanStatus */
+static bool OldExtBanScan(Channel* chan, User* user, char type)
+{
+	for (BanList::iterator i = chan->bans.begin(); i != chan->bans.end(); i++)
+		if (i->data.length() > 2 && i->data[0] == type && i->data[1] == ':' && chan->CheckBan(user, i->data.substr(2)))
+			return true;
+	return false;
+}
+
+bool TestSuite::DoBanListTests()
+{
+	const unsigned int bancount = 500;
+	const unsigned int usercount = 2000;
+	const unsigned int rounds = 20;
+
+	Channel* chan = new Channel("#banbench", ServerInstance->Time());
+	for (unsigned int i = 0; i < bancount; i++)
+	{
+		BanItem b;
+		b.set_time = ServerInstance->Time();
+		b.set_by = "bench";
+		switch (i % 8)
+		{
+			case 0:
+				b.data = "*!*@host" + ConvToStr(i) + ".Example.com";
+				break;
+			case 1:
+				b.data = "*!*@10.0." + ConvToStr(i % 256) + "." + ConvToStr(i % 7);
+				break;
+			case 2:
+				b.data = "*!*@10.1." + ConvToStr(i % 256) + ".0/24";
+				break;
+			case 3:
+				b.data = "*!*@2001:db8:" + ConvToStr(i) + "::/48";
+				break;
+			case 4:
+				b.data = "*!*@*.isp" + ConvToStr(i) + ".net";
+				break;
+			case 5:
+				b.data = "baduser" + ConvToStr(i) + "!*@*";
+				break;
+			case 6:
+				b.data = "*!ident" + ConvToStr(i) + "@host?" + ConvToStr(i) + ".example.com";
+				break;
+			case 7:
+				b.data = "m:*!*@host" + ConvToStr(i) + ".example.com";
+				break;
+		}
+		chan->bans.push_back(b);
+	}
+	chan->InvalidateBanCache();
+
+	TestUsers fixture;
+	std::vector<LocalUser*>& users = fixture.users;
+	for (unsigned int i = 0; i < usercount; i++)
+	{
+		LocalUser* u = fixture.Add(i % 5 == 4 ? "2001:db8:" + ConvToStr(i % 700) + "::" + ConvToStr(i)
+			: "10." + ConvToStr(i % 3) + "." + ConvToStr(i % 256) + "." + ConvToStr(i % 9));
+		u->nick = (i % 11 ? "bench" : "baduser") + ConvToStr(i % 600);
+		u->ident = "ident" + ConvToStr(i % 600);
+		u->host = (i % 3 ? "host" : "user") + ConvToStr(i % 600) + (i % 2 ? ".example.com" : ".isp" + ConvToStr(i % 600) + ".net");
+		u->dhost = (i % 7 ? u->host : "cloaked.example.com");
+	}
+
+	std::cout << "\n\nChecking " << usercount << " users against " << bancount << " bans\n";
+
+	bool passed = true;
+	unsigned int banned = 0, muted = 0;
+	for (std::vector<LocalUser*>::iterator u = users.begin(); u != users.end(); ++u)
+	{
+		bool old = OldBanScan(chan, *u);
+		bool oldmute = OldExtBanScan(chan, *u, 'm');
+		if (chan->IsBanned(*u) != old || (chan->GetExtBanStatus(*u, 'm') == MOD_RES_DENY) != oldmute)
+		{
+			std::cout << "Mismatch for " << (*u)->GetFullRealHost() << " [" << (*u)->GetIPString() << "]\n";
+			passed = false;
+		}
+		banned += old;
+		muted += oldmute;
+	}
+	std::cout << banned << " banned, " << muted << " muted\n";
+
+	TestClock watch;
+	for (unsigned int r = 0; r < rounds; r++)
+		for (std::vector<LocalUser*>::iterator u = users.begin(); u != users.end(); ++u)
+			OldBanScan(chan, *u);
+	watch.Report("Linear scan", rounds);
+
+	for (unsigned int r = 0; r < rounds; r++)
+		for (std::vector<LocalUser*>::iterator u = users.begin(); u != users.end(); ++u)
+			chan->IsBanned(*u);
+	watch.Report("Ban index", rounds);
+
+	ServerInstance->chanlist->erase(chan->name);
+	ServerInstance->GlobalCulls.AddItem(chan);
+
+	return passed;
+}
+
+/* Stops at the first line which matches a user */
+struct TestLineMatcher
+{
+	User* user;
+	TestLineMatcher(User* u) : user(u) { }
+	bool operator()(XLine* line) { return line->Matches(user); }
+};
+
+bool TestSuite::DoXLineIndexTests()
+{
+	const unsigned int linecount = 40000;
+	const unsigned int usercount = 2000;
+	const unsigned int rounds = 5;
+
+	std::vector<XLine*> lines;
+	for (unsigned int i = 0; i < linecount; i++)
+	{
+		std::string n = ConvToStr(i % 256);
+		switch (i % 5)
+		{
+			case 0:
+				lines.push_back(new ZLine(0, 0, "bench", "bench", "10." + ConvToStr(i % 7) + "." + n + "." + ConvToStr(i % 13)));
+				break;
+			case 1:
+				lines.push_back(new ZLine(0, 0, "bench", "bench", "10." + ConvToStr(i % 7 + 100) + "." + n + ".0/24"));
+				break;
+			case 2:
+				lines.push_back(new ZLine(0, 0, "bench", "bench", "2001:db8:" + ConvToStr(i) + "::/48"));
+				break;
+			case 3:
+				lines.push_back(new GLine(0, 0, "bench", "bench", "*", "host" + ConvToStr(i) + ".Example.com"));
+				break;
+			case 4:
+				if (i % 400 == 4)
+					lines.push_back(new GLine(0, 0, "bench", "bench", "ident" + ConvToStr(i % 600), "*.isp" + ConvToStr(i % 600) + ".net"));
+				else
+					lines.push_back(new GLine(0, 0, "bench", "bench", "*", "10.200." + n + ".0/24"));
+				break;
+		}
+	}
+
+	XLineIndex zindex, gindex;
+	for (std::vector<XLine*>::iterator i = lines.begin(); i != lines.end(); ++i)
+		((*i)->type == "Z" ? zindex : gindex).Add(*i);
+
+	TestUsers fixture;
+	std::vector<LocalUser*>& users = fixture.users;
+	for (unsigned int i = 0; i < usercount; i++)
+	{
+		LocalUser* u = fixture.Add(i % 5 == 4 ? "2001:db8:" + ConvToStr(i * 7) + "::1"
+			: "10." + ConvToStr(i % 7 + (i % 2 ? 100 : 0)) + "." + ConvToStr(i % 256) + "." + ConvToStr(i % 13));
+		u->nick = "bench" + ConvToStr(i);
+		u->ident = "ident" + ConvToStr(i % 600);
+		u->host = (i % 3 ? "host" : "user") + ConvToStr(i * 3) + (i % 4 ? ".example.com" : ".isp" + ConvToStr(i % 600) + ".net");
+		if (i % 9 == 0)
+			u->host = "10.200." + ConvToStr(i % 256) + ".1";
+	}
+
+	std::cout << "\n\nChecking " << usercount << " users against " << linecount << " Z-lines and G-lines\n";
+
+	bool passed = true;
+	unsigned int zlined = 0, glined = 0;
+	for (std::vector<LocalUser*>::iterator u = users.begin(); u != users.end(); ++u)
+	{
+		bool oldz = false, oldg = false;
+		for (std::vector<XLine*>::iterator i = lines.begin(); i != lines.end(); ++i)
+		{
+			if ((*i)->Matches(*u))
+				((*i)->type == "Z" ? oldz : oldg) = true;
+		}
+		TestLineMatcher matcher(*u);
+		if (zindex.Walk(*u, matcher) != oldz || gindex.Walk(*u, matcher) != oldg)
+		{
+			std::cout << "Mismatch for " << (*u)->GetFullRealHost() << " [" << (*u)->GetIPString() << "]\n";
+			passed = false;
+		}
+		zlined += oldz;
+		glined += oldg;
+	}
+	std::cout << zlined << " Z-lined, " << glined << " G-lined\n";
+
+	TestClock watch;
+	for (unsigned int r = 0; r < rounds; r++)
+		for (std::vector<LocalUser*>::iterator u = users.begin(); u != users.end(); ++u)
+			for (std::vector<XLine*>::iterator i = lines.begin(); i != lines.end(); ++i)
+				if ((*i)->Matches(*u))
+					break;
+	watch.Report("Linear scan", rounds);
+
+	for (unsigned int r = 0; r < rounds; r++)
+	{
+		for (std::vector<LocalUser*>::iterator u = users.begin(); u != users.end(); ++u)
+		{
+			TestLineMatcher matcher(*u);
+			if (!zindex.Walk(*u, matcher))
+				gindex.Walk(*u, matcher);
+		}
+	}
+	watch.Report("XLineIndex", rounds);
+
+	for (std::vector<XLine*>::iterator i = lines.begin(); i != lines.end(); ++i)
+	{
+		((*i)->type == "Z" ? zindex : gindex).Remove(*i);
+		delete *i;
+	}
+
+	return passed;
+}
+
+/** Collects the ids found by a LiteralMatcher, as m_filter does */
+struct TestLiteralMarker
+{
+	std::vector<unsigned char>& found;
+	TestLiteralMarker(std::vector<unsigned char>& f) : found(f) { }
+	void operator()(unsigned int id) { found[id] = 1; }
+};
+
+#define LITERALTEST(x, y, z) std::cout << #x "(\"" << y << "\") == \"" << z << "\" " << ((passed = passed && (LiteralMatcher::x(y) == z)) ? "SUCCESS\n" : "FAILURE\n")
+
+bool TestSuite::DoLiteralMatchTests()
+{
+	const unsigned int filtercount = 2000;
+	const unsigned int messagecount = 5000;
+
+	bool passed = true;
+	std::cout << "\n\nLiteral extraction tests\n\n";
+	LITERALTEST(GlobLiteral, "*buy cheap * now*", "buy cheap ");
+	LITERALTEST(GlobLiteral, "*[spam]*", "spam");
+	LITERALTEST(RegexLiteral, "https?://spam\\.example\\.com", "://spam.example.com");
+	LITERALTEST(RegexLiteral, "free (money|cash) here", "free ");
+	LITERALTEST(RegexLiteral, "abc+d*e", "abc");
+	LITERALTEST(RegexLiteral, "spam|eggs", "");
+	LITERALTEST(RegexLiteral, "(?x) s p a m", "");
+	LITERALTEST(RegexLiteral, "abc\\x41 spam", " spam");
+
+	// Spam filters, each a pair of made up words, with a few too short to have a literal
+	std::vector<std::string> globs;
+	std::vector<bool> hasliteral;
+	LiteralMatcher prefilter;
+	for (unsigned int i = 0; i < filtercount; i++)
+	{
+		std::string glob = "*w" + ConvToStr(i * 7919 % 100003) + (i % 3 ? " w" : "*w") + ConvToStr(i) + "*";
+		if (i % 200 == 0)
+			glob = "*??????????????????????????????????????????????????????????????????????????????????????????*";
+		globs.push_back(glob);
+
+		std::string literal = LiteralMatcher::GlobLiteral(glob);
+		hasliteral.push_back(!literal.empty());
+		if (!literal.empty())
+			prefilter.Add(literal, i);
+	}
+	prefilter.Compile();
+
+	// Mostly chatter, with a message matching one of the filters now and then
+	std::vector<std::string> messages;
+	for (unsigned int i = 0; i < messagecount; i++)
+	{
+		std::string message = "hello everyone, message " + ConvToStr(i) + " is just some ordinary CHAT about w" + ConvToStr(i % 1000);
+		if (i % 50 == 0)
+		{
+			unsigned int f = i % filtercount;
+			message += " W" + ConvToStr(f * 7919 % 100003) + " W" + ConvToStr(f);
+		}
+		if (i % 1000 == 999)
+			message.append(60, '!');
+		messages.push_back(message);
+	}
+
+	std::cout << "\nMatching " << messagecount << " messages against " << filtercount << " filters\n";
+
+	std::vector<unsigned char> found(filtercount);
+	unsigned int matched = 0;
+	for (std::vector<std::string>::iterator m = messages.begin(); m != messages.end(); ++m)
+	{
+		unsigned int oldmatch = filtercount, newmatch = filtercount;
+		for (unsigned int i = 0; i < filtercount && oldmatch == filtercount; i++)
+			if (InspIRCd::Match(*m, globs[i]))
+				oldmatch = i;
+
+		std::fill(found.begin(), found.end(), 0);
+		TestLiteralMarker marker(found);
+		prefilter.Scan(*m, marker);
+		for (unsigned int i = 0; i < filtercount && newmatch == filtercount; i++)
+			if ((found[i] || !hasliteral[i]) && InspIRCd::Match(*m, globs[i]))
+				newmatch = i;
+
+		if (oldmatch != newmatch)
+		{
+			std::cout << "Mismatch for \"" << *m << "\": " << oldmatch << " != " << newmatch << "\n";
+			passed = false;
+		}
+		matched += (oldmatch != filtercount);
+	}
+	std::cout << matched << " messages filtered\n";
+
+	TestClock watch;
+	for (std::vector<std::string>::iterator m = messages.begin(); m != messages.end(); ++m)
+		for (unsigned int i = 0; i < filtercount; i++)
+			if (InspIRCd::Match(*m, globs[i]))
+				break;
+	watch.Report("Every filter");
+
+	for (std::vector<std::string>::iterator m = messages.begin(); m != messages.end(); ++m)
+	{
+		std::fill(found.begin(), found.end(), 0);
+		TestLiteralMarker marker(found);
+		prefilter.Scan(*m, marker);
+		for (unsigned int i = 0; i < filtercount; i++)
+			if ((found[i] || !hasliteral[i]) && InspIRCd::Match(*m, globs[i]))
+				break;
+	}
+	watch.Report("Prefiltered");
+
+	return passed;
+}
+
+bool TestSuite::DoUIDTableTests()
+{
+	const unsigned int idcount = 500000;
+	const unsigned int rounds = 10;
+
+	// UUIDs spread over a few dozen servers, as a hub would see them
+	std::vector<std::string> ids;
+	ids.reserve(idcount);
+	for (unsigned int i = 0; i < idcount; i++)
+	{
+		std::string id = ConvToStr(i % 40 / 10) + (char)('A' + i % 10) + (char)('A' + i % 4);
+		for (unsigned int n = i / 40, c = 0; c < 6; c++, n /= 36)
+			id.push_back(n % 36 < 26 ? 'A' + n % 36 : '0' + n % 36 - 26);
+		ids.push_back(id);
+	}
+
+	std::cout << "\n\nLooking up " << idcount << " UUIDs\n";
+
+	UIDTable<std::string> table;
+	nspace::hash_map<std::string, std::string*, nspace::insensitive, irc::StrHashComp> oldtable;
+	bool passed = true;
+	for (std::vector<std::string>::iterator i = ids.begin(); i != ids.end(); ++i)
+	{
+		oldtable[*i] = &*i;
+		if (!table.insert(*i, &*i))
+		{
+			std::cout << "Could not insert " << *i << "\n";
+			passed = false;
+		}
+	}
+	if (passed && table.insert(ids[0], &ids[0]))
+	{
+		std::cout << "Inserted a duplicate UUID\n";
+		passed = false;
+	}
+
+	std::string lower(ids[idcount / 2]);
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	if (table.find(lower) != &ids[idcount / 2] || table.find("0AA\xe9") || table.find("0AAAAAAAAA") || table.find(""))
+	{
+		std::cout << "Wrong result for case folded or invalid UUIDs\n";
+		passed = false;
+	}
+
+	TestClock watch;
+	unsigned long found = 0;
+	for (unsigned int r = 0; r < rounds; r++)
+		for (std::vector<std::string>::iterator i = ids.begin(); i != ids.end(); ++i)
+			found += (oldtable.find(*i) != oldtable.end());
+	watch.Report("String hash", rounds);
+
+	for (unsigned int r = 0; r < rounds; r++)
+		for (std::vector<std::string>::iterator i = ids.begin(); i != ids.end(); ++i)
+			found -= (table.find(*i) == &*i);
+	watch.Report("UIDTable", rounds);
+
+	if (found)
+	{
+		std::cout << "Lookups disagree\n";
+		passed = false;
+	}
+
+	// Split off most of the network, then check what is left is still there
+	for (unsigned int i = 0; i < idcount; i++)
+		if (i % 40 >= 4)
+			table.erase(ids[i]);
+	for (unsigned int i = 0; i < idcount; i++)
+	{
+		if (table.find(ids[i]) != (i % 40 < 4 ? &ids[i] : NULL))
+		{
+			std::cout << "Wrong result for " << ids[i] << " after erasing\n";
+			passed = false;
+			break;
+		}
+	}
+	if (table.size() != idcount / 10)
+	{
+		std::cout << table.size() << " UUIDs left, expected " << (idcount / 10) << "\n";
+		passed = false;
+	}
+
+	return passed;
+}
@@ -26,54 +26,195 @@
 #include "timer.h"
 
 TimerManager::TimerManager()
+	: nexttick(ServerInstance->Time()), count(0)
 {
+	for (unsigned int i = 0; i < ROOT_SIZE; i++)
+		root[i] = NULL;
+	for (unsigned int l = 0; l < LEVELS; l++)
+		for (unsigned int i = 0; i < LEVEL_SIZE; i++)
+			levels[l][i] = NULL;
 }
 
 TimerManager::~TimerManager()
 {
-	for(std::vector<Timer *>::iterator i = Timers.begin(); i != Timers.end(); i++)
-		delete *i;
+	for (unsigned int i = 0; i < ROOT_SIZE; i++)
+	{
+		while (root[i])
+		{
+			Timer* t = root[i];
+			Unlink(t);
+			delete t;
+		}
+	}
+	for (unsigned int l = 0; l < LEVELS; l++)
+	{
+		for (unsigned int i = 0; i < LEVEL_SIZE; i++)
+		{
+			while (levels[l][i])
+			{
+				Timer* t = levels[l][i];
+				Unlink(t);
+				delete t;
+			}
+		}
+	}
 }
 
-void TimerManager::TickTimers(time_t TIME)
+void TimerManager::Schedule(Timer* T)
 {
-	while ((Timers.size()) && (TIME > (*Timers.begin())->GetTimer()))
+	// Anything already overdue goes into the slot for the next tick
+	time_t when = std::max(T->GetTimer(), nexttick);
+	time_t delta = when - nexttick;
+	Timer** slot;
+
+	if (delta < (time_t)ROOT_SIZE)
+	{
+		slot = &root[when & (ROOT_SIZE - 1)];
+	}
+	else
 	{
-		std::vector<Timer *>::iterator i = Timers.begin();
-		Timer *t = (*i);
+		unsigned int level = 0;
+		while (level < LEVELS - 1 && delta >= ((time_t)1 << (ROOT_BITS + (level + 1) * LEVEL_BITS)))
+			level++;
 
-		// Probable fix: move vector manipulation to *before* we modify the vector.
-		Timers.erase(i);
+		// The top level wraps after 2^32 seconds, anything more than 2^30 seconds
+		// (about 34 years) away is treated as being due then
+		const time_t maxdelta = (time_t)1 << (ROOT_BITS + LEVELS * LEVEL_BITS - 2);
+		if (delta > maxdelta)
+			when = nexttick + maxdelta;
+
+		slot = &levels[level][(when >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1)];
+	}
+
+	T->wheelnext = *slot;
+	if (T->wheelnext)
+		T->wheelnext->wheelprev = &T->wheelnext;
+	T->wheelprev = slot;
+	*slot = T;
+	count++;
+}
+
+void TimerManager::Unlink(Timer* T)
+{
+	*T->wheelprev = T->wheelnext;
+	if (T->wheelnext)
+		T->wheelnext->wheelprev = T->wheelprev;
+	T->wheelnext = NULL;
+	T->wheelprev = NULL;
+	count--;
+}
+
+unsigned int TimerManager::Cascade(unsigned int level)
+{
+	unsigned int index = (nexttick >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+
+	Timer* list = levels[level][index];
+	levels[level][index] = NULL;
+	while (list)
+	{
+		Timer* t = list;
+		list = t->wheelnext;
+		count--;
+		Schedule(t);
+	}
+	return index;
+}
 
-		t->Tick(TIME);
-		if (t->GetRepeat())
+void TimerManager::Rebase(time_t TIME)
+{
+	Timer* all = NULL;
+	for (unsigned int i = 0; i < ROOT_SIZE; i++)
+	{
+		while (root[i])
 		{
-			t->SetTimer(TIME + t->GetSecs());
-			AddTimer(t);
+			Timer* t = root[i];
+			Unlink(t);
+			t->wheelnext = all;
+			all = t;
 		}
-		else
-			delete t;
+	}
+	for (unsigned int l = 0; l < LEVELS; l++)
+	{
+		for (unsigned int i = 0; i < LEVEL_SIZE; i++)
+		{
+			while (levels[l][i])
+			{
+				Timer* t = levels[l][i];
+				Unlink(t);
+				t->wheelnext = all;
+				all = t;
+			}
+		}
+	}
+
+	// Start from the second before TIME so that anything overdue fires on this tick
+	nexttick = TIME - 1;
+	while (all)
+	{
+		Timer* t = all;
+		all = t->wheelnext;
+		Schedule(t);
 	}
 }
 
-void TimerManager::DelTimer(Timer* T)
+void TimerManager::TickTimers(time_t TIME)
 {
-	std::vector<Timer *>::iterator i = std::find(Timers.begin(), Timers.end(), T);
+	// The slots are only valid relative to nexttick. If the clock went backwards, timers added
+	// since would be clamped to the old time, and if it jumped forwards by more than the first
+	// level covers, walking every skipped second would take a while. Sort everything out again.
+	if (TIME < nexttick || TIME - nexttick > (time_t)ROOT_SIZE)
+		Rebase(TIME);
 
-	if (i != Timers.end())
+	while (nexttick < TIME)
 	{
-		delete (*i);
-		Timers.erase(i);
+		unsigned int index = nexttick & (ROOT_SIZE - 1);
+
+		// When the first level wraps, refill it from the next level up, and so on
+		if (!index)
+		{
+			for (unsigned int level = 0; level < LEVELS; level++)
+				if (Cascade(level))
+					break;
+		}
+
+		// Take the whole slot so that timers added by Tick() go into a later one.
+		// Unlink() still works on this list, so a Tick() may delete any of these timers.
+		Timer* pending = root[index];
+		root[index] = NULL;
+		if (pending)
+			pending->wheelprev = &pending;
+		nexttick++;
+
+		while (pending)
+		{
+			Timer* t = pending;
+			Unlink(t);
+
+			t->Tick(TIME);
+			if (t->GetRepeat())
+			{
+				t->SetTimer(TIME + t->GetSecs());
+				AddTimer(t);
+			}
+			else
+				delete t;
+		}
 	}
 }
 
-void TimerManager::AddTimer(Timer* T)
+void TimerManager::DelTimer(Timer* T)
 {
-	Timers.push_back(T);
-	std::sort(Timers.begin(), Timers.end(), TimerManager::TimerComparison);
+	// Not scheduled, e.g. deleting itself from its own Tick()
+	if (!T->wheelprev)
+		return;
+
+	Unlink(T);
+	delete T;
 }
 
-bool TimerManager::TimerComparison( Timer *one, Timer *two)
+void TimerManager::AddTimer(Timer* T)
 {
-	return (one->GetTimer()) < (two->GetTimer());
+	if (T->wheelprev)
+		Unlink(T);
+	Schedule(T);
 }
@@ -81,6 +81,9 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	New->localuseriter = this->local_users.insert(local_users.end(), New);
 	local_count++;
 
+	New->deadline = new UserDeadlineTimer(New);
+	ServerInstance->Timers->AddTimer(New->deadline);
+
 	if ((this->local_users.size() > ServerInstance->Config->SoftLimit) || (this->local_users.size() >= (unsigned int)ServerInstance->SE->GetMaxFds()))
 	{
 		ServerInstance->SNO->WriteToSnoMask('a', "Warning: softlimit value has been reached: %d clients", ServerInstance->Config->SoftLimit);
@@ -109,7 +112,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	 */
 	New->exempt = (ServerInstance->XLines->MatchesLine("E",New) != NULL);
 
-	if (BanCacheHit *b = ServerInstance->BanCache->GetHit(New->GetIPString()))
+	if (BanCacheHit *b = ServerInstance->BanCache->GetHit(New->client_sa))
 	{
 		if (!b->Type.empty() && !New->exempt)
 		{
@@ -175,6 +178,75 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 }
 
 void UserManager::QuitUser(User *user, const std::string &quitreason, const char* operreason)
+{
+	DoQuitUser(user, quitreason, operreason, true);
+}
+
+void UserManager::QuitUsers(const std::vector<User*>& users, const std::string &quitreason, const char* operreason)
+{
+	if (!ServerInstance->Modules->EventHandlers[I_OnBuildNeighborList].empty())
+	{
+		/* Modules may change who sees each quit, so leave it to WriteCommonQuit to ask them */
+		for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+			QuitUser(*i, quitreason, operreason);
+		return;
+	}
+
+	std::string reason(quitreason, 0, ServerInstance->Config->Limits.MaxQuit);
+	std::string oper_reason((operreason && *operreason) ? std::string(operreason, 0, ServerInstance->Config->Limits.MaxQuit) : quitreason);
+
+	/* Build each QUIT once, and note which channels it needs to go to */
+	std::vector<std::pair<reference<SendQBuffer>, reference<SendQBuffer> > > lines(users.size());
+	std::map<Channel*, std::vector<size_t> > chans;
+	for (size_t i = 0; i < users.size(); i++)
+	{
+		User* user = users[i];
+		if (user->quitting || IS_SERVER(user) || user->registered != REG_ALL)
+			continue;
+
+		lines[i].first = LocalUser::PrepareLine(":" + user->GetFullHost() + " QUIT :" + reason);
+		if (oper_reason == reason)
+			lines[i].second = lines[i].first;
+		else
+			lines[i].second = LocalUser::PrepareLine(":" + user->GetFullHost() + " QUIT :" + oper_reason);
+		for (UCListIter c = user->chans.begin(); c != user->chans.end(); ++c)
+			chans[*c].push_back(i);
+	}
+
+	/* Then go over the local members of each channel once, rather than over every channel of every quitting user.
+	 * Each member is looked up once per channel in the set of quits they have been sent, so that someone
+	 * sharing several channels with a quitting user only sees them quit once.
+	 */
+	std::map<LocalUser*, std::vector<bool> > sent;
+	for (std::map<Channel*, std::vector<size_t> >::const_iterator c = chans.begin(); c != chans.end(); ++c)
+	{
+		const LocalMembList& members = c->first->GetLocalMembers();
+		for (LocalMembList::const_iterator m = members.begin(); m != members.end(); ++m)
+		{
+			LocalUser* u = static_cast<LocalUser*>((*m)->user);
+			if (u->quitting)
+				continue;
+
+			std::vector<bool>& seen = sent[u];
+			if (seen.empty())
+				seen.resize(users.size());
+
+			for (std::vector<size_t>::const_iterator q = c->second.begin(); q != c->second.end(); ++q)
+			{
+				if (!seen[*q] && users[*q] != u)
+				{
+					seen[*q] = true;
+					u->Write(IS_OPER(u) ? lines[*q].second : lines[*q].first);
+				}
+			}
+		}
+	}
+
+	for (std::vector<User*>::const_iterator i = users.begin(); i != users.end(); ++i)
+		DoQuitUser(*i, quitreason, operreason, false);
+}
+
+void UserManager::DoQuitUser(User *user, const std::string &quitreason, const char* operreason, bool notify)
 {
 	if (user->quitting)
 	{
@@ -206,7 +278,8 @@ void UserManager::QuitUser(User *user, const std::string &quitreason, const char
 	if (user->registered == REG_ALL)
 	{
 		FOREACH_MOD(I_OnUserQuit,OnUserQuit(user, reason, oper_reason));
-		user->WriteCommonQuit(reason, oper_reason);
+		if (notify)
+			user->WriteCommonQuit(reason, oper_reason);
 	}
 
 	if (user->registered != REG_ALL)
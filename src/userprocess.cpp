@@ -46,81 +46,74 @@ void FloodQuitUserHandler::Call(User* current)
 	}
 }
 
-/**
- * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the user structs, e.g.
- * stuff like ping checks, registration timeouts, etc.
- */
-void InspIRCd::DoBackgroundUserStuff()
+UserDeadlineTimer::UserDeadlineTimer(LocalUser* u)
+	: Timer(1, ServerInstance->Time(), true), user(u), resume(false)
 {
-	/*
-	 * loop over all local users..
-	 */
-	LocalUserList::reverse_iterator count2 = this->Users->local_users.rbegin();
-	while (count2 != this->Users->local_users.rend())
-	{
-		LocalUser *curr = *count2;
-		count2++;
+}
 
-		if (curr->quitting)
-			continue;
+time_t UserDeadlineTimer::GetTimer()
+{
+	if (resume || user->registered != REG_ALL)
+		return ServerInstance->Time();
+	return user->nping;
+}
 
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
+void UserDeadlineTimer::Tick(time_t TIME)
+{
+	if (user->quitting)
+		return;
 
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				if (Time() > curr->nping)
-				{
-					// This user didn't answer the last ping, remove them
-					if (!curr->lastping)
-					{
-						time_t time = this->Time() - (curr->nping - curr->MyClass->GetPingTime());
-						char message[MAXBUF];
-						snprintf(message, MAXBUF, "Ping timeout: %ld second%s", (long)time, time > 1 ? "s" : "");
-						curr->lastping = 1;
-						curr->nping = Time() + curr->MyClass->GetPingTime();
-						this->Users->QuitUser(curr, message);
-						continue;
-					}
+	if (resume)
+	{
+		resume = false;
+		user->eh.OnDataReady();
+		if (user->quitting)
+			return;
+	}
 
-					curr->Write("PING :%s",this->Config->ServerName.c_str());
-					curr->lastping = 0;
-					curr->nping = Time()  +curr->MyClass->GetPingTime();
-				}
-				break;
-			case REG_NICKUSER:
-				if (AllModulesReportReady(curr) && curr->dns_done)
+	switch (user->registered)
+	{
+		case REG_ALL:
+			if (TIME > user->nping)
+			{
+				// This user didn't answer the last ping, remove them
+				if (!user->lastping)
 				{
-					/* User has sent NICK/USER, modules are okay, DNS finished. */
-					curr->FullConnect();
-					continue;
+					time_t time = TIME - (user->nping - user->MyClass->GetPingTime());
+					char message[MAXBUF];
+					snprintf(message, MAXBUF, "Ping timeout: %ld second%s", (long)time, time > 1 ? "s" : "");
+					user->lastping = 1;
+					user->nping = TIME + user->MyClass->GetPingTime();
+					ServerInstance->Users->QuitUser(user, message);
+					return;
 				}
 
-				// If the user has been quit in OnCheckReady then we shouldn't
-				// quit them again for having a registration timeout.
-				if (curr->quitting)
-					continue;
-				break;
-		}
+				user->Write("PING :%s",ServerInstance->Config->ServerName.c_str());
+				user->lastping = 0;
+				user->nping = TIME + user->MyClass->GetPingTime();
+			}
+			break;
+		case REG_NICKUSER:
+			if (ServerInstance->AllModulesReportReady(user) && user->dns_done)
+			{
+				/* User has sent NICK/USER, modules are okay, DNS finished. */
+				user->FullConnect();
+				return;
+			}
 
-		if (curr->registered != REG_ALL && curr->MyClass && (Time() > (curr->signon + curr->MyClass->GetRegTimeout())))
-		{
-			/*
-			 * registration timeout -- didnt send USER/NICK/HOST
-			 * in the time specified in their connection class.
-			 */
-			this->Users->QuitUser(curr, "Registration timeout");
-			continue;
-		}
+			// If the user has been quit in OnCheckReady then we shouldn't
+			// quit them again for having a registration timeout.
+			if (user->quitting)
+				return;
+			break;
 	}
-}
 
+	if (user->registered != REG_ALL && user->MyClass && (TIME > (user->signon + user->MyClass->GetRegTimeout())))
+	{
+		/*
+		 * registration timeout -- didnt send USER/NICK/HOST
+		 * in the time specified in their connection class.
+		 */
+		ServerInstance->Users->QuitUser(user, "Registration timeout");
+	}
+}
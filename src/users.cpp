@@ -207,21 +207,19 @@ User::User(const std::string &uid, const std::string& sid, int type)
 	quietquit = quitting = exempt = dns_done = false;
 	quitting_sendq = false;
 	client_sa.sa.sa_family = AF_UNSPEC;
+	banversion = 0;
 
 	ServerInstance->Logs->Log("USERS", DEBUG, "New UUID for user: %s", uuid.c_str());
 
-	user_hash::iterator finduuid = ServerInstance->Users->uuidlist->find(uuid);
-	if (finduuid == ServerInstance->Users->uuidlist->end())
-		(*ServerInstance->Users->uuidlist)[uuid] = this;
-	else
-		throw CoreException("Duplicate UUID "+std::string(uuid)+" in User constructor");
+	if (!ServerInstance->Users->uuidlist->insert(uuid, this))
+		throw CoreException("Duplicate or invalid UUID "+std::string(uuid)+" in User constructor");
 }
 
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
 	: User(ServerInstance->GetUID(), ServerInstance->Config->ServerName, USERTYPE_LOCAL), eh(this),
 	localuseriter(ServerInstance->Users->local_users.end()),
-	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
-	already_sent(0)
+	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), deadline(NULL), CommandFloodPenalty(0),
+	lastdecay(ServerInstance->Time()), already_sent(0)
 {
 	ident = "unknown";
 	lastping = 0;
@@ -233,7 +231,7 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 
 User::~User()
 {
-	if (ServerInstance->Users->uuidlist->find(uuid) != ServerInstance->Users->uuidlist->end())
+	if (ServerInstance->Users->uuidlist->find(uuid) == this)
 		ServerInstance->Logs->Log("USERS", DEFAULT, "User destructor for %s called without cull", uuid.c_str());
 }
 
@@ -409,12 +407,24 @@ bool LocalUser::HasPermission(const std::string &command)
 		return false;
 	}
 
-	if (oper->AllowedOperCommands.find(command) != oper->AllowedOperCommands.end())
-		return true;
-	else if (oper->AllowedOperCommands.find("*") != oper->AllowedOperCommands.end())
-		return true;
+	unsigned int id;
+	if (PermissionRegistry::FindId(PermissionRegistry::COMMAND, command, id))
+		return oper->HasCommand(id);
 
-	return false;
+	return oper->AllCommands;
+}
+
+bool User::HasPermission(const Command*)
+{
+	return true;
+}
+
+bool LocalUser::HasPermission(const Command* command)
+{
+	if (!IS_OPER(this))
+		return false;
+
+	return oper->HasCommand(command->permid);
 }
 
 bool User::HasPrivPermission(const std::string &privstr, bool noisy)
@@ -431,26 +441,48 @@ bool LocalUser::HasPrivPermission(const std::string &privstr, bool noisy)
 		return false;
 	}
 
-	if (oper->AllowedPrivs.find(privstr) != oper->AllowedPrivs.end())
-	{
+	// A privilege nobody has registered can only be granted by "*"
+	unsigned int id;
+	if (PermissionRegistry::FindId(PermissionRegistry::PRIV, privstr, id) ? oper->HasPriv(id) : oper->AllPrivs)
 		return true;
-	}
-	else if (oper->AllowedPrivs.find("*") != oper->AllowedPrivs.end())
+
+	if (noisy)
+		this->WriteServ("NOTICE %s :Oper type %s does not have access to priv %s", this->nick.c_str(), oper->NameStr(), privstr.c_str());
+	return false;
+}
+
+bool User::HasPrivPermission(const Privilege&, bool)
+{
+	return true;
+}
+
+bool LocalUser::HasPrivPermission(const Privilege& priv, bool noisy)
+{
+	if (!IS_OPER(this))
 	{
-		return true;
+		if (noisy)
+			this->WriteServ("NOTICE %s :You are not an oper", this->nick.c_str());
+		return false;
 	}
 
+	if (oper->HasPriv(priv.id))
+		return true;
+
 	if (noisy)
-		this->WriteServ("NOTICE %s :Oper type %s does not have access to priv %s", this->nick.c_str(), oper->NameStr(), privstr.c_str());
+		this->WriteServ("NOTICE %s :Oper type %s does not have access to priv %s", this->nick.c_str(), oper->NameStr(), priv.name.c_str());
 	return false;
 }
 
+static Privilege privincreasedbuffers("users/flood/increased-buffers");
+static Privilege privnofakelag("users/flood/no-fakelag");
+
 void UserIOHandler::OnDataReady()
 {
 	if (user->quitting)
 		return;
 
-	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
+	bool increasedbuffers = user->HasPrivPermission(privincreasedbuffers);
+	if (recvq.length() > user->MyClass->GetRecvqMax() && !increasedbuffers)
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
 		ServerInstance->SNO->WriteToSnoMask('a', "User %s RecvQ of %lu exceeds connect class maximum of %lu",
@@ -458,58 +490,108 @@ void UserIOHandler::OnDataReady()
 		return;
 	}
 	unsigned long sendqmax = ULONG_MAX;
-	if (!user->HasPrivPermission("users/flood/increased-buffers"))
+	if (!increasedbuffers)
 		sendqmax = user->MyClass->GetSendqSoftMax();
 	unsigned long penaltymax = ULONG_MAX;
-	if (!user->HasPrivPermission("users/flood/no-fakelag"))
+	if (!user->HasPrivPermission(privnofakelag))
 		penaltymax = user->MyClass->GetPenaltyThreshold() * 1000;
 
+	// The penalty drains by the command rate every second, catch up on
+	// however much has drained since it was last looked at
+	time_t now = ServerInstance->Time();
+	if (user->CommandFloodPenalty && now > user->lastdecay)
+	{
+		unsigned long rate = user->MyClass->GetCommandRate();
+		unsigned long elapsed = now - user->lastdecay;
+		if (elapsed <= user->CommandFloodPenalty / rate)
+			user->CommandFloodPenalty -= rate * elapsed;
+		else
+			user->CommandFloodPenalty = 0;
+	}
+	user->lastdecay = now;
+
+	// Lines are split out by offset and the processed ones are removed from
+	// the front of the recvq in one go, rather than copying what is left of
+	// the recvq after every line
+	std::string line;
+	line.reserve(MAXBUF);
+	std::string::size_type qpos = 0;
+	bool held = true;
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
-		std::string line;
-		line.reserve(MAXBUF);
-		std::string::size_type qpos = 0;
-		while (qpos < recvq.length())
+		std::string::size_type linestart = qpos;
+		if (!SplitLine(recvq, qpos, line))
 		{
-			char c = recvq[qpos++];
-			switch (c)
-			{
-			case '\0':
-				c = ' ';
-				break;
-			case '\r':
-				continue;
-			case '\n':
-				goto eol_found;
-			}
-			if (line.length() < MAXBUF - 2)
-				line.push_back(c);
+			// the recvq ran out before we found a newline
+			held = false;
+			break;
 		}
-		// if we got here, the recvq ran out before we found a newline
-		return;
-eol_found:
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq = recvq.substr(qpos);
 
 		// TODO should this be moved to when it was inserted in recvq?
-		ServerInstance->stats->statsRecv += qpos;
-		user->bytes_in += qpos;
+		ServerInstance->stats->statsRecv += qpos - linestart;
+		user->bytes_in += qpos - linestart;
 		user->cmds_in++;
 
 		ServerInstance->Parser->ProcessBuffer(line, user);
 		if (user->quitting)
-			return;
+			break;
 	}
+	recvq.erase(0, qpos);
+
+	if (!held || user->quitting)
+		return;
+
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+	else if (user->deadline)
+	{
+		// Commands are being held back, try again in a second
+		user->deadline->resume = true;
+		ServerInstance->Timers->AddTimer(user->deadline);
+	}
+}
+
+bool UserIOHandler::SplitLine(const std::string& buffer, std::string::size_type& pos, std::string& line)
+{
+	const char* start = buffer.data() + pos;
+	const char* eol = static_cast<const char*>(memchr(start, '\n', buffer.length() - pos));
+	if (!eol)
+		return false;
+
+	size_t len = eol - start;
+	pos += len + 1;
+
+	// Almost every line is either LF or CRLF terminated with no other CR or NUL
+	// in it, and can be copied in one go
+	if (len && start[len - 1] == '\r')
+		len--;
+	if (!memchr(start, '\r', len) && !memchr(start, '\0', len))
+	{
+		line.assign(start, std::min<size_t>(len, MAXBUF - 2));
+		return true;
+	}
+
+	line.clear();
+	for (const char* c = start; c != start + len && line.length() < MAXBUF - 2; ++c)
+	{
+		if (*c == '\r')
+			continue;
+		line.push_back(*c ? *c : ' ');
+	}
+	return true;
 }
 
 void UserIOHandler::AddWriteBuf(const std::string &data)
+{
+	AddWriteBuf(reference<SendQBuffer>(new SendQBuffer(data)));
+}
+
+void UserIOHandler::AddWriteBuf(const reference<SendQBuffer>& data)
 {
 	if (user->quitting_sendq)
 		return;
-	if (!user->quitting && getSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
-		!user->HasPrivPermission("users/flood/increased-buffers"))
+	if (!user->quitting && getSendQSize() + data->data.length() > user->MyClass->GetSendqHardMax() &&
+		!user->HasPrivPermission(privincreasedbuffers))
 	{
 		user->quitting_sendq = true;
 		ServerInstance->GlobalCulls.AddSQItem(user);
@@ -552,6 +634,12 @@ CullResult LocalUser::cull()
 	else
 		ServerInstance->Logs->Log("USERS", DEFAULT, "ERROR: LocalUserIter does not point to a valid entry for " + this->nick);
 
+	if (deadline)
+	{
+		ServerInstance->Timers->DelTimer(deadline);
+		deadline = NULL;
+	}
+
 	ClearInvites();
 	eh.cull();
 	return User::cull();
@@ -572,6 +660,7 @@ void User::Oper(OperInfo* info)
 		this->UnOper();
 
 	this->modes[UM_OPERATOR] = 1;
+	InvalidateBanCache();
 	this->oper = info;
 	this->WriteServ("MODE %s :+o", this->nick.c_str());
 	FOREACH_MOD(I_OnOper, OnOper(this, info->name));
@@ -605,6 +694,54 @@ void User::Oper(OperInfo* info)
 	FOREACH_MOD(I_OnPostOper,OnPostOper(this, oper->name, opername));
 }
 
+typedef nspace::hash_map<std::string, unsigned int, nspace::hash<std::string> > PermissionIdMap;
+
+static PermissionIdMap& GetPermissionIds(PermissionRegistry::Type type)
+{
+	// Privileges can be registered during static initialisation, so the maps
+	// are created on first use
+	static PermissionIdMap privs;
+	static PermissionIdMap commands;
+	return type == PermissionRegistry::PRIV ? privs : commands;
+}
+
+unsigned int PermissionRegistry::GetId(Type type, const std::string& name)
+{
+	PermissionIdMap& ids = GetPermissionIds(type);
+	PermissionIdMap::iterator i = ids.find(name);
+	if (i != ids.end())
+		return i->second;
+
+	unsigned int id = ids.size();
+	ids.insert(std::make_pair(name, id));
+	return id;
+}
+
+bool PermissionRegistry::FindId(Type type, const std::string& name, unsigned int& id)
+{
+	PermissionIdMap& ids = GetPermissionIds(type);
+	PermissionIdMap::iterator i = ids.find(name);
+	if (i == ids.end())
+		return false;
+
+	id = i->second;
+	return true;
+}
+
+/** Set the bits for a list of names from a \<class> block */
+static void SetPermissionBits(PermissionRegistry::Type type, const std::set<std::string>& names, std::vector<bool>& bits, bool& all)
+{
+	all = (names.find("*") != names.end());
+	bits.clear();
+	for (std::set<std::string>::const_iterator i = names.begin(); i != names.end(); ++i)
+	{
+		unsigned int id = PermissionRegistry::GetId(type, *i);
+		if (id >= bits.size())
+			bits.resize(id + 1);
+		bits[id] = true;
+	}
+}
+
 void OperInfo::init()
 {
 	AllowedOperCommands.clear();
@@ -656,6 +793,9 @@ void OperInfo::init()
 			}
 		}
 	}
+
+	SetPermissionBits(PermissionRegistry::COMMAND, AllowedOperCommands, CommandBits, AllCommands);
+	SetPermissionBits(PermissionRegistry::PRIV, AllowedPrivs, PrivBits, AllPrivs);
 }
 
 void User::UnOper()
@@ -663,6 +803,8 @@ void User::UnOper()
 	if (!IS_OPER(this))
 		return;
 
+	InvalidateBanCache();
+
 	/*
 	 * unset their oper type (what IS_OPER checks).
 	 * note, order is important - this must come before modes as -o attempts
@@ -830,7 +972,7 @@ void LocalUser::FullConnect()
 	ServerInstance->SNO->WriteToSnoMask('c',"Client connecting on port %d (class %s): %s (%s) [%s]",
 		this->GetServerPort(), this->MyClass->name.c_str(), GetFullRealHost().c_str(), this->GetIPString(), this->fullname.c_str());
 	ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCache: Adding NEGATIVE hit for %s", this->GetIPString());
-	ServerInstance->BanCache->AddHit(this->GetIPString(), "", "");
+	ServerInstance->BanCache->AddHit(this->client_sa, "", "");
 	// reset the flood penalty (which could have been raised due to things like auto +x)
 	CommandFloodPenalty = 0;
 }
@@ -843,6 +985,7 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	InvalidateBanCache();
 }
 
 bool User::ChangeNick(const std::string& newnick, bool force)
@@ -1051,24 +1194,33 @@ void LocalUser::Write(const std::string& text)
 	if (!ServerInstance->SE->BoundsCheckFd(&eh))
 		return;
 
-	if (text.length() > MAXBUF - 2)
-	{
-		// this should happen rarely or never. Crop the string at 512 and try again.
-		std::string try_again = text.substr(0, MAXBUF - 2);
-		Write(try_again);
+	this->Write(reference<SendQBuffer>(PrepareLine(text)));
+}
+
+void LocalUser::Write(const reference<SendQBuffer>& line)
+{
+	if (!ServerInstance->SE->BoundsCheckFd(&eh))
 		return;
-	}
 
-	ServerInstance->Logs->Log("USEROUTPUT", RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
+	const std::string& data = line->data;
+	if (ServerInstance->Config->RawLog)
+		ServerInstance->Logs->Log("USEROUTPUT", RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)data.length() - 2, data.c_str());
 
-	eh.AddWriteBuf(text);
-	eh.AddWriteBuf(wide_newline);
+	eh.AddWriteBuf(line);
 
-	ServerInstance->stats->statsSent += text.length() + 2;
-	this->bytes_out += text.length() + 2;
+	ServerInstance->stats->statsSent += data.length();
+	this->bytes_out += data.length();
 	this->cmds_out++;
 }
 
+SendQBuffer* LocalUser::PrepareLine(const std::string& text)
+{
+	// this should happen rarely or never. Crop the string at 512.
+	std::string line(text, 0, MAXBUF - 2);
+	line.append(wide_newline);
+	return new SendQBuffer(line);
+}
+
 /** Write()
  */
 void LocalUser::Write(const char *text, ...)
@@ -1208,44 +1360,87 @@ void User::WriteCommonExcept(const char* text, ...)
 	this->WriteCommonRaw(std::string(textbuffer), false);
 }
 
-void User::WriteCommonRaw(const std::string &line, bool include_self)
+NeighborIterator::NeighborIterator(User* user, bool include_self)
+	: source(user), chans(&user->chans), first(NULL), membidx(0)
 {
-	if (this->registered != REG_ALL || quitting)
-		return;
-
-	LocalUser::already_sent_id++;
+	silent_id = ++LocalUser::already_sent_id;
+	seen_id = ++LocalUser::already_sent_id;
 
-	UserChanList include_c(chans);
-	std::map<User*,bool> exceptions;
+	if (!ServerInstance->Modules->EventHandlers[I_OnBuildNeighborList].empty())
+	{
+		include_c = user->chans;
+		exceptions[user] = include_self;
+		FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(user, include_c, exceptions));
+		chans = &include_c;
+	}
+	else
+	{
+		LocalUser* u = IS_LOCAL(user);
+		if (u && !u->quitting)
+		{
+			u->already_sent = include_self ? seen_id : silent_id;
+			if (include_self)
+				first = u;
+		}
+	}
 
-	exceptions[this] = include_self;
+	excit = exceptions.begin();
+	chanit = chans->begin();
+}
 
-	FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(this, include_c, exceptions));
+LocalUser* NeighborIterator::Next()
+{
+	if (first)
+	{
+		LocalUser* u = first;
+		first = NULL;
+		return u;
+	}
 
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	/* Users added or hidden by modules come first */
+	while (excit != exceptions.end())
 	{
-		LocalUser* u = IS_LOCAL(i->first);
+		LocalUser* u = IS_LOCAL(excit->first);
+		bool include = excit->second;
+		++excit;
 		if (u && !u->quitting)
 		{
-			u->already_sent = LocalUser::already_sent_id;
-			if (i->second)
-				u->Write(line);
+			u->already_sent = include ? seen_id : silent_id;
+			if (include)
+				return u;
 		}
 	}
-	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
+
+	/* Then everyone else on the channels */
+	while (chanit != chans->end())
 	{
-		Channel* c = *v;
-		const UserMembList* ulist = c->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const LocalMembList& members = (*chanit)->GetLocalMembers();
+		while (membidx < members.size())
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && !u->quitting && u->already_sent != LocalUser::already_sent_id)
+			LocalUser* u = static_cast<LocalUser*>(members[membidx++]->user);
+			if (!u->quitting && u->already_sent != seen_id && u->already_sent != silent_id)
 			{
-				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				u->already_sent = seen_id;
+				return u;
 			}
 		}
+
+		++chanit;
+		membidx = 0;
 	}
+	return NULL;
+}
+
+void User::WriteCommonRaw(const std::string &line, bool include_self)
+{
+	if (this->registered != REG_ALL || quitting)
+		return;
+
+	reference<SendQBuffer> out = LocalUser::PrepareLine(line);
+
+	NeighborIterator neighbors(this, include_self);
+	while (LocalUser* u = neighbors.Next())
+		u->Write(out);
 }
 
 void User::WriteCommonQuit(const std::string &normal_text, const std::string &oper_text)
@@ -1256,41 +1451,18 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 	if (this->registered != REG_ALL)
 		return;
 
-	already_sent_t uniq_id = ++LocalUser::already_sent_id;
-
 	snprintf(tb1,MAXBUF,":%s QUIT :%s",this->GetFullHost().c_str(),normal_text.c_str());
-	snprintf(tb2,MAXBUF,":%s QUIT :%s",this->GetFullHost().c_str(),oper_text.c_str());
-	std::string out1 = tb1;
-	std::string out2 = tb2;
-
-	UserChanList include_c(chans);
-	std::map<User*,bool> exceptions;
-
-	FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(this, include_c, exceptions));
-
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
-	{
-		LocalUser* u = IS_LOCAL(i->first);
-		if (u && !u->quitting)
-		{
-			u->already_sent = uniq_id;
-			if (i->second)
-				u->Write(IS_OPER(u) ? out2 : out1);
-		}
-	}
-	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
+	reference<SendQBuffer> out1 = LocalUser::PrepareLine(tb1);
+	reference<SendQBuffer> out2 = out1;
+	if (oper_text != normal_text)
 	{
-		const UserMembList* ulist = (*v)->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
-		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && !u->quitting && (u->already_sent != uniq_id))
-			{
-				u->already_sent = uniq_id;
-				u->Write(IS_OPER(u) ? out2 : out1);
-			}
-		}
+		snprintf(tb2,MAXBUF,":%s QUIT :%s",this->GetFullHost().c_str(),oper_text.c_str());
+		out2 = LocalUser::PrepareLine(tb2);
 	}
+
+	NeighborIterator neighbors(this, false);
+	while (LocalUser* u = neighbors.Next())
+		u->Write(IS_OPER(u) ? out2 : out1);
 }
 
 void LocalUser::SendText(const std::string& line)
@@ -1379,6 +1551,7 @@ bool User::ChangeName(const char* gecos)
 		FOREACH_MOD(I_OnChangeName,OnChangeName(this,gecos));
 	}
 	this->fullname.assign(gecos, 0, ServerInstance->Config->Limits.MaxGecos);
+	InvalidateBanCache();
 
 	return true;
 }
@@ -1390,66 +1563,43 @@ void User::DoHostCycle(const std::string &quitline)
 	if (!ServerInstance->Config->CycleHosts)
 		return;
 
-	already_sent_t silent_id = ++LocalUser::already_sent_id;
-	already_sent_t seen_id = ++LocalUser::already_sent_id;
-
-	UserChanList include_c(chans);
-	std::map<User*,bool> exceptions;
-
-	FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(this, include_c, exceptions));
+	reference<SendQBuffer> quitout = LocalUser::PrepareLine(quitline);
 
 	// Users shouldn't see themselves quitting when host cycling
-	exceptions.erase(this);
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
-	{
-		LocalUser* u = IS_LOCAL(i->first);
-		if (u && !u->quitting)
-		{
-			if (i->second)
-			{
-				u->already_sent = seen_id;
-				u->Write(quitline);
-			}
-			else
-			{
-				u->already_sent = silent_id;
-			}
-		}
-	}
-	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
+	NeighborIterator neighbors(this, false);
+	while (LocalUser* u = neighbors.Next())
+		u->Write(quitout);
+
+	// Everyone who saw the quit now sees the user rejoin each of the common channels
+	const UserChanList& include_c = neighbors.GetChannels();
+	for (UserChanList::const_iterator v = include_c.begin(); v != include_c.end(); ++v)
 	{
 		Channel* c = *v;
 		snprintf(buffer, MAXBUF, ":%s JOIN %s", GetFullHost().c_str(), c->name.c_str());
-		std::string joinline(buffer);
+		reference<SendQBuffer> joinout = LocalUser::PrepareLine(buffer);
 		Membership* memb = c->GetUser(this);
-		std::string modeline = memb->modes;
-		if (modeline.length() > 0)
+		reference<SendQBuffer> modeout;
+		if (memb->modes.length() > 0)
 		{
+			std::string modeline = memb->modes;
 			for(unsigned int i=0; i < memb->modes.length(); i++)
 				modeline.append(" ").append(nick);
 			snprintf(buffer, MAXBUF, ":%s MODE %s +%s",
 				ServerInstance->Config->CycleHostsFromUser ? GetFullHost().c_str() : ServerInstance->Config->ServerName.c_str(),
 				c->name.c_str(), modeline.c_str());
-			modeline = buffer;
+			modeout = LocalUser::PrepareLine(buffer);
 		}
 
-		const UserMembList *ulist = c->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const LocalMembList& members = c->GetLocalMembers();
+		for (LocalMembList::const_iterator i = members.begin(); i != members.end(); ++i)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u == NULL || u == this)
-				continue;
-			if (u->already_sent == silent_id)
+			LocalUser* u = static_cast<LocalUser*>((*i)->user);
+			if (!neighbors.WasVisited(u))
 				continue;
 
-			if (u->already_sent != seen_id)
-			{
-				u->Write(quitline);
-				u->already_sent = seen_id;
-			}
-			u->Write(joinline);
-			if (modeline.length() > 0)
-				u->Write(modeline);
+			u->Write(joinout);
+			if (modeout)
+				u->Write(modeout);
 		}
 	}
 }
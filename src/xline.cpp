@@ -126,9 +126,9 @@ class ZLineFactory : public XLineFactory
  *  All lines are (as in v1) stored together -- no seperation of perm and non-perm. They are stored in
  *  a map of maps (first map is line type, second map is for quick lookup on add/delete/etc).
  *
- *  Expiry is *no longer* performed on a timer, and no longer uses a sorted list of any variety. This
- *  is now done by only checking for expiry when a line is accessed, meaning that expiry is no longer
- *  a resource intensive problem.
+ *  Expiry is done by a once a second timer, which pops lines off a heap ordered by expiry time. This
+ *  means lines are removed (and the expiry snotice sent) when they expire rather than whenever they
+ *  are next looked at, and looking up a line never has to change the containers.
  *
  *  Application no longer tries to apply every single line on every single user - instead, now only lines
  *  added since the previous application are applied. This keeps S2S ADDLINE during burst nice and fast,
@@ -141,6 +141,125 @@ bool XLine::Matches(User *u)
 	return false;
 }
 
+/** Expires X-lines each second
+ */
+class XLineExpiryTimer : public Timer
+{
+ public:
+	XLineExpiryTimer(time_t now) : Timer(1, now, true) { }
+
+	void Tick(time_t TIME)
+	{
+		ServerInstance->XLines->ExpireLines(TIME);
+	}
+};
+
+/** Checks the lines found by an XLineIndex against a user or string. Lines
+ * which expired since the expiry timer last ran are skipped, not expired.
+ */
+template<typename T>
+struct LineMatcher
+{
+	T target;
+	const time_t now;
+	XLine* found;
+
+	LineMatcher(T t) : target(t), now(ServerInstance->Time()), found(NULL) { }
+
+	bool operator()(XLine* line)
+	{
+		if (line->duration && now > line->expiry)
+			return false;
+		if (!line->Matches(target))
+			return false;
+		found = line;
+		return true;
+	}
+};
+
+typedef LineMatcher<User*> UserLineMatcher;
+typedef LineMatcher<const std::string&> PatternLineMatcher;
+
+/** Collects every line found by an XLineIndex */
+struct LineCollector
+{
+	std::vector<XLine*>& lines;
+	LineCollector(std::vector<XLine*>& l) : lines(l) { }
+	bool operator()(XLine* line)
+	{
+		lines.push_back(line);
+		return false;
+	}
+};
+
+/** Work out where an XLineIndex keeps a line
+ * @param line The line
+ * @param mask Set to the line's index mask
+ * @param fields Set to the line's index fields
+ * @param cidr Set to the CIDR range of the mask, if it has one
+ * @return False if the line has to be tested every time, true if it goes in
+ * the exact hash; cidr.type is AF_INET or AF_INET6 if it also goes in the trie
+ */
+static bool GetIndexPlace(XLine* line, const std::string*& mask, int& fields, irc::sockets::cidr_mask& cidr)
+{
+	fields = 0;
+	cidr.type = 0;
+	mask = line->GetIndexMask(fields);
+	if (!mask || !fields || mask->find_first_of("*?") != std::string::npos)
+		return false;
+
+	// MatchCIDR ignores anything up to an '@' in the mask. A well formed mask
+	// which isn't a valid address matches any host which isn't one either, so
+	// the line can't be looked up by host.
+	if ((fields & (XLine::INDEX_HOST | XLine::INDEX_IP)) && irc::sockets::ParseCIDR(mask->substr(mask->rfind('@') + 1), cidr))
+		return (cidr.type == AF_INET || cidr.type == AF_INET6);
+
+	return true;
+}
+
+void XLineIndex::Add(XLine* line)
+{
+	const std::string* mask;
+	int linefields;
+	irc::sockets::cidr_mask cidr;
+	if (!GetIndexPlace(line, mask, linefields, cidr))
+	{
+		residual.insert(line);
+		return;
+	}
+
+	exact[*mask].push_back(line);
+	fields |= linefields;
+	if (!(linefields & XLine::INDEX_PATTERN))
+		unpatterned++;
+	cidrs.add(cidr, line);
+}
+
+void XLineIndex::Remove(XLine* line)
+{
+	const std::string* mask;
+	int linefields;
+	irc::sockets::cidr_mask cidr;
+	if (!GetIndexPlace(line, mask, linefields, cidr))
+	{
+		residual.erase(line);
+		return;
+	}
+
+	ExactMap::iterator i = exact.find(*mask);
+	if (i == exact.end())
+		return;
+	std::vector<XLine*>::iterator j = std::find(i->second.begin(), i->second.end(), line);
+	if (j == i->second.end())
+		return;
+	i->second.erase(j);
+	if (i->second.empty())
+		exact.erase(i);
+	if (!(linefields & XLine::INDEX_PATTERN))
+		unpatterned--;
+	cidrs.remove(cidr, line);
+}
+
 /*
  * Checks what users match a given vector of ELines and sets their ban exempt flag accordingly.
  */
@@ -156,25 +275,12 @@ void XLineManager::CheckELines()
 	if (ELines.empty())
 		return;
 
+	XLineIndex* index = line_indexes[n->first];
 	for (LocalUserList::const_iterator u2 = ServerInstance->Users->local_users.begin(); u2 != ServerInstance->Users->local_users.end(); u2++)
 	{
 		User* u = (User*)(*u2);
-		u->exempt = false;
-
-		/* This uses safe iteration to ensure that if a line expires here, it doenst trash the iterator */
-		LookupIter safei;
-
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
-		{
-			safei = i;
-			safei++;
-
-			XLine *e = i->second;
-			if ((!e->duration || ServerInstance->Time() < e->expiry) && e->Matches(u))
-				u->exempt = true;
-
-			i = safei;
-		}
+		UserLineMatcher matcher(u);
+		u->exempt = index->Walk(u, matcher);
 	}
 }
 
@@ -186,21 +292,6 @@ XLineLookup* XLineManager::GetAll(const std::string &type)
 	if (n == lookup_lines.end())
 		return NULL;
 
-	LookupIter safei;
-	const time_t current = ServerInstance->Time();
-
-	/* Expire any dead ones, before sending */
-	for (LookupIter x = n->second.begin(); x != n->second.end(); )
-	{
-		safei = x;
-		safei++;
-		if (x->second->duration && current > x->second->expiry)
-		{
-			ExpireLine(n, x);
-		}
-		x = safei;
-	}
-
 	return &(n->second);
 }
 
@@ -284,6 +375,12 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable()] = line;
+	XLineIndex*& index = line_indexes[line->type];
+	if (!index)
+		index = new XLineIndex;
+	index->Add(line);
+	if (line->duration)
+		HeapPush(line);
 	line->OnAdd();
 
 	FOREACH_MOD(I_OnAddLine,OnAddLine(user, line));
@@ -318,6 +415,8 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	line_indexes[type]->Remove(y->second);
+	HeapRemove(y->second);
 	delete y->second;
 	x->second.erase(y);
 
@@ -339,31 +438,9 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 	if (x == lookup_lines.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
-
-	LookupIter safei;
-
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
-	{
-		safei = i;
-		safei++;
-
-		if (i->second->duration && current > i->second->expiry)
-		{
-			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
-			continue;
-		}
-
-		if (i->second->Matches(user))
-		{
-			return i->second;
-		}
-
-		i = safei;
-	}
-	return NULL;
+	UserLineMatcher matcher(user);
+	line_indexes[type]->Walk(user, matcher);
+	return matcher.found;
 }
 
 XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
@@ -373,30 +450,19 @@ XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pat
 	if (x == lookup_lines.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
-
-	 LookupIter safei;
-
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	XLineIndex* index = line_indexes[type];
+	if (index->CanWalkPattern())
 	{
-		safei = i;
-		safei++;
-
-		if (i->second->Matches(pattern))
-		{
-			if (i->second->duration && current > i->second->expiry)
-			{
-				/* Expire the line, return nothing */
-				ExpireLine(x, i);
-				/* See above */
-				i = safei;
-				continue;
-			}
-			else
-				return i->second;
-		}
+		PatternLineMatcher matcher(pattern);
+		index->Walk(pattern, matcher);
+		return matcher.found;
+	}
 
-		i = safei;
+	PatternLineMatcher matcher(pattern);
+	for (LookupIter i = x->second.begin(); i != x->second.end(); ++i)
+	{
+		if (matcher(i->second))
+			return i->second;
 	}
 	return NULL;
 }
@@ -417,14 +483,112 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	line_indexes[container->first]->Remove(item->second);
+	HeapRemove(item->second);
 	delete item->second;
 	container->second.erase(item);
 }
 
+void XLineManager::ExpireLines(time_t now)
+{
+	while (!expiry_heap.empty() && now > expiry_heap[0]->expiry)
+	{
+		XLine* line = expiry_heap[0];
+		ContainerIter x = lookup_lines.find(line->type);
+		LookupIter i = x->second.find(line->Displayable());
+		if (i != x->second.end() && i->second == line)
+			ExpireLine(x, i);
+		else
+			HeapRemove(line);
+	}
+}
+
+void XLineManager::HeapSwap(size_t a, size_t b)
+{
+	std::swap(expiry_heap[a], expiry_heap[b]);
+	expiry_heap[a]->heappos = a;
+	expiry_heap[b]->heappos = b;
+}
+
+void XLineManager::HeapUp(size_t pos)
+{
+	while (pos)
+	{
+		size_t parent = (pos - 1) / 2;
+		if (expiry_heap[parent]->expiry <= expiry_heap[pos]->expiry)
+			break;
+		HeapSwap(pos, parent);
+		pos = parent;
+	}
+}
+
+void XLineManager::HeapDown(size_t pos)
+{
+	for (;;)
+	{
+		size_t least = pos;
+		size_t left = pos * 2 + 1;
+		size_t right = left + 1;
+		if (left < expiry_heap.size() && expiry_heap[left]->expiry < expiry_heap[least]->expiry)
+			least = left;
+		if (right < expiry_heap.size() && expiry_heap[right]->expiry < expiry_heap[least]->expiry)
+			least = right;
+		if (least == pos)
+			break;
+		HeapSwap(pos, least);
+		pos = least;
+	}
+}
+
+void XLineManager::HeapPush(XLine* line)
+{
+	line->heappos = expiry_heap.size();
+	expiry_heap.push_back(line);
+	HeapUp(line->heappos);
+}
+
+void XLineManager::HeapRemove(XLine* line)
+{
+	size_t pos = line->heappos;
+	if (pos >= expiry_heap.size() || expiry_heap[pos] != line)
+		return;
+
+	line->heappos = std::string::npos;
+	size_t last = expiry_heap.size() - 1;
+	if (pos != last)
+	{
+		XLine* moved = expiry_heap[last];
+		expiry_heap[pos] = moved;
+		moved->heappos = pos;
+		expiry_heap.pop_back();
+		HeapUp(pos);
+		HeapDown(moved->heappos);
+	}
+	else
+		expiry_heap.pop_back();
+}
+
 
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
 {
+	if (pending_lines.empty())
+		return;
+
+	// Index the pending lines so that each user is only tested against the
+	// few that might match them, rather than every line added by a burst
+	XLineIndex pending;
+	std::map<XLine*, size_t> position;
+	for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+	{
+		pending.Add(*i);
+		position.insert(std::make_pair(*i, i - pending_lines.begin()));
+	}
+
+	std::vector<XLine*> candidates;
+	LineCollector collector(candidates);
+	std::vector<std::pair<size_t, XLine*> > ordered;
+
 	LocalUserList::reverse_iterator u2 = ServerInstance->Users->local_users.rbegin();
 	while (u2 != ServerInstance->Users->local_users.rend())
 	{
@@ -434,9 +598,19 @@ void XLineManager::ApplyLines()
 		if (u->exempt)
 			continue;
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		candidates.clear();
+		pending.Walk(u, collector);
+
+		// Apply them in the order they were added, as which one gets to quit the user matters
+		ordered.clear();
+		for (std::vector<XLine *>::iterator i = candidates.begin(); i != candidates.end(); i++)
+			ordered.push_back(std::make_pair(position[*i], *i));
+		std::sort(ordered.begin(), ordered.end());
+		ordered.erase(std::unique(ordered.begin(), ordered.end()), ordered.end());
+
+		for (std::vector<std::pair<size_t, XLine*> >::iterator i = ordered.begin(); i != ordered.end(); i++)
 		{
-			XLine *x = *i;
+			XLine *x = i->second;
 			if (x->Matches(u))
 				x->Apply(u);
 		}
@@ -449,26 +623,18 @@ void XLineManager::InvokeStats(const std::string &type, int numeric, User* user,
 {
 	ContainerIter n = lookup_lines.find(type);
 
-	time_t current = ServerInstance->Time();
-
-	LookupIter safei;
-
 	if (n != lookup_lines.end())
 	{
+		const time_t current = ServerInstance->Time();
 		XLineLookup& list = n->second;
-		for (LookupIter i = list.begin(); i != list.end(); )
+		for (LookupIter i = list.begin(); i != list.end(); ++i)
 		{
-			safei = i;
-			safei++;
-
+			// Expired, but the expiry timer hasn't run yet this second
 			if (i->second->duration && current > i->second->expiry)
-			{
-				ExpireLine(n, i);
-			}
-			else
-				results.push_back(ServerInstance->Config->ServerName+" "+ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
-					ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
-			i = safei;
+				continue;
+
+			results.push_back(ServerInstance->Config->ServerName+" "+ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
+				ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
 		}
 	}
 }
@@ -494,10 +660,15 @@ XLineManager::XLineManager()
 	RegisterFactory(KFact);
 	RegisterFactory(QFact);
 	RegisterFactory(ZFact);
+
+	expirytimer = new XLineExpiryTimer(ServerInstance->Time());
+	ServerInstance->Timers->AddTimer(expirytimer);
 }
 
 XLineManager::~XLineManager()
 {
+	ServerInstance->Timers->DelTimer(expirytimer);
+
 	const char gekqz[] = "GEKQZ";
 	for(unsigned int i=0; i < sizeof(gekqz); i++)
 	{
@@ -513,6 +684,9 @@ XLineManager::~XLineManager()
 			delete j->second;
 		}
 	}
+
+	for (std::map<std::string, XLineIndex*>::iterator i = line_indexes.begin(); i != line_indexes.end(); ++i)
+		delete i->second;
 }
 
 void XLine::Apply(User* u)
@@ -541,9 +715,9 @@ void XLine::DefaultApply(User* u, const std::string &line, bool bancache)
 	{
 		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCache: Adding positive hit (" + line + ") for " + u->GetIPString());
 		if (this->duration > 0)
-			ServerInstance->BanCache->AddHit(u->GetIPString(), this->type, line + "-Lined: " + this->reason, (this->expiry - ServerInstance->Time()));
+			ServerInstance->BanCache->AddHit(u->client_sa, this->type, line + "-Lined: " + this->reason, (this->expiry - ServerInstance->Time()));
 		else
-			ServerInstance->BanCache->AddHit(u->GetIPString(), this->type, line + "-Lined: " + this->reason);
+			ServerInstance->BanCache->AddHit(u->client_sa, this->type, line + "-Lined: " + this->reason);
 	}
 }
 
@@ -734,6 +908,36 @@ const char* QLine::Displayable()
 	return nick.c_str();
 }
 
+const std::string* ELine::GetIndexMask(int& fields)
+{
+	fields = INDEX_HOST | INDEX_IP;
+	return &hostmask;
+}
+
+const std::string* KLine::GetIndexMask(int& fields)
+{
+	fields = INDEX_HOST | INDEX_IP;
+	return &hostmask;
+}
+
+const std::string* GLine::GetIndexMask(int& fields)
+{
+	fields = INDEX_HOST | INDEX_IP;
+	return &hostmask;
+}
+
+const std::string* ZLine::GetIndexMask(int& fields)
+{
+	fields = INDEX_IP | INDEX_PATTERN;
+	return &ipaddr;
+}
+
+const std::string* QLine::GetIndexMask(int& fields)
+{
+	fields = INDEX_NICK | INDEX_PATTERN;
+	return &nick;
+}
+
 bool KLine::IsBurstable()
 {
 	return false;